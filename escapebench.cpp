@@ -0,0 +1,206 @@
+/* escapebench, checks and times pluginlogger's JSON string escaper
+ * Copyright 2009 Ian McKellar <http://ian.mckellar.org/>
+ * */
+
+/*  This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Builds pluginlogger.cpp in so it can drive appendEscaped() both ways:
+ * with the AVX2 search and with the byte-at-a-time loop. Run with --check
+ * to compare both against a simple reference escaper on random strings cut
+ * off by random buffer sizes, and with no arguments to also time them on
+ * script, JSON and non-ASCII text. */
+
+#include "pluginlogger.cpp"
+
+#define CHECK_STRINGS 20000
+#define BENCH_SIZE (512*1024)
+#define BENCH_PASSES 200
+
+/* the escaped form of aString a piece at a time, where a piece is a plain
+ * byte, an escape or a whole UTF-8 sequence */
+static std::vector<std::string>
+referencePieces(const std::string& aString) {
+  std::vector<std::string> pieces;
+  for (size_t i = 0; i < aString.size(); ) {
+    unsigned char c = aString[i];
+    char piece[8];
+    if (c == '"' || c == '\\') {
+      snprintf(piece, sizeof(piece), "\\%c", c);
+    } else if (c == '\n') {
+      strcpy(piece, "\\n");
+    } else if (c == '\r') {
+      strcpy(piece, "\\r");
+    } else if (c == '\t') {
+      strcpy(piece, "\\t");
+    } else if (c == '\b') {
+      strcpy(piece, "\\b");
+    } else if (c == '\f') {
+      strcpy(piece, "\\f");
+    } else if (c < 0x20) {
+      snprintf(piece, sizeof(piece), "\\u%04x", c);
+    } else if (c < 0x80) {
+      piece[0] = c;
+      piece[1] = '\0';
+    } else {
+      // decode by hand and check the code point, rather than reuse the
+      // byte ranges utf8Sequence() checks
+      size_t length = c >= 0xf0 ? 4 : (c >= 0xe0 ? 3 : (c >= 0xc0 ? 2 : 1));
+      uint32_t code = length == 4 ? c & 0x07 : (length == 3 ? c & 0x0f :
+          c & 0x1f);
+      bool valid = length > 1 && i + length <= aString.size();
+      for (size_t j = 1; valid && j < length; j++) {
+        unsigned char next = aString[i + j];
+        valid = (next & 0xc0) == 0x80;
+        code = (code << 6) | (next & 0x3f);
+      }
+      uint32_t least = length == 2 ? 0x80 : (length == 3 ? 0x800 : 0x10000);
+      valid = valid && code >= least && code <= 0x10ffff &&
+        (code < 0xd800 || code > 0xdfff);
+      if (valid) {
+        pieces.push_back(aString.substr(i, length));
+        i += length;
+      } else {
+        pieces.push_back("\\ufffd");
+        i++;
+      }
+      continue;
+    }
+    pieces.push_back(piece);
+    i++;
+  }
+  return pieces;
+}
+
+/* as much of the escaped string as fits in aSpace bytes */
+static std::string
+reference(const std::string& aString, size_t aSpace) {
+  std::vector<std::string> pieces = referencePieces(aString);
+  std::string escaped;
+  for (size_t i = 0; i < pieces.size(); i++) {
+    if (escaped.size() + pieces[i].size() > aSpace) break;
+    escaped += pieces[i];
+  }
+  return escaped;
+}
+
+static std::string
+escape(const std::string& aString, size_t aSpace, bool aAVX2) {
+  gEscapeWithAVX2 = aAVX2;
+  std::vector<char> buffer(aSpace + 1);
+  SafeWriter writer(&buffer[0], aSpace);
+  appendEscaped(writer, aString.data(), aString.size());
+  return std::string(&buffer[0], writer.length());
+}
+
+static std::string
+randomString(unsigned* aSeed) {
+  static const char* const pieces[] = {
+    "a", "Z", " ", "{", "\"", "\\", "\n", "\t", "\x01", "\x1f", "\x7f",
+    "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80", // é € 😀
+    "\xc0\xaf", "\xe0\x80\xaf", "\xed\xa0\x80", "\xf4\x90\x80\x80", // invalid
+    "\x80", "\xbf", "\xc3", "\xe2\x82", "\xf0\x9f\x98", "\xff", "\xfe",
+  };
+  size_t count = sizeof(pieces) / sizeof(pieces[0]);
+  std::string string;
+  size_t length = rand_r(aSeed) % 200;
+  while (string.size() < length) {
+    // long plain runs too, to exercise the vector search
+    if (rand_r(aSeed) % 4 == 0) {
+      string.append(rand_r(aSeed) % 80, 'x');
+    } else {
+      string += pieces[rand_r(aSeed) % count];
+    }
+  }
+  return string;
+}
+
+static int
+check(bool aAVX2) {
+  unsigned seed = 1;
+  int failures = 0;
+  for (int n = 0; n < CHECK_STRINGS; n++) {
+    std::string string = randomString(&seed);
+    size_t space = rand_r(&seed) % 2 ? string.size() * 6 :
+      rand_r(&seed) % (string.size() * 2 + 1);
+    std::string expected = reference(string, space);
+    std::string got = escape(string, space, false);
+    if (got != expected) {
+      fprintf(stderr, "byte loop differs on string %d (space %u)\n", n,
+          (unsigned)space);
+      failures++;
+    }
+    if (aAVX2 && escape(string, space, true) != expected) {
+      fprintf(stderr, "AVX2 search differs on string %d (space %u)\n", n,
+          (unsigned)space);
+      failures++;
+    }
+  }
+  printf("%d strings checked against the reference (%s), %d failures\n",
+      CHECK_STRINGS, aAVX2 ? "byte loop and AVX2" : "byte loop only",
+      failures);
+  return failures;
+}
+
+static double
+megabytesPerSecond(const std::string& aInput, bool aAVX2) {
+  std::vector<char> buffer(aInput.size() * 6);
+  gEscapeWithAVX2 = aAVX2;
+  uint64_t start = monotonicNanos();
+  for (int pass = 0; pass < BENCH_PASSES; pass++) {
+    SafeWriter writer(&buffer[0], buffer.size());
+    appendEscaped(writer, aInput.data(), aInput.size());
+    __asm__ __volatile__("" : : "r"(&buffer[0]) : "memory");
+  }
+  double seconds = (monotonicNanos() - start) / 1e9;
+  return aInput.size() * (double)BENCH_PASSES / seconds / 1e6;
+}
+
+static std::string
+repeat(const char* aText) {
+  std::string input;
+  while (input.size() < BENCH_SIZE) input += aText;
+  return input;
+}
+
+int
+main(int argc, char** argv) {
+  bool avx2 = escapeWithAVX2();
+  int failures = check(avx2);
+  if (argc > 1 && strcmp(argv[1], "--check") == 0) {
+    return failures ? 1 : 0;
+  }
+
+  struct {
+    const char* name;
+    std::string input;
+  } inputs[] = {
+    { "script", repeat("function onLoad(player) { player.setVolume(50); "
+        "return player.getState(); }\n") },
+    { "JSON", repeat("{\"a\":1,\"b\":[\"x\",\"y\"],\"c\":\"\\u00e9\"}") },
+    { "non-ASCII", repeat("Gr\xc3\xbc\xc3\x9f" "e aus M\xc3\xbcnchen, "
+        "\xe2\x82\xac" "5 ") },
+  };
+  printf("\n%-12s %12s %12s\n", "MB/s", "byte loop", "AVX2 search");
+  for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+    printf("%-12s %12.0f", inputs[i].name,
+        megabytesPerSecond(inputs[i].input, false));
+    if (avx2) {
+      printf(" %12.0f\n", megabytesPerSecond(inputs[i].input, true));
+    } else {
+      printf(" %12s\n", "-");
+    }
+  }
+  return failures ? 1 : 0;
+}
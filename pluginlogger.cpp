@@ -18,15 +18,34 @@
 
 
 /* system headers for useful things */
+#include <ctype.h>
 #include <dlfcn.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
 
 /* everyone loves the STL */
+#include <algorithm>
 #include <map>
+#include <set>
 #include <string>
+#include <vector>
 
 /* load the npapi headers */
 #include "nptypes.h"
@@ -34,7 +53,9 @@
 #include "npfunctions.h"
 #include "npruntime.h"
 
-#define MIN(A,B) (A<B?A:B)
+#include "pluginstats.h"
+
+#define MIN(A,B) ((A)<(B)?(A):(B))
 
 /* types for plugin functions */
 typedef NPError (*NP_Initialize_Func)(NPNetscapeFuncs*, NPPluginFuncs*);
@@ -55,303 +76,4589 @@ bool gInitialized = false;
 
 static NPNetscapeFuncs* gBrowserFuncs = NULL; // browser functions
 static NPNetscapeFuncs* gWrappedBrowserFuncs = NULL; // wrapped browser functions
-static NPPluginFuncs* gPluginFuncs = NULL; // plugin functions
 
-static void* gPlugin = NULL;
-static ExportedPluginFunctions gExportedPluginFunctions = { NULL };
+/* the plugins to wrap, separated by colons */
+#ifndef PLUGINS
+#define PLUGINS PLUGIN
+#endif
+
+/* what a plugin tells the browser about itself before it's initialized */
+typedef struct {
+  std::string key; // path, mtime and size, tab separated
+  std::string version;
+  std::string name;
+  std::string description;
+  std::string mimeDescription;
+} PluginInfo;
+
+/* what starting up a plugin cost us, in nanoseconds */
+typedef struct {
+  bool infoFromCache;
+  uint64_t dlopen;
+  uint64_t dlsym;
+  uint64_t initialize;
+} StartupTimes;
+
+/* every function we log, for the trace mask and call statistics */
+typedef enum {
+  FN_pluginlogger, // our own messages
+  FN_NPClass_allocate,
+  FN_NPClass_deallocate,
+  FN_NPClass_invalidate,
+  FN_NPClass_hasMethod,
+  FN_NPClass_invoke,
+  FN_NPClass_invokeDefault,
+  FN_NPClass_hasProperty,
+  FN_NPClass_getProperty,
+  FN_NPClass_setProperty,
+  FN_NPClass_removeProperty,
+  FN_NPClass_enumerate,
+  FN_NPClass_construct,
+  FN_NPN_GetValue,
+  FN_NPN_SetValue,
+  FN_NPN_GetURLNotify,
+  FN_NPN_PostURLNotify,
+  FN_NPN_GetURL,
+  FN_NPN_PostURL,
+  FN_NPN_RequestRead,
+  FN_NPN_NewStream,
+  FN_NPN_Write,
+  FN_NPN_DestroyStream,
+  FN_NPN_Status,
+  FN_NPN_UserAgent,
+  FN_NPN_MemAlloc,
+  FN_NPN_MemFree,
+  FN_NPN_MemFlush,
+  FN_NPN_ReloadPlugins,
+  FN_NPN_GetJavaEnv,
+  FN_NPN_GetJavaPeer,
+  FN_NPN_InvalidateRect,
+  FN_NPN_InvalidateRegion,
+  FN_NPN_ForceRedraw,
+  FN_NPN_GetStringIdentifier,
+  FN_NPN_GetStringIdentifiers,
+  FN_NPN_GetIntIdentifier,
+  FN_NPN_IdentifierIsString,
+  FN_NPN_UTF8FromIdentifier,
+  FN_NPN_IntFromIdentifier,
+  FN_NPN_CreateObject,
+  FN_NPN_RetainObject,
+  FN_NPN_ReleaseObject,
+  FN_NPN_Invoke,
+  FN_NPN_InvokeDefault,
+  FN_NPN_Evaluate,
+  FN_NPN_GetProperty,
+  FN_NPN_SetProperty,
+  FN_NPN_RemoveProperty,
+  FN_NPN_HasProperty,
+  FN_NPN_HasMethod,
+  FN_NPN_ReleaseVariantValue,
+  FN_NPN_SetException,
+  FN_NPN_PushPopupsEnabledState,
+  FN_NPN_PopPopupsEnabledState,
+  FN_NPN_Enumerate,
+  FN_NPN_PluginThreadAsyncCall,
+  FN_NPN_Construct,
+  FN_NPN_GetValueForURL,
+  FN_NPN_SetValueForURL,
+  FN_NPN_GetAuthenticationInfo,
+  FN_NPN_ScheduleTimer,
+  FN_NPN_UnscheduleTimer,
+  FN_NPN_PopUpContextMenu,
+  FN_NPN_ConvertPoint,
+  FN_NPP_New,
+  FN_NPP_Destroy,
+  FN_NPP_SetWindow,
+  FN_NPP_NewStream,
+  FN_NPP_DestroyStream,
+  FN_NPP_StreamAsFile,
+  FN_NPP_WriteReady,
+  FN_NPP_Write,
+  FN_NPP_Print,
+  FN_NPP_HandleEvent,
+  FN_NPP_URLNotify,
+  FN_NPP_GetValue,
+  FN_NPP_SetValue,
+  FN_NP_EXPORT,
+  FN_NP_Initialize,
+  FN_NP_GetPluginVersion,
+  FN_NP_GetMIMEDescription,
+  FN_NP_GetValue,
+  FN_NP_Shutdown,
+  FN_COUNT
+} FunctionId;
+
+/* helper to get the printable name of a FunctionId */
+static const char*
+FunctionName(FunctionId aFunction) {
+  switch (aFunction) {
+    case FN_pluginlogger: return "pluginlogger"; break;
+    case FN_NPClass_allocate: return "NPClass.allocate"; break;
+    case FN_NPClass_deallocate: return "NPClass.deallocate"; break;
+    case FN_NPClass_invalidate: return "NPClass.invalidate"; break;
+    case FN_NPClass_hasMethod: return "NPClass.hasMethod"; break;
+    case FN_NPClass_invoke: return "NPClass.invoke"; break;
+    case FN_NPClass_invokeDefault: return "NPClass.invokeDefault"; break;
+    case FN_NPClass_hasProperty: return "NPClass.hasProperty"; break;
+    case FN_NPClass_getProperty: return "NPClass.getProperty"; break;
+    case FN_NPClass_setProperty: return "NPClass.setProperty"; break;
+    case FN_NPClass_removeProperty: return "NPClass.removeProperty"; break;
+    case FN_NPClass_enumerate: return "NPClass.enumerate"; break;
+    case FN_NPClass_construct: return "NPClass.construct"; break;
+    case FN_NPN_GetValue: return "NPN_GetValue"; break;
+    case FN_NPN_SetValue: return "NPN_SetValue"; break;
+    case FN_NPN_GetURLNotify: return "NPN_GetURLNotify"; break;
+    case FN_NPN_PostURLNotify: return "NPN_PostURLNotify"; break;
+    case FN_NPN_GetURL: return "NPN_GetURL"; break;
+    case FN_NPN_PostURL: return "NPN_PostURL"; break;
+    case FN_NPN_RequestRead: return "NPN_RequestRead"; break;
+    case FN_NPN_NewStream: return "NPN_NewStream"; break;
+    case FN_NPN_Write: return "NPN_Write"; break;
+    case FN_NPN_DestroyStream: return "NPN_DestroyStream"; break;
+    case FN_NPN_Status: return "NPN_Status"; break;
+    case FN_NPN_UserAgent: return "NPN_UserAgent"; break;
+    case FN_NPN_MemAlloc: return "NPN_MemAlloc"; break;
+    case FN_NPN_MemFree: return "NPN_MemFree"; break;
+    case FN_NPN_MemFlush: return "NPN_MemFlush"; break;
+    case FN_NPN_ReloadPlugins: return "NPN_ReloadPlugins"; break;
+    case FN_NPN_GetJavaEnv: return "NPN_GetJavaEnv"; break;
+    case FN_NPN_GetJavaPeer: return "NPN_GetJavaPeer"; break;
+    case FN_NPN_InvalidateRect: return "NPN_InvalidateRect"; break;
+    case FN_NPN_InvalidateRegion: return "NPN_InvalidateRegion"; break;
+    case FN_NPN_ForceRedraw: return "NPN_ForceRedraw"; break;
+    case FN_NPN_GetStringIdentifier: return "NPN_GetStringIdentifier"; break;
+    case FN_NPN_GetStringIdentifiers: return "NPN_GetStringIdentifiers"; break;
+    case FN_NPN_GetIntIdentifier: return "NPN_GetIntIdentifier"; break;
+    case FN_NPN_IdentifierIsString: return "NPN_IdentifierIsString"; break;
+    case FN_NPN_UTF8FromIdentifier: return "NPN_UTF8FromIdentifier"; break;
+    case FN_NPN_IntFromIdentifier: return "NPN_IntFromIdentifier"; break;
+    case FN_NPN_CreateObject: return "NPN_CreateObject"; break;
+    case FN_NPN_RetainObject: return "NPN_RetainObject"; break;
+    case FN_NPN_ReleaseObject: return "NPN_ReleaseObject"; break;
+    case FN_NPN_Invoke: return "NPN_Invoke"; break;
+    case FN_NPN_InvokeDefault: return "NPN_InvokeDefault"; break;
+    case FN_NPN_Evaluate: return "NPN_Evaluate"; break;
+    case FN_NPN_GetProperty: return "NPN_GetProperty"; break;
+    case FN_NPN_SetProperty: return "NPN_SetProperty"; break;
+    case FN_NPN_RemoveProperty: return "NPN_RemoveProperty"; break;
+    case FN_NPN_HasProperty: return "NPN_HasProperty"; break;
+    case FN_NPN_HasMethod: return "NPN_HasMethod"; break;
+    case FN_NPN_ReleaseVariantValue: return "NPN_ReleaseVariantValue"; break;
+    case FN_NPN_SetException: return "NPN_SetException"; break;
+    case FN_NPN_PushPopupsEnabledState: return "NPN_PushPopupsEnabledState"; break;
+    case FN_NPN_PopPopupsEnabledState: return "NPN_PopPopupsEnabledState"; break;
+    case FN_NPN_Enumerate: return "NPN_Enumerate"; break;
+    case FN_NPN_PluginThreadAsyncCall: return "NPN_PluginThreadAsyncCall"; break;
+    case FN_NPN_Construct: return "NPN_Construct"; break;
+    case FN_NPN_GetValueForURL: return "NPN_GetValueForURL"; break;
+    case FN_NPN_SetValueForURL: return "NPN_SetValueForURL"; break;
+    case FN_NPN_GetAuthenticationInfo: return "NPN_GetAuthenticationInfo"; break;
+    case FN_NPN_ScheduleTimer: return "NPN_ScheduleTimer"; break;
+    case FN_NPN_UnscheduleTimer: return "NPN_UnscheduleTimer"; break;
+    case FN_NPN_PopUpContextMenu: return "NPN_PopUpContextMenu"; break;
+    case FN_NPN_ConvertPoint: return "NPN_ConvertPoint"; break;
+    case FN_NPP_New: return "NPP_New"; break;
+    case FN_NPP_Destroy: return "NPP_Destroy"; break;
+    case FN_NPP_SetWindow: return "NPP_SetWindow"; break;
+    case FN_NPP_NewStream: return "NPP_NewStream"; break;
+    case FN_NPP_DestroyStream: return "NPP_DestroyStream"; break;
+    case FN_NPP_StreamAsFile: return "NPP_StreamAsFile"; break;
+    case FN_NPP_WriteReady: return "NPP_WriteReady"; break;
+    case FN_NPP_Write: return "NPP_Write"; break;
+    case FN_NPP_Print: return "NPP_Print"; break;
+    case FN_NPP_HandleEvent: return "NPP_HandleEvent"; break;
+    case FN_NPP_URLNotify: return "NPP_URLNotify"; break;
+    case FN_NPP_GetValue: return "NPP_GetValue"; break;
+    case FN_NPP_SetValue: return "NPP_SetValue"; break;
+    case FN_NP_EXPORT: return "NP_EXPORT"; break;
+    case FN_NP_Initialize: return "NP_Initialize"; break;
+    case FN_NP_GetPluginVersion: return "NP_GetPluginVersion"; break;
+    case FN_NP_GetMIMEDescription: return "NP_GetMIMEDescription"; break;
+    case FN_NP_GetValue: return "NP_GetValue"; break;
+    case FN_NP_Shutdown: return "NP_Shutdown"; break;
+    case FN_COUNT: break;
+  }
+  return "(unknown function)";
+}
+
+/* Log output is batched. Each thread formats its lines into its own large
+ * buffer, which is written to the log file with a single write() when it
+ * fills up, when LOG_FLUSH_INTERVAL milliseconds have passed since it was
+ * last written, when the thread exits, at NP_Shutdown and when the plugin
+ * is unloaded. Any thread that logs also writes out other threads' buffers
+ * that have gone stale, so an idle thread's lines aren't held until
+ * shutdown. A buffer is only touched while holding its lock, which its own
+ * thread takes for each line it adds. If the process crashes, the crash
+ * handler writes out whatever is still pending before passing the signal
+ * on. */
+#ifndef LOG_BUFFER_SIZE
+#define LOG_BUFFER_SIZE (256*1024)
+#endif
+#ifndef LOG_FLUSH_INTERVAL
+#define LOG_FLUSH_INTERVAL 1000
+#endif
+
+/* In flight recorder mode nothing is written while the browser runs. The
+ * most recent RECORDER_SIZE log lines are kept in memory as binary records
+ * (the format string and its raw arguments) and only formatted and written
+ * to the log file if we crash, at NP_Shutdown, or when SNAPSHOT_SIGNAL is
+ * received. Build with -DLOGMODE=LOGMODE_RECORDER to use it. */
+/* In JSON mode (-DLOGMODE=LOGMODE_JSON) each call is written as a single
+ * line holding a JSON object with its serial number, thread, start time,
+ * function, arguments, return value and duration. */
+/* With -DLOGMODE=LOGMODE_NONE nothing is logged or even formatted and the
+ * log file is never opened, leaving the USDT probes and the stats segment
+ * as the only ways to see what the plugin is doing. */
+#define LOGMODE_NONE 0
+#define LOGMODE_TEXT 1
+#define LOGMODE_RECORDER 2
+#define LOGMODE_JSON 3
+#ifndef LOGMODE
+#define LOGMODE LOGMODE_TEXT
+#endif
+#ifndef RECORDER_SIZE
+#define RECORDER_SIZE 8192
+#endif
+
+/* Tracing can be turned on and off while the browser is running by sending
+ * TRACE_SIGNAL. If CONTROLFILE exists, the signal runs the commands in it
+ * instead of just toggling:
+ *   on, off, toggle  - enable or disable tracing
+ *   +NAME, -NAME     - trace or stop tracing a function, eg: -NPN_MemAlloc
+ *                      NAME may end in * to match a prefix, eg: -NPClass.*
+ *   snapshot         - write the call counts and object table to the log
+ * CONTROLFILE is also read at startup, and TRACE_INITIALLY=0 starts with
+ * tracing turned off. SNAPSHOT_SIGNAL writes a snapshot on demand. */
+#ifndef TRACE_SIGNAL
+#define TRACE_SIGNAL SIGUSR1
+#endif
+#ifndef SNAPSHOT_SIGNAL
+#define SNAPSHOT_SIGNAL SIGUSR2
+#endif
+#ifndef CONTROLFILE
+#define CONTROLFILE LOGFILE ".control"
+#endif
+#ifndef TRACE_INITIALLY
+#define TRACE_INITIALLY 1
+#endif
+
+static const int gLogMode = LOGMODE;
+
+/* Which functions are traced. The hot path only ever reads its word of
+ * gMask, which is the configured mask while tracing is on and empty while
+ * it's off. Each word keeps its top bit for TRACE_PENDING: when a signal
+ * arrives it's set in every word so that the next call takes the slow
+ * path and handles the request outside of the signal handler. */
+#define TRACE_WORD_BITS 63
+#define TRACE_PENDING (1ULL << TRACE_WORD_BITS)
+#define TRACE_MASK_WORDS ((FN_COUNT + TRACE_WORD_BITS - 1) / TRACE_WORD_BITS)
+#define TRACE_WORD(f) ((f) / TRACE_WORD_BITS)
+#define TRACE_BIT(f) (1ULL << ((f) % TRACE_WORD_BITS))
+#define CONTROL_TOGGLE 1
+#define CONTROL_COMMANDS 2
+#define CONTROL_SNAPSHOT 4
+class TraceControl {
+  private:
+    static uint64_t gMask[TRACE_MASK_WORDS];
+    static uint64_t gConfiguredMask[TRACE_MASK_WORDS];
+    static bool gTracing;
+    static int gPending;
+    /* held while pending requests are dealt with, which is the only time
+     * gTracing and gConfiguredMask change after initialize() */
+    static pthread_mutex_t gLock;
+    static void apply();
+    static void setFunctions(const char* aPattern, size_t aLength, bool aOn);
+    static bool runCommands();
+    static bool slowPath(FunctionId aFunction);
+    static void handleSignal(int aSignal, void (*aHandler)(int));
+  public:
+    static void initialize();
+    static void request(int aRequest);
+    static inline bool enabled(FunctionId aFunction) {
+      uint64_t mask = __atomic_load_n(&gMask[TRACE_WORD(aFunction)],
+          __ATOMIC_RELAXED);
+      if ((mask & (TRACE_PENDING | TRACE_BIT(aFunction))) ==
+          TRACE_BIT(aFunction)) {
+        return true;
+      }
+      return (mask & TRACE_PENDING) && slowPath(aFunction);
+    }
+    static bool tracing() { return gTracing; }
+};
+uint64_t TraceControl::gMask[TRACE_MASK_WORDS];
+uint64_t TraceControl::gConfiguredMask[TRACE_MASK_WORDS];
+bool TraceControl::gTracing = TRACE_INITIALLY;
+int TraceControl::gPending = 0;
+pthread_mutex_t TraceControl::gLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* per-function call counts, for snapshots */
+class FunctionStats {
+  private:
+    static uint64_t gCalls[FN_COUNT];
+  public:
+    static void count(FunctionId aFunction) {
+      __atomic_add_fetch(&gCalls[aFunction], 1, __ATOMIC_RELAXED);
+    }
+    static uint64_t calls(FunctionId aFunction) { return gCalls[aFunction]; }
+};
+uint64_t FunctionStats::gCalls[FN_COUNT];
+
+/* Build with -DSTATS_SEGMENT=1 to keep the number of calls and time spent
+ * in every function, traced or not, along with each instance's stream,
+ * paint and timer counts, in a segment under /dev/shm laid out as in
+ * pluginstats.h. Run plugintop to watch them as the browser runs. */
+#ifndef STATS_SEGMENT
+#define STATS_SEGMENT 0
+#endif
+class LiveStats {
+  private:
+    static PluginStatsSegment* gSegment;
+    static char gPath[64];
+    static inline void add(uint64_t* aCounter, uint64_t aValue) {
+      __atomic_add_fetch(aCounter, aValue, __ATOMIC_RELAXED);
+    }
+    /* CLOCK_MONOTONIC itself, which plugintop compares times with, rather
+     * than our TSC-based version of it */
+    static uint64_t systemNanos() {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+  public:
+    static void create();
+    static void destroy();
+    static inline void called(FunctionId aFunction, uint64_t aNanos) {
+      if (gSegment == NULL) return;
+      PluginStatsFunction& function = gSegment->functions[aFunction];
+      add(&function.calls, 1);
+      add(&function.nanos, aNanos);
+      uint64_t max = __atomic_load_n(&function.maxNanos, __ATOMIC_RELAXED);
+      while (aNanos > max && !__atomic_compare_exchange_n(&function.maxNanos,
+            &max, aNanos, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      }
+    }
+    /* a slot for a new instance, or NULL if they're all taken - call on
+     * the main thread */
+    static PluginStatsInstance* claim(NPP aNPP, const char* aType);
+    static void release(PluginStatsInstance* aInstance) {
+      if (aInstance) __atomic_store_n(&aInstance->id, 0, __ATOMIC_RELEASE);
+    }
+    static inline void count(PluginStatsInstance* aInstance,
+        uint64_t PluginStatsInstance::*aCounter, uint64_t aValue = 1) {
+      if (aInstance) add(&(aInstance->*aCounter), aValue);
+    }
+    static inline void wrote(PluginStatsInstance* aInstance, uint64_t aBytes) {
+      if (gSegment == NULL) return;
+      add(&gSegment->streamBytes, aBytes);
+      count(aInstance, &PluginStatsInstance::streamBytes, aBytes);
+    }
+    static inline void asyncCalls(int aWaiting) {
+      if (gSegment == NULL) return;
+      __atomic_store_n(&gSegment->asyncCallsWaiting, (uint64_t)aWaiting,
+          __ATOMIC_RELAXED);
+    }
+};
+PluginStatsSegment* LiveStats::gSegment = NULL;
+char LiveStats::gPath[64];
+
+/* Every wrapped call fires the USDT probes pluginlogger:entry and
+ * pluginlogger:return, traced or not, with the function's name, its
+ * FunctionId and the NPP, NPObject or NPStream it's about (the browser's
+ * NPP for NPN calls). entry's fourth argument is the call with its
+ * arguments as the text log writes it, like the URL or the identifier.
+ * return's fourth is the return value, for those that are numbers,
+ * booleans or pointers (an NPError is only named in the text), and its
+ * fifth the return line as text, eg:
+ *   bpftrace -e 'usdt:pluginlogger.so:pluginlogger:entry
+ *     { printf("%s\n", str(arg3)); }'
+ *   bpftrace -e 'usdt:pluginlogger.so:pluginlogger:return
+ *     /str(arg0) == "NPP_Write"/ { @bytes = sum(arg3); }'
+ * entry fires once the wrapper has its arguments, just before it passes
+ * the call on. Until a tracer attaches each probe is a single nop, behind a
+ * test of the probe's semaphore, which tracers set while they're
+ * attached, so nothing is worked out for nobody. They need sys/sdt.h
+ * (from systemtap's sdt development package) and are left out without
+ * it, or when built with -DUSDT_PROBES=0. */
+#ifndef USDT_PROBES
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define USDT_PROBES 1
+#endif
+#endif
+#endif
+#ifndef USDT_PROBES
+#define USDT_PROBES 0
+#endif
+#if USDT_PROBES
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+__extension__ unsigned short pluginlogger_entry_semaphore
+  __attribute__((unused)) __attribute__((section(".probes")));
+__extension__ unsigned short pluginlogger_return_semaphore
+  __attribute__((unused)) __attribute__((section(".probes")));
+#define PROBE_ENABLED(name) __builtin_expect(*(volatile unsigned short*) \
+    &pluginlogger_##name##_semaphore, 0)
+#else
+#define DTRACE_PROBE3(provider, name, arg1, arg2, arg3) do { } while (0)
+#define DTRACE_PROBE4(provider, name, arg1, arg2, arg3, arg4) \
+  do { } while (0)
+#define DTRACE_PROBE5(provider, name, arg1, arg2, arg3, arg4, arg5) \
+  do { } while (0)
+#define PROBE_ENABLED(name) 0
+#endif
+#define PROBE_TEXT_SIZE 256
+
+class LogBuffer {
+  private:
+    static LogBuffer* gBuffers; // every buffer ever allocated
+    static pthread_key_t gKey;
+    static pthread_once_t gKeyOnce;
+    static __thread LogBuffer* tBuffer;
+    static uint64_t gLastSweep;
+    LogBuffer* mNext;
+    int mInUse;
+    int mLocked;
+    uint64_t mLastFlush;
+    static void createKey();
+    static void threadExit(void* aBuffer);
+    bool tryLock() { return __sync_lock_test_and_set(&mLocked, 1) == 0; }
+    /* write out other threads' buffers that have gone stale */
+    static void sweep(uint64_t aNow);
+  public:
+    size_t mLength;
+    char mData[LOG_BUFFER_SIZE];
+    /* JSON mode: the fields and the text of the calls in progress on this
+     * thread, as stacks since calls nest */
+    char* mScratch;
+    size_t mScratchTop;
+    char* mText;
+    size_t mTextTop;
+
+    /* the calling thread's buffer */
+    static LogBuffer* get() {
+      if (tBuffer == NULL) {
+        tBuffer = claim();
+      }
+      return tBuffer;
+    }
+    static LogBuffer* claim();
+    /* Write out every thread's buffer. With aInSignal this is
+     * async-signal-safe: it never waits, and buffers that are being
+     * written to are written out as they stand but not emptied. */
+    static void flushAll(bool aInSignal);
+    /* only the buffer's own thread adds to it */
+    void lock() {
+      while (!tryLock()) sched_yield();
+    }
+    void unlock() { __sync_lock_release(&mLocked); }
+    /* write out and empty the buffer - call with it locked */
+    void flushLocked();
+    void flush() {
+      lock();
+      flushLocked();
+      unlock();
+    }
+    /* add a whole line, flushing first if it doesn't fit */
+    void append(const char* aLine, size_t aLength);
+    void flushIfStale(uint64_t aNow) {
+      if (aNow - mLastFlush >= LOG_FLUSH_INTERVAL) {
+        flush();
+      }
+      if (aNow - gLastSweep >= LOG_FLUSH_INTERVAL) {
+        sweep(aNow);
+      }
+    }
+};
+uint64_t LogBuffer::gLastSweep = 0;
+LogBuffer* LogBuffer::gBuffers = NULL;
+pthread_key_t LogBuffer::gKey;
+pthread_once_t LogBuffer::gKeyOnce = PTHREAD_ONCE_INIT;
+__thread LogBuffer* LogBuffer::tBuffer = NULL;
+
+static uint64_t monotonicNanos();
+
+/* Calls into and out of the plugin happen on the browser's main thread,
+ * which can't do anything else (like paint the page) until they return.
+ * Build with -DSTALL_THRESHOLD_MS=N to log every call on the main thread
+ * that takes N milliseconds or more, along with the calls it was made
+ * inside of, and flush the log straight away. The calls' arguments are
+ * kept for this whether or not they're traced. Build with
+ * -DSTALL_WATCHDOG_MS=M as well to start a watchdog thread that sends the
+ * main thread STALL_SIGNAL once a call has been running for M milliseconds
+ * so it writes its stack to the log. */
+#ifndef STALL_THRESHOLD_MS
+#define STALL_THRESHOLD_MS 0
+#endif
+#ifndef STALL_WATCHDOG_MS
+#define STALL_WATCHDOG_MS 0
+#endif
+#ifndef STALL_SIGNAL
+#define STALL_SIGNAL SIGURG
+#endif
+#define STALL_MAX_DEPTH 32
+#define STALL_STACK_FRAMES 64
+#define STALL_CALL_SIZE 512
+class LogLine;
+class Stalls {
+  private:
+    typedef struct {
+      FunctionId mFunction;
+      int mSerialNumber;
+      uint64_t mStart;
+    } Frame;
+    static __thread bool tMainThread;
+    static __thread int tDepth;
+    static __thread Frame tFrames[STALL_MAX_DEPTH];
+    /* each frame's call line with its arguments - only the main thread
+     * uses these, so they don't need to be thread-local */
+    static char gArguments[STALL_MAX_DEPTH][STALL_CALL_SIZE];
+    static pthread_t gMainThread;
+    /* when the main thread's outermost call started, or 0 if there isn't
+     * one, and how many there have been - for the watchdog */
+    static uint64_t gCallStart;
+    static unsigned gCalls;
+    static void report(const Frame& aFrame, uint64_t aNanos);
+    static void* watchdog(void* aUnused);
+    static void stackSignalHandler(int aSignal);
+  public:
+    /* call on the main thread */
+    static void initialize();
+    /* whether calls on this thread are watched */
+    static inline bool watching() { return tMainThread; }
+    static inline void enter(FunctionId aFunction, int aSerialNumber) {
+      if (!tMainThread) return;
+      uint64_t now = monotonicNanos();
+      if (tDepth < STALL_MAX_DEPTH) {
+        Frame& frame = tFrames[tDepth];
+        frame.mFunction = aFunction;
+        frame.mSerialNumber = aSerialNumber;
+        frame.mStart = now;
+        gArguments[tDepth][0] = '\0';
+      }
+      if (tDepth++ == 0 && STALL_WATCHDOG_MS) {
+        __atomic_add_fetch(&gCalls, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&gCallStart, now, __ATOMIC_RELEASE);
+      }
+    }
+    static inline void leave() {
+      // calls that started before initialize() weren't entered
+      if (!tMainThread || tDepth == 0) return;
+      if (--tDepth == 0 && STALL_WATCHDOG_MS) {
+        __atomic_store_n(&gCallStart, 0, __ATOMIC_RELEASE);
+      }
+      if (tDepth < STALL_MAX_DEPTH) {
+        uint64_t nanos = monotonicNanos() - tFrames[tDepth].mStart;
+        if (nanos >= STALL_THRESHOLD_MS * 1000000ULL) {
+          report(tFrames[tDepth], nanos);
+        }
+      }
+    }
+    /* keep the innermost call's call line for its report */
+    static void called(const LogLine& aLine);
+};
+__thread bool Stalls::tMainThread = false;
+__thread int Stalls::tDepth = 0;
+__thread Stalls::Frame Stalls::tFrames[STALL_MAX_DEPTH];
+char Stalls::gArguments[STALL_MAX_DEPTH][STALL_CALL_SIZE];
+pthread_t Stalls::gMainThread;
+uint64_t Stalls::gCallStart = 0;
+unsigned Stalls::gCalls = 0;
 
 class Log {
   private:
-    static FILE* gLogFile;
+    static int gLogFile;
     static int gSerialNumber;
+    static pthread_once_t gOpenOnce;
+    bool mEnabled;
+    /* whether the call line is wanted anyway, for a stall report */
+    bool mWatched;
+    /* whether a tracer is attached to the probes, which get the lines */
+    bool mProbed;
+#if USDT_PROBES
+    int64_t mProbeReturn;
+    char mProbeText[PROBE_TEXT_SIZE]; // the return line
+#endif
     int mSerialNumber;
+    FunctionId mFunction;
+    const void* mSubject; // what the call is about, for the probes
+    /* when the call started, for JSON mode and the stats segment, and in
+     * JSON mode where its fields and text start on the thread's scratch
+     * stacks and which of LINE_CALL and LINE_RETURN it has had */
+    uint64_t mStart;
+    size_t mJSONStart;
+    size_t mJSONTextStart;
+    int mJSONLines;
+    static void open();
+    /* count the call for snapshots, traced or not, and say whether it's
+     * traced */
+    static inline bool traced(FunctionId aFunction) {
+      FunctionStats::count(aFunction);
+      return aFunction == FN_pluginlogger ||
+        TraceControl::enabled(aFunction);
+    }
+    void startJSON();
+    void json(const char* aFormat, va_list aArgs);
+    void json(const LogLine& aLine);
+    void jsonText(const char* aText, size_t aLength);
+    void finishJSON();
+    void text(const LogLine& aLine);
+    friend class LogLine;
+    void line(const LogLine& aLine);
+    void probe(const LogLine& aLine);
   public:
-    Log() : mSerialNumber(++gSerialNumber) {
-      if (gLogFile == NULL) {
-        gLogFile = fopen(LOGFILE, "w");
+    Log(FunctionId aFunction, const void* aSubject = NULL)
+        : mEnabled(gLogMode != LOGMODE_NONE && traced(aFunction)),
+          mWatched(STALL_THRESHOLD_MS && aFunction != FN_pluginlogger &&
+            Stalls::watching()),
+          mProbed(aFunction != FN_pluginlogger &&
+            (PROBE_ENABLED(entry) || PROBE_ENABLED(return))),
+          mSerialNumber(0), mFunction(aFunction), mSubject(aSubject) {
+#if USDT_PROBES
+      if (mProbed) {
+        mProbeReturn = 0;
+        mProbeText[0] = '\0';
+      }
+#endif
+      if (mEnabled || mWatched) {
+        mSerialNumber = __sync_add_and_fetch(&gSerialNumber, 1);
+      }
+      if (mEnabled) {
+        pthread_once(&gOpenOnce, open);
+        if (gLogMode == LOGMODE_JSON) {
+          startJSON();
+        }
+      }
+      if (STALL_THRESHOLD_MS && aFunction != FN_pluginlogger) {
+        Stalls::enter(aFunction, mSerialNumber);
+      }
+      if (STATS_SEGMENT && aFunction != FN_pluginlogger) {
+        mStart = monotonicNanos();
       }
     }
+    ~Log() {
+      if (gLogMode == LOGMODE_JSON && mEnabled) {
+        finishJSON();
+      }
+      if (STALL_THRESHOLD_MS && mFunction != FN_pluginlogger) {
+        Stalls::leave();
+      }
+      if (STATS_SEGMENT && mFunction != FN_pluginlogger) {
+        LiveStats::called(mFunction, monotonicNanos() - mStart);
+      }
+#if USDT_PROBES
+      if (mProbed && PROBE_ENABLED(return)) {
+        // leave out the text log's indent
+        DTRACE_PROBE5(pluginlogger, return, FunctionName(mFunction),
+            (int)mFunction, mSubject, mProbeReturn,
+            mProbeText + (mProbeText[0] == ' '));
+      }
+#endif
+    }
+    /* callers check this before logging so that disabled functions don't
+     * pay for formatting their arguments */
+    operator bool() const { return mEnabled || mWatched || mProbed; }
+    /* whether the call goes in the log, for reports and timing that
+     * should only cover traced calls */
+    bool traced() const { return mEnabled; }
+    FunctionId function() const { return mFunction; }
+    /* free text, like a report */
     void operator()(const char* format, ...)
       __attribute__((__format__ (__printf__, 2, 3)));
+    /* the fields of a line about the call, see LogLine */
+    inline LogLine call();
+    inline LogLine returned();
+    inline LogLine values();
+    static void write(const char* aData, size_t aLength);
+    /* write out everything pending - this is async-signal-safe */
+    static void flush(const char* aReason, bool aInSignal = false);
 };
-FILE* Log::gLogFile = NULL;
+int Log::gLogFile = -1;
 int Log::gSerialNumber = 0;
-
-void
-Log::operator()(const char* format, ...) {
-  fprintf(gLogFile, "[%05d] ", mSerialNumber);
-  va_list argp;
-  va_start(argp, format);
-  vfprintf(gLogFile, format, argp);
-  va_end(argp);
-  fflush(gLogFile);
+pthread_once_t Log::gOpenOnce = PTHREAD_ONCE_INIT;
+
+/* milliseconds on the monotonic clock, for deciding when to flush */
+static uint64_t
+monotonicMillis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
+/* The clock log lines are stamped and calls are timed with. It's always
+ * nanoseconds on CLOCK_MONOTONIC, but once calibrated against it it's read
+ * from the TSC, which costs a fraction of even the vDSO's clock_gettime.
+ * Build with -DUSE_TSC=0 to always use clock_gettime, which is also what
+ * happens before calibration and on machines without an invariant TSC.
+ * Nothing waits for calibration: start() notes the TSC and the time, and
+ * the first call TSC_CALIBRATION_NANOS or more later works out the rate
+ * from those. Every CLOCK_RESYNC_NANOS after that the rate is measured
+ * again and steered so the TSC time meets CLOCK_MONOTONIC by the next
+ * resync, rather than jumping, and the offset to the wall clock is looked
+ * up again. Times are only turned into wall clock times when they're
+ * written out. */
+#ifndef USE_TSC
+#define USE_TSC 1
+#endif
+#ifndef TSC_CALIBRATION_NANOS
+#define TSC_CALIBRATION_NANOS 20000000
+#endif
+#ifndef CLOCK_RESYNC_NANOS
+#define CLOCK_RESYNC_NANOS 1000000000
+#endif
+#define TSC_SHIFT 32
+class Clock {
+  private:
+    /* where the TSC was against CLOCK_MONOTONIC when last synced. There
+     * are two so one can be filled in while the other is read, and a
+     * reader would have to stall for a whole resync to see one change. */
+    typedef struct {
+      uint64_t mTicks;
+      uint64_t mNanos; // what now() says at mTicks
+      uint64_t mSystemNanos; // what clock_gettime said at mTicks
+      uint64_t mMultiplier; // nanoseconds per tick << TSC_SHIFT
+      uint64_t mResyncTicks;
+    } Sync;
+    static int gHaveTSC;
+    static int gCalibrated;
+    static int gSyncing;
+    static int gSync; // which of gSyncs is current
+    static Sync gSyncs[2];
+    static int64_t gWallOffset; // CLOCK_REALTIME - CLOCK_MONOTONIC
+    static uint64_t gWallSynced;
+    static uint64_t systemNanos(clockid_t aClock) {
+      struct timespec ts;
+      clock_gettime(aClock, &ts);
+      return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+    static inline uint64_t fromTicks(const Sync& aSync, uint64_t aTicks) {
+      return aSync.mNanos + (uint64_t)(((unsigned __int128)
+            (aTicks - aSync.mTicks) * aSync.mMultiplier) >> TSC_SHIFT);
+    }
+    static void sync();
+  public:
+    /* note where the TSC is, if it ticks at a constant rate - this doesn't
+     * wait */
+    static void start();
+    static inline uint64_t now() {
+#if USE_TSC && defined(__x86_64__)
+      if (__atomic_load_n(&gCalibrated, __ATOMIC_ACQUIRE)) {
+        const Sync& current = gSyncs[__atomic_load_n(&gSync,
+            __ATOMIC_ACQUIRE)];
+        uint64_t ticks = __rdtsc();
+        if (ticks - current.mTicks >= current.mResyncTicks) {
+          sync();
+        }
+        return fromTicks(current, ticks);
+      }
+      if (gHaveTSC) {
+        uint64_t nanos = systemNanos(CLOCK_MONOTONIC);
+        if (nanos - gSyncs[0].mSystemNanos >= TSC_CALIBRATION_NANOS) {
+          sync();
+        }
+        return nanos;
+      }
+#endif
+      return systemNanos(CLOCK_MONOTONIC);
+    }
+    /* nanoseconds since the epoch for a time from now() - this is
+     * async-signal-safe */
+    static uint64_t wallNanos(uint64_t aTime) {
+      uint64_t synced = __atomic_load_n(&gWallSynced, __ATOMIC_RELAXED);
+      if (synced == 0 || (int64_t)(aTime - synced) >= CLOCK_RESYNC_NANOS) {
+        __atomic_store_n(&gWallOffset, (int64_t)(systemNanos(CLOCK_REALTIME) -
+              systemNanos(CLOCK_MONOTONIC)), __ATOMIC_RELAXED);
+        __atomic_store_n(&gWallSynced, aTime, __ATOMIC_RELAXED);
+      }
+      return aTime + __atomic_load_n(&gWallOffset, __ATOMIC_RELAXED);
+    }
+    /* whether times come, or will once calibrated, from the TSC */
+    static bool usingTSC() { return gHaveTSC; }
+};
+int Clock::gHaveTSC = 0;
+int Clock::gCalibrated = 0;
+int Clock::gSyncing = 0;
+int Clock::gSync = 0;
+Clock::Sync Clock::gSyncs[2];
+int64_t Clock::gWallOffset = 0;
+uint64_t Clock::gWallSynced = 0;
 
-/* helper to print boolean values */
-static const char*
-boolStr(bool aBoolean) {
-  return aBoolean?"true":"false";
+void
+Clock::start() {
+#if USE_TSC && defined(__x86_64__)
+  if (gHaveTSC) return;
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) ||
+      !(edx & (1 << 8))) {
+    return;
+  }
+  Sync& first = gSyncs[0];
+  first.mSystemNanos = systemNanos(CLOCK_MONOTONIC);
+  first.mTicks = __rdtsc();
+  first.mNanos = first.mSystemNanos;
+  __atomic_store_n(&gHaveTSC, 1, __ATOMIC_RELEASE);
+#endif
 }
 
-/* helper to get the value of an NPIdentifier */
-static std::string
-Printable(NPIdentifier& aIdentifier) {
-  if (gBrowserFuncs->identifierisstring(aIdentifier)) {
-    NPUTF8* utf8 = gBrowserFuncs->utf8fromidentifier(aIdentifier);
-    std::string printable("\"");
-    printable.append(utf8);
-    printable.append("\"");
-    gBrowserFuncs->memfree(utf8);
-    return printable;
-  } else {
-    int32_t intvalue = gBrowserFuncs->intfromidentifier(aIdentifier);
-    char buffer[16];
-    snprintf(buffer, 16, "%d", intvalue);
-    return std::string(buffer);
+/* measure the TSC's rate since the last sync, and steer towards
+ * CLOCK_MONOTONIC - this is async-signal-safe */
+void
+Clock::sync() {
+#if USE_TSC && defined(__x86_64__)
+  if (!__sync_bool_compare_and_swap(&gSyncing, 0, 1)) {
+    return; // another thread is at it
+  }
+  int index = gSync;
+  const Sync& last = gSyncs[index];
+  uint64_t system = systemNanos(CLOCK_MONOTONIC);
+  uint64_t ticks = __rdtsc();
+  if (ticks > last.mTicks && system > last.mSystemNanos) {
+    Sync& next = gSyncs[index ^ 1];
+    uint64_t nanos = gCalibrated ? fromTicks(last, ticks) : system;
+    unsigned __int128 rate = ((unsigned __int128)(system -
+          last.mSystemNanos) << TSC_SHIFT) / (ticks - last.mTicks);
+    // make up the difference over the next interval, within reason
+    int64_t error = (int64_t)(system - nanos);
+    if (error > CLOCK_RESYNC_NANOS / 2) error = CLOCK_RESYNC_NANOS / 2;
+    if (error < -CLOCK_RESYNC_NANOS / 2) error = -CLOCK_RESYNC_NANOS / 2;
+    next.mTicks = ticks;
+    next.mNanos = nanos;
+    next.mSystemNanos = system;
+    next.mMultiplier = (uint64_t)(rate * (CLOCK_RESYNC_NANOS + error) /
+        CLOCK_RESYNC_NANOS);
+    if (next.mMultiplier > 0) {
+      next.mResyncTicks = (uint64_t)(((unsigned __int128)CLOCK_RESYNC_NANOS
+            << TSC_SHIFT) / next.mMultiplier);
+      __atomic_store_n(&gSync, index ^ 1, __ATOMIC_RELEASE);
+      __atomic_store_n(&gCalibrated, 1, __ATOMIC_RELEASE);
+    }
   }
+  __sync_lock_release(&gSyncing);
+#endif
 }
 
-/* helper to print the value of an NPString */
-static std::string
-Printable(const NPString* aString) {
-  std::string printable("\"");
-  printable.reserve(aString->UTF8Length + 2);
-  printable.append(aString->UTF8Characters, aString->UTF8Length);
-  printable.append("\"");
-  return printable;
-};
+/* nanoseconds on the monotonic clock, for timing things */
+static uint64_t
+monotonicNanos() {
+  return Clock::now();
+}
+
+void
+LogBuffer::createKey() {
+  pthread_key_create(&gKey, threadExit);
+}
 
-static std::string Printable(const NPObject* aObject);
+void
+LogBuffer::threadExit(void* aBuffer) {
+  LogBuffer* buffer = (LogBuffer*)aBuffer;
+  buffer->flush();
+  // let another thread pick up this buffer
+  __sync_lock_release(&buffer->mInUse);
+}
 
-/* helper to print the value of an NPVariant */
-static std::string
-Printable(const NPVariant& aVariant) {
-  char buffer[32];
-  switch(aVariant.type) {
-    case NPVariantType_Void:
-      return std::string("(void)");
-      break;
-    case NPVariantType_Null:
-      return std::string("(null)");
-      break;
-    case NPVariantType_Bool:
-      return std::string(boolStr(aVariant.value.boolValue));
-      break;
-    case NPVariantType_Int32:
-      snprintf(buffer, 32, "%d", aVariant.value.intValue);
-      return std::string(buffer);
-      break;
-    case NPVariantType_Double:
-      snprintf(buffer, 32, "%lf", aVariant.value.doubleValue);
-      return std::string(buffer);
-      break;
-    case NPVariantType_String:
-      return Printable(&aVariant.value.stringValue);
-      break;
-    case NPVariantType_Object:
-      return Printable(aVariant.value.objectValue);
+LogBuffer*
+LogBuffer::claim() {
+  LogBuffer* buffer;
+  // reuse a buffer left behind by a thread that has exited
+  for (buffer = gBuffers; buffer != NULL; buffer = buffer->mNext) {
+    if (__sync_lock_test_and_set(&buffer->mInUse, 1) == 0) {
       break;
+    }
   }
-  return std::string("(unknown variant type)");
-}
-static std::string
-Printable(const NPVariant* aVariant) {
-  return Printable(*aVariant);
+  if (buffer == NULL) {
+    buffer = (LogBuffer*)malloc(sizeof(LogBuffer));
+    buffer->mInUse = 1;
+    buffer->mLocked = 0;
+    buffer->mLength = 0;
+    buffer->mScratch = NULL;
+    buffer->mScratchTop = 0;
+    buffer->mText = NULL;
+    buffer->mTextTop = 0;
+    buffer->mLastFlush = monotonicMillis();
+    do {
+      buffer->mNext = gBuffers;
+    } while (!__sync_bool_compare_and_swap(&gBuffers, buffer->mNext, buffer));
+  }
+  pthread_once(&gKeyOnce, createKey);
+  pthread_setspecific(gKey, buffer);
+  return buffer;
 }
 
-/* helper to print a list of variants - useful for collecting argument lists */
-static std::string
-Printable(const NPVariant* aVariants, uint32_t aCount, bool aParens=false) {
-  std::string variants;
-  if (aParens) {
-    variants.append("(");
+void
+LogBuffer::flushLocked() {
+  if (mLength > 0) {
+    Log::write(mData, mLength);
+    mLength = 0;
   }
-  for (uint32_t i=0; i<aCount; i++) {
-    if (i>0) {
-      variants.append(", ");
-    }
-    variants.append(Printable(aVariants[i]).c_str());
+  mLastFlush = monotonicMillis();
+}
+
+void
+LogBuffer::append(const char* aLine, size_t aLength) {
+  lock();
+  if (mLength + aLength > LOG_BUFFER_SIZE) {
+    flushLocked();
   }
-  if (aParens) {
-    variants.append(")");
+  if (aLength > LOG_BUFFER_SIZE) {
+    Log::write(aLine, aLength);
+  } else {
+    memcpy(mData + mLength, aLine, aLength);
+    mLength += aLength;
   }
-  return variants;
+  unlock();
 }
 
-/* helper to get the printable name of an NPNVariable */
-const char*
-NPNVariableName(NPNVariable variable) {
-  switch (variable) {
-    case NPNVxDisplay: return "NPNVxDisplay"; break;
-    case NPNVxtAppContext: return "NPNVxtAppContext"; break;
-    case NPNVnetscapeWindow: return "NPNVnetscapeWindow"; break;
-    case NPNVjavascriptEnabledBool: return "NPNVjavascriptEnabledBool"; break;
-    case NPNVasdEnabledBool: return "NPNVasdEnabledBool"; break;
-    case NPNVisOfflineBool: return "NPNVisOfflineBool"; break;
-    case NPNVserviceManager: return "NPNVserviceManager"; break;
-    case NPNVDOMElement: return "NPNVDOMElement"; break;
-    case NPNVDOMWindow: return "NPNVDOMWindow"; break;
-    case NPNVToolkit: return "NPNVToolkit"; break;
-    case NPNVSupportsXEmbedBool: return "NPNVSupportsXEmbedBool"; break;
-    case NPNVWindowNPObject: return "NPNVWindowNPObject"; break;
-    case NPNVPluginElementNPObject: return "NPNVPluginElementNPObject"; break;
-    case NPNVSupportsWindowless: return "NPNVSupportsWindowless"; break;
-    case NPNVprivateModeBool: return "NPNVprivateModeBool"; break;
+void
+LogBuffer::sweep(uint64_t aNow) {
+  uint64_t last = gLastSweep;
+  if (!__sync_bool_compare_and_swap(&gLastSweep, last, aNow)) {
+    return; // another thread is sweeping
+  }
+  for (LogBuffer* buffer = gBuffers; buffer != NULL; buffer = buffer->mNext) {
+    if (buffer == tBuffer || !buffer->tryLock()) continue;
+    if (aNow - buffer->mLastFlush >= LOG_FLUSH_INTERVAL) {
+      buffer->flushLocked();
+    }
+    buffer->unlock();
   }
-  return "(unknown NPNVariable)";
 }
 
-/* helper to get the printable name of an NPPVariable */
-const char*
-NPPVariableName(NPPVariable variable) {
-  switch (variable) {
-    case NPPVpluginNameString: return "NPPVpluginNameString"; break;
-    case NPPVpluginDescriptionString: return "NPPVpluginDescriptionString"; break;
-    case NPPVpluginWindowBool: return "NPPVpluginWindowBool"; break;
-    case NPPVpluginTransparentBool: return "NPPVpluginTransparentBool"; break;
-    case NPPVjavaClass: return "NPPVjavaClass"; break;
-    case NPPVpluginWindowSize: return "NPPVpluginWindowSize"; break;
-    case NPPVpluginTimerInterval: return "NPPVpluginTimerInterval"; break;
-    case NPPVpluginScriptableInstance: return "NPPVpluginScriptableInstance"; break;
-    case NPPVpluginScriptableIID: return "NPPVpluginScriptableIID"; break;
-    case NPPVjavascriptPushCallerBool: return "NPPVjavascriptPushCallerBool"; break;
-    case NPPVpluginKeepLibraryInMemory: return "NPPVpluginKeepLibraryInMemory"; break;
-    case NPPVpluginNeedsXEmbed        : return "NPPVpluginNeedsXEmbed"; break;
-    case NPPVpluginScriptableNPObject : return "NPPVpluginScriptableNPObject"; break;
-    case NPPVformValue: return "NPPVformValue"; break;
-    case NPPVpluginUrlRequestsDisplayedBool: return "NPPVpluginUrlRequestsDisplayedBool"; break;
-    case NPPVpluginWantsAllNetworkStreams: return "NPPVpluginWantsAllNetworkStreams"; break;
+void
+LogBuffer::flushAll(bool aInSignal) {
+  for (LogBuffer* buffer = gBuffers; buffer != NULL; buffer = buffer->mNext) {
+    if (buffer->tryLock()) {
+      buffer->flushLocked();
+      buffer->unlock();
+    } else if (aInSignal) {
+      // we may have interrupted its thread mid-line, so leave it be but
+      // get out the lines that are complete
+      Log::write(buffer->mData, buffer->mLength);
+    } else if (buffer != tBuffer) {
+      buffer->flush();
+    }
   }
-  return "(unknown NPPVariable)";
 }
 
-/* helper to get the printable name of an NPError */
-const char*
-NPErrorName(NPError e) {
-  switch(e) {
-    case NPERR_NO_ERROR: return "NO_ERROR"; break;
-    case NPERR_GENERIC_ERROR: return "GENERIC_ERROR"; break;
-    case NPERR_INVALID_INSTANCE_ERROR: return "INVALID_INSTANCE_ERROR"; break;
-    case NPERR_INVALID_FUNCTABLE_ERROR: return "INVALID_FUNCTABLE_ERROR"; break;
-    case NPERR_MODULE_LOAD_FAILED_ERROR: return "MODULE_LOAD_FAILED_ERROR"; break;
-    case NPERR_OUT_OF_MEMORY_ERROR: return "OUT_OF_MEMORY_ERROR"; break;
-    case NPERR_INVALID_PLUGIN_ERROR: return "INVALID_PLUGIN_ERROR"; break;
-    case NPERR_INVALID_PLUGIN_DIR_ERROR: return "INVALID_PLUGIN_DIR_ERROR"; break;
-    case NPERR_INCOMPATIBLE_VERSION_ERROR: return "INCOMPATIBLE_VERSION_ERROR"; break;
-    case NPERR_INVALID_PARAM: return "INVALID_PARAM"; break;
-    case NPERR_INVALID_URL: return "INVALID_URL"; break;
-    case NPERR_FILE_NOT_FOUND: return "FILE_NOT_FOUND"; break;
-    case NPERR_NO_DATA: return "NO_DATA"; break;
-    case NPERR_STREAM_NOT_SEEKABLE: return "STREAM_NOT_SEEKABLE"; break;
+/* A printf conversion, as found by nextConversion(). Only the subset of
+ * printf that the wrappers actually use is understood. */
+typedef struct {
+  const char* start; // the '%'
+  const char* end; // just past the conversion character
+  char conversion;
+  char length; // 'l' for long / double, 'L' for long long, or 0
+  bool zeroPad;
+  bool leftAlign;
+  int width;
+} Conversion;
+
+/* find the next conversion in aFormat, skipping "%%" */
+static bool
+nextConversion(const char* aFormat, Conversion* aConversion) {
+  for (const char* p = strchr(aFormat, '%'); p != NULL; p = strchr(p, '%')) {
+    aConversion->start = p++;
+    if (*p == '%') {
+      p++;
+      continue;
+    }
+    aConversion->zeroPad = false;
+    aConversion->leftAlign = false;
+    for (;; p++) {
+      if (*p == '0') aConversion->zeroPad = true;
+      else if (*p == '-') aConversion->leftAlign = true;
+      else if (*p != '+' && *p != ' ' && *p != '#') break;
+    }
+    aConversion->width = 0;
+    while (*p >= '0' && *p <= '9') {
+      aConversion->width = aConversion->width * 10 + (*p++ - '0');
+    }
+    aConversion->length = 0;
+    for (; *p == 'l' || *p == 'h' || *p == 'z'; p++) {
+      if (*p == 'z' || aConversion->length == 'l') {
+        aConversion->length = 'L';
+      } else if (*p == 'l') {
+        aConversion->length = 'l';
+      }
+    }
+    aConversion->conversion = *p;
+    aConversion->end = *p ? p + 1 : p;
+    return true;
   }
-  return "UNKNOWN NPError";
+  return false;
 }
 
-/* NPObject and NPClass tracking */
-typedef enum {
-  ORIGIN_UNKNOWN,
-  ORIGIN_BROWSER,
-  ORIGIN_PLUGIN,
-} NPObjectOrigin;
-class NPObjectTracker {
+/* An async-signal-safe output buffer, used to format records from the
+ * crash handler where snprintf isn't allowed. */
+class SafeWriter {
   private:
-    typedef std::map<const NPObject*,NPObjectTracker*> NPObjectMap;
-    static NPObjectMap byObject;
-    const NPObject* mObject;
-    NPObjectOrigin mOrigin;
-    std::string mPath;
-    std::string mPrintable;
-    NPObjectTracker(const NPObject* aObject, NPObjectOrigin aOrigin,
-        std::string aPath)
-        : mObject(aObject), mOrigin(aOrigin), mPath(aPath) {
-      updatePrintable();
-    }
-    void updatePrintable() {
-      char ptr[64];
-      snprintf(ptr, 64, "%p", mObject);
-      std::string printable = std::string(mOrigin==ORIGIN_BROWSER?"B":
-            (mOrigin==ORIGIN_PLUGIN?"P":"?"));
-      printable.append(ptr);
-      printable.append(":");
-      printable.append(mPath);
-      mPrintable.assign(printable);
+    char* mBuffer;
+    size_t mSize;
+    size_t mLength;
+  public:
+    SafeWriter(char* aBuffer, size_t aSize)
+      : mBuffer(aBuffer), mSize(aSize), mLength(0) { }
+    size_t length() const { return mLength; }
+    /* for code that fills the buffer itself: where to write and how much
+     * room is left, then how much was written */
+    char* tail(size_t* aSpace) {
+      *aSpace = mSize - mLength;
+      return mBuffer + mLength;
     }
-    void setOrigin(NPObjectOrigin aOrigin){
-      mOrigin = aOrigin;
-      updatePrintable();
+    void advance(size_t aLength) { mLength += aLength; }
+    void append(char aChar) {
+      if (mLength < mSize) mBuffer[mLength++] = aChar;
     }
-  public:
-    static NPObjectTracker* getTracker(const NPObject* aObject,
-        NPObjectOrigin aOrigin = ORIGIN_UNKNOWN, std::string aPath="") {
-      NPObjectMap::iterator i = byObject.find(aObject);
-      if (i == byObject.end()) {
-        NPObjectTracker* tracker = new NPObjectTracker(aObject, aOrigin, aPath);
-        byObject[aObject] = tracker;
-        return tracker;
+    void append(const char* aString, size_t aLength) {
+      size_t length = MIN(aLength, mSize - mLength);
+      memcpy(mBuffer + mLength, aString, length);
+      mLength += length;
+    }
+    void append(const char* aString) {
+      append(aString, strlen(aString));
+    }
+    /* literal text from a format string, where %% means % */
+    void appendFormatText(const char* aText, size_t aLength) {
+      for (size_t i = 0; i < aLength; i++) {
+        append(aText[i]);
+        if (aText[i] == '%' && i + 1 < aLength && aText[i + 1] == '%') i++;
       }
-      NPObjectTracker* tracker = byObject[aObject];
-      if (tracker->mOrigin == ORIGIN_UNKNOWN && aOrigin != ORIGIN_UNKNOWN) {
-        tracker->mOrigin = aOrigin;
+    }
+    void pad(size_t aLength, const Conversion& aConversion) {
+      for (size_t i = aLength; i < (size_t)aConversion.width; i++) {
+        append(aConversion.zeroPad && !aConversion.leftAlign ? '0' : ' ');
       }
-      return tracker;
     }
-    static const char* c_str(NPObject* aObject) {
-      return getTracker(aObject)->c_str();
+    void appendNumber(uint64_t aValue, unsigned aBase, bool aNegative,
+        const Conversion& aConversion) {
+      char digits[24];
+      size_t n = 0;
+      do {
+        digits[n++] = "0123456789abcdef"[aValue % aBase];
+        aValue /= aBase;
+      } while (aValue != 0);
+      if (aNegative) digits[n++] = '-';
+      if (!aConversion.leftAlign) pad(n, aConversion);
+      while (n > 0) append(digits[--n]);
+      if (aConversion.leftAlign) pad(n, aConversion);
     }
-    const NPObject* getObject() const { return mObject; }
-    const char* c_str() const { return mPrintable.c_str(); }
-
-    NPObjectTracker* trackChild(NPObject* aChildObject,
-        std::string aRelationship) {
-      return getTracker(aChildObject, mOrigin, mPath + aRelationship);
+    void appendDouble(double aValue) {
+      if (aValue != aValue) {
+        append("nan");
+        return;
+      }
+      if (aValue < 0) {
+        append('-');
+        aValue = -aValue;
+      }
+      if (aValue > __DBL_MAX__) {
+        append("inf");
+        return;
+      }
+      // too big for the whole part to fit in 64 bits, so use %e's form
+      int exponent = -1;
+      if (aValue >= 1e18) {
+        exponent = 0;
+        while (aValue >= 10) {
+          aValue /= 10;
+          exponent++;
+        }
+      }
+      uint64_t whole = (uint64_t)aValue;
+      uint64_t fraction = (uint64_t)((aValue - whole) * 1e6 + 0.5);
+      if (fraction >= 1000000) {
+        whole++;
+        fraction -= 1000000;
+      }
+      if (exponent >= 0 && whole >= 10) {
+        whole = 1;
+        exponent++;
+      }
+      Conversion six = { NULL, NULL, 'd', 0, true, false, 6 };
+      Conversion two = { NULL, NULL, 'd', 0, true, false, 2 };
+      Conversion none = { NULL, NULL, 'd', 0, false, false, 0 };
+      appendNumber(whole, 10, false, none);
+      append('.');
+      appendNumber(fraction, 10, false, six);
+      if (exponent >= 0) {
+        append("e+");
+        appendNumber(exponent, 10, false, two);
+      }
     }
+};
 
-    NPObjectTracker* trackChild(NPObject* aChildObject,
-        NPIdentifier aIdentifier, std::string aExtra="") {
-      char buf[256];
-      if (gBrowserFuncs->identifierisstring(aIdentifier)) {
-        NPUTF8* utf8 = gBrowserFuncs->utf8fromidentifier(aIdentifier);
-        snprintf(buf, 256, ".%s", utf8);
-        gBrowserFuncs->memfree(utf8);
-      } else {
-        int32_t intvalue = gBrowserFuncs->intfromidentifier(aIdentifier);
-        snprintf(buf, 256, "[%d]", intvalue);
+/* what starts each log line: the call's serial number and the line's
+ * time of day (UTC) - this is async-signal-safe */
+static void
+appendLinePrefix(SafeWriter& aWriter, int aSerialNumber, uint64_t aTime) {
+  Conversion serial = { NULL, NULL, 'd', 0, true, false, 5 };
+  Conversion two = { NULL, NULL, 'd', 0, true, false, 2 };
+  Conversion six = { NULL, NULL, 'd', 0, true, false, 6 };
+  uint64_t wall = Clock::wallNanos(aTime);
+  uint64_t seconds = (wall / 1000000000) % 86400;
+  aWriter.append('[');
+  aWriter.appendNumber(aSerialNumber, 10, false, serial);
+  aWriter.append(' ');
+  aWriter.appendNumber(seconds / 3600, 10, false, two);
+  aWriter.append(':');
+  aWriter.appendNumber(seconds / 60 % 60, 10, false, two);
+  aWriter.append(':');
+  aWriter.appendNumber(seconds % 60, 10, false, two);
+  aWriter.append('.');
+  aWriter.appendNumber(wall / 1000 % 1000000, 10, false, six);
+  aWriter.append("] ");
+}
+
+/* What a wrapper records about a call: lines of named, typed fields, which
+ * each log mode's writer turns into text or JSON (see LogLine). */
+typedef enum {
+  FIELD_INT,
+  FIELD_POINTER,
+  FIELD_BOOL,
+  FIELD_DOUBLE,
+  FIELD_STRING, // quoted and escaped
+  FIELD_SYMBOL, // a constant's name, like NO_ERROR, left bare in text
+  FIELD_VALUE, // already written in the log's notation by a serializer
+} FieldType;
+typedef struct {
+  const char* mName;
+  FieldType mType;
+  union {
+    int64_t mInt;
+    const void* mPointer;
+    bool mBool;
+    double mDouble;
+    const char* mString;
+  } mValue;
+} Field;
+typedef enum {
+  LINE_CALL, // the call and its arguments
+  LINE_RETURN, // what it returned, unnamed, then what it passed back
+  LINE_VALUES, // more named values
+} LineKind;
+#define LOG_LINE_FIELDS 12
+static void writeLine(SafeWriter& aWriter, FunctionId aFunction,
+    LineKind aKind, const Field* aFields, unsigned aCount);
+/* what we know about an NPObject, which can be written out without
+ * allocating */
+typedef struct {
+  char mOrigin;
+  const void* mObject;
+  const void* mPath;
+} ObjectRef;
+static void formatObjectRef(SafeWriter& aWriter, const ObjectRef& aRef);
+
+/* the flight recorder's ring of recent log lines: either a format string
+ * and its arguments or a line of fields */
+#define RECORDER_MAX_ARGS LOG_LINE_FIELDS
+#define RECORDER_STRING_SPACE 256
+typedef struct {
+  unsigned mSequence; // index+1 once the record is complete
+  int mSerialNumber;
+  uint64_t mTime;
+  const char* mFormat; // NULL for a line of fields
+  FunctionId mFunction;
+  LineKind mKind;
+  unsigned mCount;
+  union {
+    uint64_t mArgs[RECORDER_MAX_ARGS];
+    Field mFields[RECORDER_MAX_ARGS]; // strings are offsets in mStrings
+  };
+  char mStrings[RECORDER_STRING_SPACE];
+} RecorderRecord;
+
+class Recorder {
+  private:
+    static RecorderRecord gRecords[RECORDER_SIZE];
+    static unsigned gNext; // index of the next record to fill
+    /* records before this have been written out. The crash handler,
+     * SNAPSHOT_SIGNAL, NP_Shutdown and stalls can all dump, so each claims
+     * its range atomically and no record is written twice. */
+    static unsigned gDumped;
+    static void format(SafeWriter& aWriter, const RecorderRecord& aRecord);
+  public:
+    static void record(int aSerialNumber, uint64_t aTime, const char* aFormat,
+        va_list aArgs);
+    static void record(int aSerialNumber, uint64_t aTime,
+        FunctionId aFunction, LineKind aKind, const Field* aFields,
+        unsigned aCount);
+    static void dump(const char* aReason);
+};
+RecorderRecord Recorder::gRecords[RECORDER_SIZE];
+unsigned Recorder::gNext = 0;
+unsigned Recorder::gDumped = 0;
+
+/* copy a string into a record's string space, truncating it to what's
+ * left, and return its offset, or -1 for NULL */
+static uint64_t
+keepString(RecorderRecord& aRecord, size_t* aUsed, const char* aString) {
+  if (aString == NULL) {
+    return (uint64_t)-1;
+  }
+  size_t strings = *aUsed;
+  size_t length = strnlen(aString, RECORDER_STRING_SPACE);
+  if (strings + length + 1 > RECORDER_STRING_SPACE) {
+    length = strings + 1 < RECORDER_STRING_SPACE ?
+      RECORDER_STRING_SPACE - strings - 1 : 0;
+  }
+  memcpy(aRecord.mStrings + strings, aString, length);
+  aRecord.mStrings[strings + length] = '\0';
+  *aUsed = MIN(strings + length + 1, RECORDER_STRING_SPACE - 1);
+  return strings;
+}
+
+/* capture a log line without formatting it. strings are copied (and
+ * truncated) since they may not outlive the call */
+void
+Recorder::record(int aSerialNumber, uint64_t aTime, const char* aFormat,
+    va_list aArgs) {
+  unsigned index = __sync_fetch_and_add(&gNext, 1);
+  RecorderRecord& record = gRecords[index % RECORDER_SIZE];
+  record.mSequence = 0;
+  __sync_synchronize();
+  record.mSerialNumber = aSerialNumber;
+  record.mTime = aTime;
+  record.mFormat = aFormat;
+
+  size_t strings = 0;
+  unsigned n = 0;
+  Conversion c;
+  for (const char* f = aFormat; n < RECORDER_MAX_ARGS &&
+      nextConversion(f, &c); f = c.end) {
+    switch (c.conversion) {
+      case 'd': case 'i': case 'u': case 'x': case 'X': case 'c':
+        record.mArgs[n++] = c.length == 'L' ? va_arg(aArgs, long long) :
+          (c.length == 'l' ? va_arg(aArgs, long) : va_arg(aArgs, int));
+        break;
+      case 'p':
+        record.mArgs[n++] = (uintptr_t)va_arg(aArgs, void*);
+        break;
+      case 'f': case 'g': case 'e':
+        {
+          double d = va_arg(aArgs, double);
+          memcpy(&record.mArgs[n++], &d, sizeof(d));
+        }
+        break;
+      case 's':
+        record.mArgs[n++] = keepString(record, &strings,
+            va_arg(aArgs, const char*));
+        break;
+    }
+  }
+
+  __sync_synchronize();
+  record.mSequence = index + 1;
+}
+
+/* capture a line of fields, copying their strings */
+void
+Recorder::record(int aSerialNumber, uint64_t aTime, FunctionId aFunction,
+    LineKind aKind, const Field* aFields, unsigned aCount) {
+  unsigned index = __sync_fetch_and_add(&gNext, 1);
+  RecorderRecord& record = gRecords[index % RECORDER_SIZE];
+  record.mSequence = 0;
+  __sync_synchronize();
+  record.mSerialNumber = aSerialNumber;
+  record.mTime = aTime;
+  record.mFormat = NULL;
+  record.mFunction = aFunction;
+  record.mKind = aKind;
+  record.mCount = MIN(aCount, RECORDER_MAX_ARGS);
+
+  size_t strings = 0;
+  for (unsigned i = 0; i < record.mCount; i++) {
+    Field& field = record.mFields[i];
+    field = aFields[i];
+    if (field.mType == FIELD_STRING || field.mType == FIELD_SYMBOL ||
+        field.mType == FIELD_VALUE) {
+      field.mValue.mInt = keepString(record, &strings, field.mValue.mString);
+    }
+  }
+
+  __sync_synchronize();
+  record.mSequence = index + 1;
+}
+
+/* replay a record's format string with its captured arguments, or write
+ * out its fields */
+void
+Recorder::format(SafeWriter& aWriter, const RecorderRecord& aRecord) {
+  appendLinePrefix(aWriter, aRecord.mSerialNumber, aRecord.mTime);
+  if (aRecord.mFormat == NULL) {
+    Field fields[RECORDER_MAX_ARGS];
+    for (unsigned i = 0; i < aRecord.mCount; i++) {
+      fields[i] = aRecord.mFields[i];
+      FieldType type = fields[i].mType;
+      if (type == FIELD_STRING || type == FIELD_SYMBOL ||
+          type == FIELD_VALUE) {
+        int64_t offset = fields[i].mValue.mInt;
+        fields[i].mValue.mString = offset < 0 ? NULL :
+          aRecord.mStrings + offset;
+      }
+    }
+    writeLine(aWriter, aRecord.mFunction, aRecord.mKind, fields,
+        aRecord.mCount);
+    return;
+  }
+
+  const char* f = aRecord.mFormat;
+  unsigned n = 0;
+  Conversion c;
+  while (nextConversion(f, &c)) {
+    aWriter.appendFormatText(f, c.start - f);
+    f = c.end;
+    if (n >= RECORDER_MAX_ARGS) {
+      continue;
+    }
+    uint64_t arg = aRecord.mArgs[n++];
+    switch (c.conversion) {
+      case 'd': case 'i':
+        {
+          int64_t value = c.length ? (int64_t)arg : (int64_t)(int)arg;
+          aWriter.appendNumber(value < 0 ? -value : value, 10, value < 0, c);
+        }
+        break;
+      case 'u':
+        aWriter.appendNumber(c.length ? arg : (unsigned)arg, 10, false, c);
+        break;
+      case 'x': case 'X':
+        aWriter.appendNumber(c.length ? arg : (unsigned)arg, 16, false, c);
+        break;
+      case 'c':
+        aWriter.append((char)arg);
+        break;
+      case 'p':
+        if (arg == 0) {
+          aWriter.append("(nil)");
+        } else {
+          aWriter.append("0x");
+          aWriter.appendNumber(arg, 16, false, c);
+        }
+        break;
+      case 'f': case 'g': case 'e':
+        {
+          double d;
+          memcpy(&d, &arg, sizeof(d));
+          aWriter.appendDouble(d);
+        }
+        break;
+      case 's':
+        if (arg == (uint64_t)-1) {
+          aWriter.append("(null)");
+        } else {
+          aWriter.append(aRecord.mStrings + arg);
+        }
+        break;
+    }
+  }
+  aWriter.appendFormatText(f, strlen(f));
+}
+
+/* write out every record that hasn't been written yet, oldest first */
+void
+Recorder::dump(const char* aReason) {
+  char line[1024];
+  unsigned end = __atomic_load_n(&gNext, __ATOMIC_ACQUIRE);
+  unsigned start = __atomic_load_n(&gDumped, __ATOMIC_RELAXED);
+  // only ever move gDumped forward, in case another dump read a later end
+  do {
+    if ((int)(end - start) <= 0) {
+      return;
+    }
+  } while (!__atomic_compare_exchange_n(&gDumped, &start, end, false,
+        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+  if (end - start > RECORDER_SIZE) {
+    start = end - RECORDER_SIZE;
+  }
+
+  SafeWriter header(line, sizeof(line));
+  Conversion none = { NULL, NULL, 'd', 0, false, false, 0 };
+  header.append("--- flight recorder: ");
+  header.appendNumber(end - start, 10, false, none);
+  header.append(" records (");
+  header.append(aReason);
+  header.append(") ---\n");
+  Log::write(line, header.length());
+
+  for (unsigned i = start; i != end; i++) {
+    const RecorderRecord& record = gRecords[i % RECORDER_SIZE];
+    if (record.mSequence != i + 1) {
+      // overwritten or still being written
+      continue;
+    }
+    SafeWriter writer(line, sizeof(line));
+    format(writer, record);
+    if (writer.length() == sizeof(line)) {
+      line[sizeof(line) - 1] = '\n';
+    }
+    Log::write(line, writer.length());
+  }
+}
+
+static void
+traceSignalHandler(int aSignal) {
+  TraceControl::request(CONTROL_TOGGLE|CONTROL_COMMANDS);
+}
+
+static void
+snapshotSignalHandler(int aSignal) {
+  if (gLogMode == LOGMODE_RECORDER) {
+    // the browser may be hung, so don't wait for the next call
+    Log::flush("signal", true);
+  }
+  TraceControl::request(CONTROL_SNAPSHOT);
+}
+
+/* turn every function on in the configured mask, read CONTROLFILE and
+ * start listening for signals */
+void
+TraceControl::initialize() {
+  memset(gConfiguredMask, 0xff, sizeof(gConfiguredMask));
+  runCommands();
+  apply();
+
+  handleSignal(TRACE_SIGNAL, traceSignalHandler);
+  handleSignal(SNAPSHOT_SIGNAL, snapshotSignalHandler);
+}
+
+/* handle aSignal, unless the browser (or something it loaded) already
+ * does, since taking it over would break that */
+void
+TraceControl::handleSignal(int aSignal, void (*aHandler)(int)) {
+  struct sigaction action;
+  if (sigaction(aSignal, NULL, &action) == 0 &&
+      ((action.sa_flags & SA_SIGINFO) || action.sa_handler != SIG_DFL)) {
+    Log log(FN_pluginlogger);
+    if (log) log("signal %d is already handled, not using it\n", aSignal);
+    return;
+  }
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = aHandler;
+  sigemptyset(&action.sa_mask);
+  // don't make the browser's system calls fail with EINTR
+  action.sa_flags = SA_RESTART;
+  sigaction(aSignal, &action, NULL);
+}
+
+/* called from signal handlers: make the next call look at it */
+void
+TraceControl::request(int aRequest) {
+  __atomic_or_fetch(&gPending, aRequest, __ATOMIC_SEQ_CST);
+  for (int i = 0; i < TRACE_MASK_WORDS; i++) {
+    __atomic_or_fetch(&gMask[i], TRACE_PENDING, __ATOMIC_SEQ_CST);
+  }
+}
+
+/* publish the mask the hot path should use */
+void
+TraceControl::apply() {
+  for (int i = 0; i < TRACE_MASK_WORDS; i++) {
+    __atomic_store_n(&gMask[i],
+        gTracing ? gConfiguredMask[i] & ~TRACE_PENDING : 0,
+        __ATOMIC_SEQ_CST);
+  }
+  // a request that came in since we took gPending would have been wiped
+  if (__atomic_load_n(&gPending, __ATOMIC_SEQ_CST) != 0) {
+    for (int i = 0; i < TRACE_MASK_WORDS; i++) {
+      __atomic_or_fetch(&gMask[i], TRACE_PENDING, __ATOMIC_SEQ_CST);
+    }
+  }
+}
+
+void
+TraceControl::setFunctions(const char* aPattern, size_t aLength, bool aOn) {
+  bool prefix = aLength > 0 && aPattern[aLength - 1] == '*';
+  if (prefix) aLength--;
+  bool all = (aLength == 3 && strncmp(aPattern, "all", 3) == 0);
+  for (int f = 0; f < FN_COUNT; f++) {
+    const char* name = FunctionName((FunctionId)f);
+    if (all || (strncmp(name, aPattern, aLength) == 0 &&
+          (prefix || name[aLength] == '\0'))) {
+      if (aOn) {
+        gConfiguredMask[TRACE_WORD(f)] |= TRACE_BIT(f);
+      } else {
+        gConfiguredMask[TRACE_WORD(f)] &= ~TRACE_BIT(f);
+      }
+    }
+  }
+}
+
+/* run the commands in CONTROLFILE, returns false if there isn't one */
+bool
+TraceControl::runCommands() {
+  int fd = open(CONTROLFILE, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  char commands[4096];
+  ssize_t length = read(fd, commands, sizeof(commands) - 1);
+  close(fd);
+  if (length < 0) {
+    length = 0;
+  }
+  commands[length] = '\0';
+
+  const char* separators = " \t\r\n,";
+  for (const char* word = commands + strspn(commands, separators); *word;
+      word += strspn(word, separators)) {
+    size_t wordLength = strcspn(word, separators);
+    if (word[0] == '+' || word[0] == '-') {
+      setFunctions(word + 1, wordLength - 1, word[0] == '+');
+    } else if (strncmp(word, "on", wordLength) == 0) {
+      gTracing = true;
+    } else if (strncmp(word, "off", wordLength) == 0) {
+      gTracing = false;
+    } else if (strncmp(word, "toggle", wordLength) == 0) {
+      gTracing = !gTracing;
+    } else if (strncmp(word, "snapshot", wordLength) == 0) {
+      __atomic_or_fetch(&gPending, CONTROL_SNAPSHOT, __ATOMIC_RELAXED);
+    }
+    word += wordLength;
+  }
+  return true;
+}
+
+static void snapshot();
+
+/* a traced function was called with requests pending: deal with them and
+ * then decide for real */
+bool
+TraceControl::slowPath(FunctionId aFunction) {
+  if (pthread_mutex_trylock(&gLock) != 0) {
+    // another thread is dealing with them
+    return (__atomic_load_n(&gMask[TRACE_WORD(aFunction)], __ATOMIC_RELAXED) &
+        TRACE_BIT(aFunction)) != 0;
+  }
+  int pending = __atomic_exchange_n(&gPending, 0, __ATOMIC_SEQ_CST);
+  if (pending == 0) {
+    // another thread dealt with them
+    pthread_mutex_unlock(&gLock);
+    return (__atomic_load_n(&gMask[TRACE_WORD(aFunction)], __ATOMIC_RELAXED) &
+        TRACE_BIT(aFunction)) != 0;
+  }
+
+  bool wasTracing = gTracing;
+  if (pending & CONTROL_COMMANDS) {
+    if (!runCommands() && (pending & CONTROL_TOGGLE)) {
+      gTracing = !gTracing;
+    }
+  }
+  // running commands may have asked for a snapshot too
+  pending |= __atomic_exchange_n(&gPending, 0, __ATOMIC_RELAXED);
+
+  // say what happened while we can still be heard
+  if (wasTracing && !gTracing) {
+    Log log(FN_pluginlogger);
+    if (log) log("tracing turned off\n");
+  }
+  apply();
+  if (!wasTracing && gTracing) {
+    Log log(FN_pluginlogger);
+    if (log) log("tracing turned on\n");
+  }
+  if (pending & CONTROL_SNAPSHOT) {
+    snapshot();
+  }
+  pthread_mutex_unlock(&gLock);
+
+  return (__atomic_load_n(&gMask[TRACE_WORD(aFunction)], __ATOMIC_RELAXED) &
+      TRACE_BIT(aFunction)) != 0;
+}
+
+/* signals that mean we're about to die, and what used to handle them */
+static const int gCrashSignals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+static struct sigaction gPreviousCrashActions[NSIG];
+
+static const char*
+crashSignalName(int aSignal) {
+  switch (aSignal) {
+    case SIGSEGV: return "SIGSEGV"; break;
+    case SIGBUS: return "SIGBUS"; break;
+    case SIGILL: return "SIGILL"; break;
+    case SIGFPE: return "SIGFPE"; break;
+    case SIGABRT: return "SIGABRT"; break;
+  }
+  return "unknown signal";
+}
+
+static void
+crashHandler(int aSignal, siginfo_t* aInfo, void* aContext) {
+  Log::flush(crashSignalName(aSignal), true);
+
+  // pass the signal on to whoever was handling it before us
+  struct sigaction* previous = &gPreviousCrashActions[aSignal];
+  if (previous->sa_flags & SA_SIGINFO) {
+    previous->sa_sigaction(aSignal, aInfo, aContext);
+  } else if (previous->sa_handler != SIG_DFL &&
+      previous->sa_handler != SIG_IGN) {
+    previous->sa_handler(aSignal);
+  } else {
+    signal(aSignal, SIG_DFL);
+    raise(aSignal);
+  }
+}
+
+void
+Log::open() {
+  gLogFile = ::open(LOGFILE, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, 0644);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = crashHandler;
+  action.sa_flags = SA_SIGINFO|SA_NODEFER|SA_RESETHAND;
+  sigemptyset(&action.sa_mask);
+  for (size_t i = 0; i < sizeof(gCrashSignals)/sizeof(gCrashSignals[0]); i++) {
+    sigaction(gCrashSignals[i], &action,
+        &gPreviousCrashActions[gCrashSignals[i]]);
+  }
+
+}
+
+void
+Log::flush(const char* aReason, bool aInSignal) {
+  if (gLogMode == LOGMODE_RECORDER) {
+    Recorder::dump(aReason);
+  } else {
+    LogBuffer::flushAll(aInSignal);
+  }
+}
+
+void
+Log::write(const char* aData, size_t aLength) {
+  while (aLength > 0) {
+    ssize_t written = ::write(gLogFile, aData, aLength);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+    aData += written;
+    aLength -= written;
+  }
+}
+
+void
+Log::operator()(const char* format, ...) {
+  va_list argp;
+
+  if (!mEnabled) return;
+
+  if (gLogMode == LOGMODE_RECORDER) {
+    va_start(argp, format);
+    Recorder::record(mSerialNumber, monotonicNanos(), format, argp);
+    va_end(argp);
+    return;
+  }
+  if (gLogMode == LOGMODE_JSON) {
+    va_start(argp, format);
+    json(format, argp);
+    va_end(argp);
+    return;
+  }
+
+  LogBuffer* buffer = LogBuffer::get();
+  char prefixData[32];
+  SafeWriter prefixWriter(prefixData, sizeof(prefixData));
+  appendLinePrefix(prefixWriter, mSerialNumber, monotonicNanos());
+  size_t prefix = prefixWriter.length();
+
+  buffer->lock();
+  for (;;) {
+    char* line = buffer->mData + buffer->mLength;
+    size_t space = LOG_BUFFER_SIZE - buffer->mLength;
+    if (prefix < space) memcpy(line, prefixData, prefix);
+    va_start(argp, format);
+    size_t length = prefix + vsnprintf(prefix < space ? line + prefix : NULL,
+        prefix < space ? space - prefix : 0, format, argp);
+    va_end(argp);
+    if (length < space) {
+      buffer->mLength += length;
+      break;
+    }
+    if (buffer->mLength == 0) {
+      // this line is bigger than the whole buffer, write it out on its own
+      char* big = (char*)malloc(length + 1);
+      memcpy(big, prefixData, prefix);
+      va_start(argp, format);
+      vsnprintf(big + prefix, length + 1 - prefix, format, argp);
+      va_end(argp);
+      write(big, length);
+      free(big);
+      break;
+    }
+    buffer->flushLocked();
+  }
+  buffer->unlock();
+
+  buffer->flushIfStale(monotonicMillis());
+}
+
+
+/* log a call that held up the main thread, and what it was called from */
+void
+Stalls::report(const Frame& aFrame, uint64_t aNanos) {
+  {
+    Log log(FN_pluginlogger);
+    if (!log) return;
+    int depth = MIN(tDepth, STALL_MAX_DEPTH);
+    const char* call = depth < STALL_MAX_DEPTH && gArguments[depth][0] ?
+      gArguments[depth] : FunctionName(aFrame.mFunction);
+    log("stall: [%05d] took %lluus: %s\n", aFrame.mSerialNumber,
+        (unsigned long long)aNanos / 1000, call);
+    for (int i = depth - 1; i >= 0; i--) {
+      call = gArguments[i][0] ? gArguments[i] :
+        FunctionName(tFrames[i].mFunction);
+      log("  inside [%05d], started %lluus before: %s\n",
+          tFrames[i].mSerialNumber,
+          (unsigned long long)(aFrame.mStart - tFrames[i].mStart) / 1000,
+          call);
+    }
+  }
+  // the recorder is only dumped when something goes wrong or on request
+  if (gLogMode != LOGMODE_RECORDER) {
+    Log::flush("stall");
+  }
+}
+
+void
+Stalls::initialize() {
+  if (!STALL_THRESHOLD_MS || tMainThread) return;
+  tMainThread = true;
+  gMainThread = pthread_self();
+  if (STALL_WATCHDOG_MS) {
+    // the first backtrace() loads libgcc, which isn't safe in a handler
+    void* frames[1];
+    backtrace(frames, 1);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stackSignalHandler;
+    action.sa_flags = SA_RESTART;
+    sigaction(STALL_SIGNAL, &action, NULL);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, watchdog, NULL) == 0) {
+      pthread_detach(thread);
+    }
+  }
+}
+
+/* map the segment and fill in everything but the counters, then the magic
+ * number so that readers know it's ready */
+void
+LiveStats::create() {
+  if (!STATS_SEGMENT || gSegment != NULL) return;
+  if (FN_COUNT > PLUGINSTATS_FUNCTIONS) return; // pluginstats.h is too old
+  snprintf(gPath, sizeof(gPath), PLUGINSTATS_PREFIX "%d", (int)getpid());
+  // the name is easy to guess, so clear out one left by an earlier process
+  // with our pid and only use a file we've just made ourselves, not one
+  // someone else has put (or linked) there
+  unlink(gPath);
+  int fd = ::open(gPath, O_RDWR|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0644);
+  if (fd < 0) return;
+  if (ftruncate(fd, sizeof(PluginStatsSegment)) < 0) {
+    close(fd);
+    unlink(gPath);
+    return;
+  }
+  void* segment = mmap(NULL, sizeof(PluginStatsSegment),
+      PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (segment == MAP_FAILED) {
+    unlink(gPath);
+    return;
+  }
+  PluginStatsSegment* stats = (PluginStatsSegment*)segment;
+  stats->version = PLUGINSTATS_VERSION;
+  stats->size = sizeof(PluginStatsSegment);
+  stats->functionCount = FN_COUNT;
+  stats->pid = getpid();
+  stats->started = systemNanos();
+  for (int f = 0; f < FN_COUNT; f++) {
+    strncpy(stats->functions[f].name, FunctionName((FunctionId)f),
+        PLUGINSTATS_NAME_SIZE - 1);
+  }
+  __atomic_store_n(&stats->magic, PLUGINSTATS_MAGIC, __ATOMIC_RELEASE);
+  gSegment = stats;
+}
+
+/* Leave the segment mapped, since other threads may still be counting
+ * into it, but take its name away. */
+void
+LiveStats::destroy() {
+  if (gSegment != NULL) unlink(gPath);
+}
+
+PluginStatsInstance*
+LiveStats::claim(NPP aNPP, const char* aType) {
+  if (gSegment == NULL) return NULL;
+  for (int i = 0; i < PLUGINSTATS_INSTANCES; i++) {
+    PluginStatsInstance* instance = &gSegment->instances[i];
+    if (__atomic_load_n(&instance->id, __ATOMIC_RELAXED) != 0) continue;
+    instance->created = systemNanos();
+    instance->streams = 0;
+    instance->streamBytes = 0;
+    instance->requests = 0;
+    instance->invalidations = 0;
+    instance->paints = 0;
+    instance->paintNanos = 0;
+    instance->timerFires = 0;
+    memset(instance->type, 0, sizeof(instance->type));
+    strncpy(instance->type, aType ? aType : "", PLUGINSTATS_NAME_SIZE - 1);
+    __atomic_store_n(&instance->id, (uint64_t)(uintptr_t)aNPP,
+        __ATOMIC_RELEASE);
+    return instance;
+  }
+  return NULL;
+}
+
+/* look in on the main thread a few times per STALL_WATCHDOG_MS and have it
+ * write out its stack once for each call that's running too long */
+void*
+Stalls::watchdog(void* aUnused) {
+  unsigned reported = 0;
+  useconds_t interval = STALL_WATCHDOG_MS * 1000 / 4;
+  if (interval < 1000) interval = 1000;
+  for (;;) {
+    usleep(interval);
+    uint64_t start = __atomic_load_n(&gCallStart, __ATOMIC_ACQUIRE);
+    unsigned call = __atomic_load_n(&gCalls, __ATOMIC_RELAXED);
+    if (start != 0 && call != reported &&
+        monotonicNanos() - start >= STALL_WATCHDOG_MS * 1000000ULL) {
+      reported = call;
+      // write out what led up to it here, where it's safe to wait on the
+      // main thread's buffer, so the stack lands after it
+      Log::flush("stall");
+      pthread_kill(gMainThread, STALL_SIGNAL);
+    }
+  }
+  return NULL;
+}
+
+/* runs on the main thread, in the middle of the slow call - this has to be
+ * async-signal-safe (dladdr isn't promised to be, but doesn't allocate).
+ * The stack goes straight to the file: we may have interrupted a write to
+ * the main thread's buffer, so this leaves the buffers to the watchdog and
+ * the next call. */
+void
+Stalls::stackSignalHandler(int aSignal) {
+  int savedErrno = errno;
+  void* frames[STALL_STACK_FRAMES];
+  int n = backtrace(frames, STALL_STACK_FRAMES);
+  char line[512];
+  Conversion none = { NULL, NULL, 'd', 0, false, false, 0 };
+  SafeWriter header(line, sizeof(line));
+  header.append("--- main thread stack: ");
+  if (tDepth > 0 && tDepth <= STALL_MAX_DEPTH) {
+    const Frame& frame = tFrames[tDepth - 1];
+    header.append(FunctionName(frame.mFunction));
+    header.append(" running for ");
+    header.appendNumber((monotonicNanos() - frame.mStart) / 1000, 10, false,
+        none);
+    header.append("us");
+  }
+  header.append(" ---\n");
+  Log::write(line, header.length());
+  // skip this handler and the signal trampoline
+  for (int i = 2; i < n; i++) {
+    SafeWriter writer(line, sizeof(line) - 1);
+    writer.append("  #");
+    writer.appendNumber(i - 2, 10, false, none);
+    writer.append(" 0x");
+    writer.appendNumber((uintptr_t)frames[i], 16, false, none);
+    Dl_info info;
+    if (dladdr(frames[i], &info)) {
+      const char* file = info.dli_fname ? strrchr(info.dli_fname, '/') : NULL;
+      writer.append(' ');
+      writer.append(file ? file + 1 : (info.dli_fname ? info.dli_fname : "?"));
+      if (info.dli_sname) {
+        writer.append('!');
+        writer.append(info.dli_sname);
+        writer.append("+0x");
+        writer.appendNumber((uintptr_t)frames[i] - (uintptr_t)info.dli_saddr,
+            16, false, none);
+      }
+    }
+    size_t length = writer.length();
+    line[length++] = '\n';
+    Log::write(line, length);
+  }
+  errno = savedErrno;
+}
+
+/* helper to print boolean values */
+static const char*
+boolStr(bool aBoolean) {
+  return aBoolean?"true":"false";
+}
+
+/* how much of a string argument to log, and how big a single logged
+ * value (like an argument list) can get */
+#ifndef PRINTABLE_STRING_LIMIT
+#define PRINTABLE_STRING_LIMIT 1024
+#endif
+#ifndef PRINTABLE_SIZE
+#define PRINTABLE_SIZE 4096
+#endif
+
+/* Strings are logged JSON escaped so that quotes, newlines and control
+ * characters in script or data can't break up the log, and invalid UTF-8
+ * is replaced with U+FFFD so the log stays valid UTF-8. Most of a big
+ * string is plain ASCII that can be copied as it is, so where the CPU has
+ * AVX2 the work is finding the next byte that isn't, 32 bytes at a time.
+ * Elsewhere a byte-at-a-time copy is as fast as any search we tried (see
+ * escapebench.cpp). */
+static inline bool
+plainByte(unsigned char aChar) {
+  return aChar >= 0x20 && aChar < 0x80 && aChar != '"' && aChar != '\\';
+}
+
+/* the length of the valid UTF-8 sequence aString starts with, or 0 */
+static size_t
+utf8Sequence(const unsigned char* aString, size_t aLength) {
+  unsigned char c = aString[0];
+  size_t length;
+  unsigned char low = 0x80, high = 0xbf; // allowed range of the 2nd byte
+  if (c >= 0xc2 && c <= 0xdf) {
+    length = 2;
+  } else if (c >= 0xe0 && c <= 0xef) {
+    length = 3;
+    if (c == 0xe0) low = 0xa0; // overlong
+    if (c == 0xed) high = 0x9f; // surrogates
+  } else if (c >= 0xf0 && c <= 0xf4) {
+    length = 4;
+    if (c == 0xf0) low = 0x90; // overlong
+    if (c == 0xf4) high = 0x8f; // past U+10FFFF
+  } else {
+    return 0;
+  }
+  if (aLength < length || aString[1] < low || aString[1] > high) {
+    return 0;
+  }
+  for (size_t i = 2; i < length; i++) {
+    if ((aString[i] & 0xc0) != 0x80) return 0;
+  }
+  return length;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* the index of the first byte in aString that isn't plain, or aLength */
+static size_t __attribute__((target("avx2")))
+findSpecialAVX2(const char* aString, size_t aLength) {
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  const __m256i control = _mm256_set1_epi8(0x1f);
+  size_t i = 0;
+  for (; i + 32 <= aLength; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i*)(aString + i));
+    // bytes <= 0x1f are the ones max(byte, 0x1f) leaves at 0x1f, and
+    // movemask picks out the bytes >= 0x80 by themselves
+    __m256i found = _mm256_or_si256(chunk, _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote),
+          _mm256_cmpeq_epi8(chunk, backslash)),
+        _mm256_cmpeq_epi8(_mm256_max_epu8(chunk, control), control)));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(found);
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  while (i < aLength && plainByte(aString[i])) i++;
+  return i;
+}
+#endif
+
+/* whether to search with AVX2, decided the first time we're called, or
+ * -1 before then */
+static int gEscapeWithAVX2 = -1;
+
+static bool
+escapeWithAVX2() {
+  if (gEscapeWithAVX2 < 0) {
+    gEscapeWithAVX2 = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    gEscapeWithAVX2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+#endif
+  }
+  return gEscapeWithAVX2;
+}
+
+/* Append aString JSON escaped, as much of it as fits. Escapes and UTF-8
+ * sequences are never cut in half. */
+static void
+appendEscaped(SafeWriter& aWriter, const char* aString, size_t aLength) {
+  static const char hex[] = "0123456789abcdef";
+  size_t space;
+  char* start = aWriter.tail(&space);
+  char* out = start;
+  char* end = start + space;
+  bool search = escapeWithAVX2();
+  size_t i = 0;
+  while (i < aLength && out < end) {
+    if (search) {
+      // escapes are often close together (think JSON), so copy a few bytes
+      // at a time before starting a vector search
+      size_t near = MIN(aLength, i + MIN((size_t)8, (size_t)(end - out)));
+      while (i < near && plainByte(aString[i])) *out++ = aString[i++];
+#if defined(__x86_64__) || defined(__i386__)
+      if (i == near) {
+        size_t clean = MIN(findSpecialAVX2(aString + i, aLength - i),
+            (size_t)(end - out));
+        memcpy(out, aString + i, clean);
+        out += clean;
+        i += clean;
+        continue;
+      }
+#endif
+    } else {
+      while (i < aLength && out < end && plainByte(aString[i])) {
+        *out++ = aString[i++];
+      }
+      if (i == aLength || out == end) break;
+    }
+    unsigned char c = aString[i];
+    if (c >= 0x80) {
+      size_t length = utf8Sequence((const unsigned char*)aString + i,
+          aLength - i);
+      if (length == 0) {
+        if (end - out < 6) break;
+        memcpy(out, "\\ufffd", 6);
+        out += 6;
+        i++;
+      } else {
+        if ((size_t)(end - out) < length) break;
+        memcpy(out, aString + i, length);
+        out += length;
+        i += length;
+      }
+      continue;
+    }
+    char escape = 0;
+    switch (c) {
+      case '"': escape = '"'; break;
+      case '\\': escape = '\\'; break;
+      case '\n': escape = 'n'; break;
+      case '\r': escape = 'r'; break;
+      case '\t': escape = 't'; break;
+      case '\b': escape = 'b'; break;
+      case '\f': escape = 'f'; break;
+    }
+    if (end - out < (escape ? 2 : 6)) {
+      break;
+    }
+    i++;
+    *out++ = '\\';
+    if (escape) {
+      *out++ = escape;
+    } else {
+      *out++ = 'u';
+      *out++ = '0';
+      *out++ = '0';
+      *out++ = hex[c >> 4];
+      *out++ = hex[c & 0xf];
+    }
+  }
+  aWriter.advance(out - start);
+}
+
+/* the longest prefix of aString no longer than aLimit bytes that doesn't
+ * end part way through a UTF-8 sequence */
+static size_t
+truncateUTF8(const char* aString, size_t aLength, size_t aLimit) {
+  if (aLength <= aLimit) {
+    return aLength;
+  }
+  size_t length = aLimit;
+  // back up over continuation bytes to the start of the sequence
+  for (int i = 0; i < 3 && length > 0 &&
+      ((unsigned char)aString[length] & 0xc0) == 0x80; i++) {
+    length--;
+  }
+  return length;
+}
+
+/* The serializers write values straight into a SafeWriter, truncating
+ * long strings, so they can fill a stack buffer or a record without
+ * allocating. With aJSON they write JSON values instead of the text log's
+ * notation. */
+static void
+writeIdentifier(SafeWriter& aWriter, NPIdentifier aIdentifier) {
+  if (gBrowserFuncs->identifierisstring(aIdentifier)) {
+    NPUTF8* utf8 = gBrowserFuncs->utf8fromidentifier(aIdentifier);
+    aWriter.append('"');
+    if (utf8) appendEscaped(aWriter, utf8, strlen(utf8));
+    aWriter.append('"');
+    gBrowserFuncs->memfree(utf8);
+  } else {
+    Conversion none = { NULL, NULL, 'd', 0, false, false, 0 };
+    int32_t intvalue = gBrowserFuncs->intfromidentifier(aIdentifier);
+    aWriter.appendNumber(intvalue < 0 ? -(int64_t)intvalue : intvalue, 10,
+        intvalue < 0, none);
+  }
+}
+
+static void
+writeString(SafeWriter& aWriter, const char* aString, size_t aLength,
+    bool aJSON) {
+  aWriter.append('"');
+  appendEscaped(aWriter, aString,
+      truncateUTF8(aString, aLength, PRINTABLE_STRING_LIMIT));
+  if (!aJSON) aWriter.append('"');
+  if (aLength > PRINTABLE_STRING_LIMIT) {
+    Conversion none = { NULL, NULL, 'u', 0, false, false, 0 };
+    aWriter.append("...(");
+    aWriter.appendNumber(aLength, 10, false, none);
+    aWriter.append(" bytes)");
+  }
+  if (aJSON) aWriter.append('"');
+}
+
+/* an object reference as a JSON string */
+static void
+writeJSONObjectRef(SafeWriter& aWriter, const ObjectRef& aRef) {
+  char buffer[512];
+  SafeWriter ref(buffer, sizeof(buffer));
+  formatObjectRef(ref, aRef);
+  aWriter.append('"');
+  appendEscaped(aWriter, buffer, ref.length());
+  aWriter.append('"');
+}
+
+static void writeObject(SafeWriter& aWriter, const NPObject* aObject,
+    bool aJSON);
+
+static void
+writeDouble(SafeWriter& aWriter, double aValue, bool aJSON) {
+  if (aJSON && (aValue != aValue || aValue > __DBL_MAX__ ||
+        aValue < -__DBL_MAX__)) {
+    // JSON has no NaN or infinity
+    aWriter.append("null");
+  } else {
+    aWriter.appendDouble(aValue);
+  }
+}
+
+static void
+writeVariant(SafeWriter& aWriter, const NPVariant& aVariant, bool aJSON) {
+  Conversion none = { NULL, NULL, 'd', 0, false, false, 0 };
+  switch(aVariant.type) {
+    case NPVariantType_Void:
+      aWriter.append(aJSON ? "null" : "(void)");
+      break;
+    case NPVariantType_Null:
+      aWriter.append(aJSON ? "null" : "(null)");
+      break;
+    case NPVariantType_Bool:
+      aWriter.append(boolStr(aVariant.value.boolValue));
+      break;
+    case NPVariantType_Int32:
+      {
+        int32_t value = aVariant.value.intValue;
+        aWriter.appendNumber(value < 0 ? -(int64_t)value : value, 10,
+            value < 0, none);
+      }
+      break;
+    case NPVariantType_Double:
+      writeDouble(aWriter, aVariant.value.doubleValue, aJSON);
+      break;
+    case NPVariantType_String:
+      writeString(aWriter, aVariant.value.stringValue.UTF8Characters,
+          aVariant.value.stringValue.UTF8Length, aJSON);
+      break;
+    case NPVariantType_Object:
+      writeObject(aWriter, aVariant.value.objectValue, aJSON);
+      break;
+    default:
+      aWriter.append(aJSON ? "null" : "(unknown variant type)");
+      break;
+  }
+}
+
+/* a list of variants - useful for collecting argument lists */
+static void
+writeVariants(SafeWriter& aWriter, const NPVariant* aVariants,
+    uint32_t aCount, bool aParens, bool aJSON) {
+  if (aJSON) {
+    aWriter.append('[');
+  } else if (aParens) {
+    aWriter.append('(');
+  }
+  for (uint32_t i=0; i<aCount; i++) {
+    if (i>0) {
+      aWriter.append(", ");
+    }
+    writeVariant(aWriter, aVariants[i], aJSON);
+  }
+  if (aJSON) {
+    aWriter.append(']');
+  } else if (aParens) {
+    aWriter.append(')');
+  }
+}
+
+/* A value formatted as text in a fixed buffer, usually on the stack, for
+ * things like object paths and reports. Use it as
+ * Printable(value).c_str(). */
+class Printable {
+  private:
+    char mBuffer[PRINTABLE_SIZE];
+    SafeWriter mWriter;
+  public:
+    Printable(NPIdentifier aIdentifier)
+        : mWriter(mBuffer, PRINTABLE_SIZE - 1) {
+      writeIdentifier(mWriter, aIdentifier);
+    }
+    Printable(const NPVariant* aVariants, uint32_t aCount, bool aParens=false)
+        : mWriter(mBuffer, PRINTABLE_SIZE - 1) {
+      writeVariants(mWriter, aVariants, aCount, aParens, false);
+    }
+    const char* c_str() {
+      size_t length = mWriter.length();
+      if (length == PRINTABLE_SIZE - 1) {
+        // it didn't fit, say so
+        memcpy(mBuffer + length - 3, "...", 3);
+      }
+      mBuffer[length] = '\0';
+      return mBuffer;
+    }
+};
+
+const char* NPErrorName(NPError e);
+
+/* a field's value, in the text log's notation or as JSON */
+static void
+writeFieldValue(SafeWriter& aWriter, const Field& aField, bool aJSON) {
+  Conversion none = { NULL, NULL, 'd', 0, false, false, 0 };
+  const char* string = aField.mValue.mString;
+  switch (aField.mType) {
+    case FIELD_INT:
+      {
+        int64_t value = aField.mValue.mInt;
+        aWriter.appendNumber(value < 0 ? -(uint64_t)value : value, 10,
+            value < 0, none);
+      }
+      break;
+    case FIELD_POINTER:
+      if (aField.mValue.mPointer == NULL) {
+        aWriter.append(aJSON ? "null" : "(nil)");
+        break;
+      }
+      if (aJSON) aWriter.append('"');
+      aWriter.append("0x");
+      aWriter.appendNumber((uintptr_t)aField.mValue.mPointer, 16, false,
+          none);
+      if (aJSON) aWriter.append('"');
+      break;
+    case FIELD_BOOL:
+      aWriter.append(boolStr(aField.mValue.mBool));
+      break;
+    case FIELD_DOUBLE:
+      writeDouble(aWriter, aField.mValue.mDouble, aJSON);
+      break;
+    case FIELD_STRING:
+    case FIELD_SYMBOL:
+      if (string == NULL) {
+        aWriter.append(aJSON ? "null" : "(null)");
+      } else if (aField.mType == FIELD_SYMBOL && !aJSON) {
+        aWriter.append(string);
+      } else {
+        writeString(aWriter, string, strlen(string), aJSON);
+      }
+      break;
+    case FIELD_VALUE:
+      aWriter.append(string);
+      break;
+  }
+}
+
+/* fields as an object: {a=1, b="x"} or {"a":1,"b":"x"} */
+static void
+writeStruct(SafeWriter& aWriter, const Field* aFields, unsigned aCount,
+    bool aJSON) {
+  aWriter.append('{');
+  for (unsigned i = 0; i < aCount; i++) {
+    if (i > 0) aWriter.append(aJSON ? "," : ", ");
+    const char* name = aFields[i].mName ? aFields[i].mName : "value";
+    if (aJSON) {
+      aWriter.append('"');
+      appendEscaped(aWriter, name, strlen(name));
+      aWriter.append("\":");
+    } else {
+      aWriter.append(name);
+      aWriter.append('=');
+    }
+    writeFieldValue(aWriter, aFields[i], aJSON);
+  }
+  aWriter.append('}');
+}
+
+/* a line of fields as the text log writes it (without its prefix), eg
+ *   NPN_GetURL(npp=0x..., url="http://...", window=(null))
+ *    returned NO_ERROR
+ *   NPNVWindowNPObject=B0x...:window
+ * this is async-signal-safe, for the recorder */
+static void
+writeLine(SafeWriter& aWriter, FunctionId aFunction, LineKind aKind,
+    const Field* aFields, unsigned aCount) {
+  unsigned i = 0;
+  switch (aKind) {
+    case LINE_CALL:
+      aWriter.append(FunctionName(aFunction));
+      aWriter.append('(');
+      break;
+    case LINE_RETURN:
+      aWriter.append(" returned");
+      if (aCount > 0 && aFields[0].mName == NULL) {
+        aWriter.append(' ');
+        writeFieldValue(aWriter, aFields[0], false);
+        i = 1;
+      }
+      break;
+    case LINE_VALUES:
+      aWriter.append("  ");
+      break;
+  }
+  for (; i < aCount; i++) {
+    if (i > 0) {
+      aWriter.append(", ");
+    } else if (aKind == LINE_RETURN) {
+      aWriter.append(' ');
+    }
+    if (aFields[i].mName) {
+      aWriter.append(aFields[i].mName);
+      aWriter.append('=');
+    }
+    writeFieldValue(aWriter, aFields[i], false);
+  }
+  if (aKind == LINE_CALL) aWriter.append(')');
+  aWriter.append('\n');
+}
+
+/* a line of fields as members of the call's JSON object: the arguments as
+ * "args", the return value as "ret" and anything else by its own name */
+static void
+writeJSONFields(SafeWriter& aWriter, LineKind aKind, const Field* aFields,
+    unsigned aCount) {
+  if (aKind == LINE_CALL) {
+    aWriter.append(",\"args\":");
+    writeStruct(aWriter, aFields, aCount, true);
+    return;
+  }
+  unsigned i = 0;
+  if (aKind == LINE_RETURN && aCount > 0 && aFields[0].mName == NULL) {
+    aWriter.append(",\"ret\":");
+    writeFieldValue(aWriter, aFields[0], true);
+    i = 1;
+  }
+  for (; i < aCount; i++) {
+    const char* name = aFields[i].mName ? aFields[i].mName : "value";
+    aWriter.append(",\"");
+    appendEscaped(aWriter, name, strlen(name));
+    aWriter.append("\":");
+    writeFieldValue(aWriter, aFields[i], true);
+  }
+}
+
+/* A line about a call. The wrapper records the call's arguments, or what
+ * it returned, as named and typed fields, and the line is written by the
+ * log mode's writer at the end of the statement:
+ *   if (log) log.call().pointer("npp", npp).string("url", url);
+ *   if (log) log.returned().error(e);
+ * A return line's first field is the return value, which has no name.
+ * Values that have to be read while they're still around, like variants
+ * and objects, are serialized straight away into the line's own buffer in
+ * the log's notation, and are marked as such by their type. A line that
+ * won't be written, like the return of a call that's only watched for
+ * stalls, skips that. Field names should be unique within a call, since
+ * in JSON mode they become keys. */
+#ifndef LOG_LINE_VALUE_SPACE
+#define LOG_LINE_VALUE_SPACE (2*PRINTABLE_SIZE)
+#endif
+class LogLine {
+  private:
+    Log* mLog;
+    LineKind mKind;
+    unsigned mCount;
+    Field mFields[LOG_LINE_FIELDS];
+    Field mDropped; // where fields past LOG_LINE_FIELDS go
+    size_t mValuesLength;
+    char mValues[LOG_LINE_VALUE_SPACE];
+    LogLine& operator=(const LogLine&);
+    Field& add(const char* aName, FieldType aType) {
+      Field& field = mCount < LOG_LINE_FIELDS ? mFields[mCount++] : mDropped;
+      field.mName = aName;
+      field.mType = aType;
+      return field;
+    }
+    /* a writer for a serialized value, and how much room it has */
+    SafeWriter startValue(size_t* aSpace) {
+      *aSpace = MIN((size_t)PRINTABLE_SIZE,
+          LOG_LINE_VALUE_SPACE - mValuesLength - 1);
+      return SafeWriter(mValues + mValuesLength, *aSpace);
+    }
+    LogLine& addValue(const char* aName, const SafeWriter& aWriter,
+        size_t aSpace);
+  public:
+    LogLine(Log* aLog, LineKind aKind)
+      : mLog(aLog), mKind(aKind), mCount(0), mValuesLength(0) { }
+    /* only for returning a line from Log: the copy writes it instead */
+    LogLine(const LogLine& aOther);
+    ~LogLine() {
+      if (mLog) mLog->line(*this);
+    }
+    LineKind kind() const { return mKind; }
+    unsigned count() const { return mCount; }
+    const Field* fields() const { return mFields; }
+
+    LogLine& integer(const char* aName, int64_t aValue) {
+      add(aName, FIELD_INT).mValue.mInt = aValue;
+      return *this;
+    }
+    LogLine& pointer(const char* aName, const void* aValue) {
+      add(aName, FIELD_POINTER).mValue.mPointer = aValue;
+      return *this;
+    }
+    LogLine& boolean(const char* aName, bool aValue) {
+      add(aName, FIELD_BOOL).mValue.mBool = aValue;
+      return *this;
+    }
+    LogLine& real(const char* aName, double aValue) {
+      add(aName, FIELD_DOUBLE).mValue.mDouble = aValue;
+      return *this;
+    }
+    LogLine& string(const char* aName, const char* aValue) {
+      add(aName, FIELD_STRING).mValue.mString = aValue;
+      return *this;
+    }
+    LogLine& symbol(const char* aName, const char* aValue) {
+      add(aName, FIELD_SYMBOL).mValue.mString = aValue;
+      return *this;
+    }
+    LogLine& error(const char* aName, NPError aValue) {
+      return symbol(aName, NPErrorName(aValue));
+    }
+    LogLine& string(const char* aName, const NPString* aValue);
+    LogLine& identifier(const char* aName, NPIdentifier aValue);
+    LogLine& identifiers(const char* aName, const NPIdentifier* aValues,
+        uint32_t aCount);
+    LogLine& object(const char* aName, const NPObject* aValue);
+    LogLine& variant(const char* aName, const NPVariant* aValue);
+    LogLine& variants(const char* aName, const NPVariant* aValues,
+        uint32_t aCount);
+    LogLine& strings(const char* aName, const char* const* aValues,
+        uint32_t aCount);
+    LogLine& pointers(const char* aName, const void* const* aValues,
+        uint32_t aCount);
+    LogLine& rect(const char* aName, const NPRect* aValue);
+    LogLine& ranges(const char* aName, const NPByteRange* aValue);
+
+    /* return values */
+    LogLine& integer(int64_t aValue) { return integer(NULL, aValue); }
+    LogLine& pointer(const void* aValue) { return pointer(NULL, aValue); }
+    LogLine& boolean(bool aValue) { return boolean(NULL, aValue); }
+    LogLine& string(const char* aValue) { return string(NULL, aValue); }
+    LogLine& symbol(const char* aValue) { return symbol(NULL, aValue); }
+    LogLine& error(NPError aValue) { return error(NULL, aValue); }
+    LogLine& object(const NPObject* aValue) { return object(NULL, aValue); }
+};
+
+LogLine::LogLine(const LogLine& aOther)
+    : mLog(aOther.mLog), mKind(aOther.mKind), mCount(aOther.mCount),
+      mValuesLength(aOther.mValuesLength) {
+  const_cast<LogLine&>(aOther).mLog = NULL;
+  memcpy(mValues, aOther.mValues, mValuesLength);
+  for (unsigned i = 0; i < mCount; i++) {
+    mFields[i] = aOther.mFields[i];
+    if (mFields[i].mType == FIELD_VALUE) {
+      mFields[i].mValue.mString = mValues +
+        (aOther.mFields[i].mValue.mString - aOther.mValues);
+    }
+  }
+}
+
+/* finish a serialized value: one that didn't fit is cut short, which in
+ * JSON means leaving it out */
+LogLine&
+LogLine::addValue(const char* aName, const SafeWriter& aWriter,
+    size_t aSpace) {
+  char* value = mValues + mValuesLength;
+  size_t length = aWriter.length();
+  if (length == aSpace) {
+    if (aSpace < 8) {
+      return symbol(aName, NULL);
+    } else if (gLogMode == LOGMODE_JSON) {
+      length = 5;
+      memcpy(value, "\"...\"", length);
+    } else {
+      memcpy(value + length - 3, "...", 3);
+    }
+  }
+  value[length] = '\0';
+  mValuesLength += length + 1;
+  add(aName, FIELD_VALUE).mValue.mString = value;
+  return *this;
+}
+
+LogLine&
+LogLine::string(const char* aName, const NPString* aValue) {
+  if (mLog == NULL) return *this;
+  size_t space;
+  SafeWriter writer = startValue(&space);
+  writeString(writer, aValue->UTF8Characters, aValue->UTF8Length,
+      gLogMode == LOGMODE_JSON);
+  return addValue(aName, writer, space);
+}
+
+LogLine&
+LogLine::identifier(const char* aName, NPIdentifier aValue) {
+  if (mLog == NULL) return *this;
+  size_t space;
+  SafeWriter writer = startValue(&space);
+  writeIdentifier(writer, aValue);
+  return addValue(aName, writer, space);
+}
+
+LogLine&
+LogLine::identifiers(const char* aName, const NPIdentifier* aValues,
+    uint32_t aCount) {
+  if (mLog == NULL) return *this;
+  size_t space;
+  SafeWriter writer = startValue(&space);
+  writer.append('[');
+  for (uint32_t i = 0; i < aCount; i++) {
+    if (i > 0) writer.append(", ");
+    writeIdentifier(writer, aValues[i]);
+  }
+  writer.append(']');
+  return addValue(aName, writer, space);
+}
+
+LogLine&
+LogLine::object(const char* aName, const NPObject* aValue) {
+  if (mLog == NULL) return *this;
+  if (aValue == NULL) {
+    return pointer(aName, NULL);
+  }
+  size_t space;
+  SafeWriter writer = startValue(&space);
+  writeObject(writer, aValue, gLogMode == LOGMODE_JSON);
+  return addValue(aName, writer, space);
+}
+
+LogLine&
+LogLine::variant(const char* aName, const NPVariant* aValue) {
+  if (mLog == NULL) return *this;
+  size_t space;
+  SafeWriter writer = startValue(&space);
+  writeVariant(writer, *aValue, gLogMode == LOGMODE_JSON);
+  return addValue(aName, writer, space);
+}
+
+LogLine&
+LogLine::variants(const char* aName, const NPVariant* aValues,
+    uint32_t aCount) {
+  if (mLog == NULL) return *this;
+  size_t space;
+  SafeWriter writer = startValue(&space);
+  writeVariants(writer, aValues, aCount, true, gLogMode == LOGMODE_JSON);
+  return addValue(aName, writer, space);
+}
+
+LogLine&
+LogLine::strings(const char* aName, const char* const* aValues,
+    uint32_t aCount) {
+  if (mLog == NULL) return *this;
+  bool json = gLogMode == LOGMODE_JSON;
+  size_t space;
+  SafeWriter writer = startValue(&space);
+  writer.append('[');
+  for (uint32_t i = 0; i < aCount; i++) {
+    if (i > 0) writer.append(", ");
+    Field item = { NULL, FIELD_STRING, { 0 } };
+    item.mValue.mString = aValues[i];
+    writeFieldValue(writer, item, json);
+  }
+  writer.append(']');
+  return addValue(aName, writer, space);
+}
+
+LogLine&
+LogLine::pointers(const char* aName, const void* const* aValues,
+    uint32_t aCount) {
+  if (mLog == NULL) return *this;
+  bool json = gLogMode == LOGMODE_JSON;
+  size_t space;
+  SafeWriter writer = startValue(&space);
+  writer.append('[');
+  for (uint32_t i = 0; i < aCount; i++) {
+    if (i > 0) writer.append(", ");
+    Field item = { NULL, FIELD_POINTER, { 0 } };
+    item.mValue.mPointer = aValues[i];
+    writeFieldValue(writer, item, json);
+  }
+  writer.append(']');
+  return addValue(aName, writer, space);
+}
+
+LogLine&
+LogLine::rect(const char* aName, const NPRect* aValue) {
+  if (mLog == NULL) return *this;
+  if (aValue == NULL) {
+    return pointer(aName, NULL);
+  }
+  Field fields[4] = {
+    { "top", FIELD_INT, { aValue->top } },
+    { "left", FIELD_INT, { aValue->left } },
+    { "bottom", FIELD_INT, { aValue->bottom } },
+    { "right", FIELD_INT, { aValue->right } },
+  };
+  size_t space;
+  SafeWriter writer = startValue(&space);
+  writeStruct(writer, fields, 4, gLogMode == LOGMODE_JSON);
+  return addValue(aName, writer, space);
+}
+
+LogLine&
+LogLine::ranges(const char* aName, const NPByteRange* aValue) {
+  if (mLog == NULL) return *this;
+  bool json = gLogMode == LOGMODE_JSON;
+  size_t space;
+  SafeWriter writer = startValue(&space);
+  writer.append('[');
+  for (const NPByteRange* r = aValue; r != NULL; r = r->next) {
+    Field fields[2] = {
+      { "offset", FIELD_INT, { r->offset } },
+      { "length", FIELD_INT, { r->length } },
+    };
+    if (r != aValue) writer.append(", ");
+    writeStruct(writer, fields, 2, json);
+  }
+  writer.append(']');
+  return addValue(aName, writer, space);
+}
+
+inline LogLine
+Log::call() {
+  return LogLine(mEnabled || mWatched || mProbed ? this : NULL, LINE_CALL);
+}
+
+inline LogLine
+Log::returned() {
+  return LogLine(mEnabled || mProbed ? this : NULL, LINE_RETURN);
+}
+
+inline LogLine
+Log::values() {
+  return LogLine(mEnabled ? this : NULL, LINE_VALUES);
+}
+
+/* hand a call or return line to the probes */
+void
+Log::probe(const LogLine& aLine) {
+#if USDT_PROBES
+  char text[PROBE_TEXT_SIZE];
+  char* line = aLine.kind() == LINE_RETURN ? mProbeText : text;
+  SafeWriter writer(line, PROBE_TEXT_SIZE - 1);
+  writeLine(writer, mFunction, aLine.kind(), aLine.fields(), aLine.count());
+  size_t length = writer.length();
+  if (length > 0 && line[length - 1] == '\n') length--;
+  line[length] = '\0';
+
+  if (aLine.kind() == LINE_CALL && PROBE_ENABLED(entry)) {
+    DTRACE_PROBE4(pluginlogger, entry, FunctionName(mFunction),
+        (int)mFunction, mSubject, text);
+  } else if (aLine.kind() == LINE_RETURN && aLine.count() > 0 &&
+      aLine.fields()[0].mName == NULL) {
+    const Field& value = aLine.fields()[0];
+    switch (value.mType) {
+      case FIELD_INT:
+        mProbeReturn = value.mValue.mInt;
+        break;
+      case FIELD_POINTER:
+        mProbeReturn = (intptr_t)value.mValue.mPointer;
+        break;
+      case FIELD_BOOL:
+        mProbeReturn = value.mValue.mBool;
+        break;
+      default:
+        break;
+    }
+  }
+#endif
+}
+
+void
+Log::line(const LogLine& aLine) {
+  if (USDT_PROBES && mProbed && aLine.kind() != LINE_VALUES) {
+    probe(aLine);
+  }
+  if (STALL_THRESHOLD_MS && mWatched && aLine.kind() == LINE_CALL) {
+    Stalls::called(aLine);
+  }
+  if (!mEnabled) {
+    return;
+  } else if (gLogMode == LOGMODE_RECORDER) {
+    Recorder::record(mSerialNumber, monotonicNanos(), mFunction,
+        aLine.kind(), aLine.fields(), aLine.count());
+  } else if (gLogMode == LOGMODE_JSON) {
+    json(aLine);
+  } else {
+    text(aLine);
+  }
+}
+
+void
+Stalls::called(const LogLine& aLine) {
+  if (tDepth == 0 || tDepth > STALL_MAX_DEPTH) return;
+  char* call = gArguments[tDepth - 1];
+  SafeWriter writer(call, STALL_CALL_SIZE - 1);
+  writeLine(writer, tFrames[tDepth - 1].mFunction, LINE_CALL, aLine.fields(),
+      aLine.count());
+  size_t length = writer.length();
+  if (length > 0 && call[length - 1] == '\n') {
+    length--;
+  } else if (length == STALL_CALL_SIZE - 1) {
+    memcpy(call + length - 3, "...", 3);
+  }
+  call[length] = '\0';
+}
+
+void
+Log::text(const LogLine& aLine) {
+  LogBuffer* buffer = LogBuffer::get();
+  uint64_t now = monotonicNanos();
+  buffer->lock();
+  for (;;) {
+    size_t space = LOG_BUFFER_SIZE - buffer->mLength;
+    SafeWriter writer(buffer->mData + buffer->mLength, space);
+    appendLinePrefix(writer, mSerialNumber, now);
+    writeLine(writer, mFunction, aLine.kind(), aLine.fields(),
+        aLine.count());
+    if (writer.length() < space) {
+      buffer->mLength += writer.length();
+      break;
+    }
+    if (buffer->mLength == 0) {
+      // bigger than the whole buffer, cut it short
+      buffer->mData[LOG_BUFFER_SIZE - 1] = '\n';
+      buffer->mLength = LOG_BUFFER_SIZE;
+      break;
+    }
+    buffer->flushLocked();
+  }
+  buffer->unlock();
+
+  buffer->flushIfStale(monotonicMillis());
+}
+
+/* JSON mode: while a call runs, the JSON writer adds its fields to its
+ * thread's scratch stack (calls nest, so it's a stack), and any free text
+ * it logs, like a report, to a second stack for its "text" string. Only
+ * the first line of each kind becomes fields, later ones go in the text
+ * as the text log would write them. When the call returns it's written
+ * out as one line. Lines are written as calls
+ * return, so a call's line comes after those of the calls made while it
+ * ran - sort by "serial" to see them in the order they were made. */
+#ifndef JSON_SCRATCH_SIZE
+#define JSON_SCRATCH_SIZE (64*1024)
+#endif
+
+/* the kernel's id for the calling thread */
+static pid_t
+threadId() {
+  static __thread pid_t tThreadId = 0;
+  if (tThreadId == 0) {
+    tThreadId = syscall(SYS_gettid);
+  }
+  return tThreadId;
+}
+
+void
+Log::startJSON() {
+  mStart = monotonicNanos();
+  mJSONLines = 0;
+
+  LogBuffer* buffer = LogBuffer::get();
+  if (buffer->mScratch == NULL) {
+    buffer->mScratch = (char*)malloc(JSON_SCRATCH_SIZE);
+    buffer->mText = (char*)malloc(JSON_SCRATCH_SIZE);
+  }
+  mJSONStart = buffer->mScratchTop;
+  mJSONTextStart = buffer->mTextTop;
+}
+
+/* add a line to the call's text */
+void
+Log::jsonText(const char* aText, size_t aLength) {
+  LogBuffer* buffer = LogBuffer::get();
+  size_t space = JSON_SCRATCH_SIZE - buffer->mTextTop;
+  if (space < 8) {
+    return;
+  }
+  SafeWriter writer(buffer->mText + buffer->mTextTop, space);
+  if (buffer->mTextTop > mJSONTextStart) {
+    writer.append("\\n");
+  }
+  appendEscaped(writer, aText, aLength);
+  buffer->mTextTop += writer.length();
+}
+
+void
+Log::json(const char* aFormat, va_list aArgs) {
+  char line[PRINTABLE_SIZE];
+  int length = vsnprintf(line, sizeof(line), aFormat, aArgs);
+  if (length < 0) {
+    return;
+  }
+  length = MIN((size_t)length, sizeof(line) - 1);
+  if (length > 0 && line[length - 1] == '\n') length--;
+  jsonText(line, length);
+}
+
+void
+Log::json(const LogLine& aLine) {
+  LineKind kind = aLine.kind();
+  if (mJSONLines & (1 << kind)) {
+    // another line of the same kind would likely repeat keys, like a loop
+    // does, so it goes in the text
+    char line[PRINTABLE_SIZE];
+    SafeWriter writer(line, sizeof(line));
+    writeLine(writer, mFunction, kind, aLine.fields(), aLine.count());
+    jsonText(line, writer.length() - (line[writer.length() - 1] == '\n'));
+    return;
+  }
+  mJSONLines |= 1 << kind;
+
+  LogBuffer* buffer = LogBuffer::get();
+  size_t space = JSON_SCRATCH_SIZE - buffer->mScratchTop;
+  SafeWriter writer(buffer->mScratch + buffer->mScratchTop, space);
+  writeJSONFields(writer, kind, aLine.fields(), aLine.count());
+  // drop anything that doesn't fit rather than write broken JSON
+  if (writer.length() < space) {
+    buffer->mScratchTop += writer.length();
+  }
+}
+
+void
+Log::finishJSON() {
+  LogBuffer* buffer = LogBuffer::get();
+  const char* fields = buffer->mScratch + mJSONStart;
+  size_t fieldsLength = buffer->mScratchTop - mJSONStart;
+  const char* text = buffer->mText + mJSONTextStart;
+  size_t textLength = buffer->mTextTop - mJSONTextStart;
+
+  Conversion none = { NULL, NULL, 'd', 0, false, false, 0 };
+  char head[256];
+  SafeWriter start(head, sizeof(head));
+  start.append("{\"serial\":");
+  start.appendNumber(mSerialNumber, 10, false, none);
+  start.append(",\"thread\":");
+  start.appendNumber(threadId(), 10, false, none);
+  start.append(",\"ts\":");
+  start.appendNumber(Clock::wallNanos(mStart), 10, false, none);
+  start.append(",\"fn\":\"");
+  start.append(FunctionName(mFunction));
+  start.append('"');
+  char tail[64];
+  SafeWriter end(tail, sizeof(tail));
+  end.append(",\"duration_ns\":");
+  end.appendNumber(monotonicNanos() - mStart, 10, false, none);
+  end.append("}\n");
+
+  // the scratch stacks are much smaller than the buffer, so the line
+  // always fits in an empty one
+  size_t length = start.length() + fieldsLength +
+    (textLength > 0 ? textLength + 10 : 0) + end.length();
+  buffer->lock();
+  if (buffer->mLength + length > LOG_BUFFER_SIZE) {
+    buffer->flushLocked();
+  }
+  SafeWriter line(buffer->mData + buffer->mLength,
+      LOG_BUFFER_SIZE - buffer->mLength);
+  line.append(head, start.length());
+  line.append(fields, fieldsLength);
+  if (textLength > 0) {
+    line.append(",\"text\":\"");
+    line.append(text, textLength);
+    line.append('"');
+  }
+  line.append(tail, end.length());
+  buffer->mLength += line.length();
+  buffer->unlock();
+
+  buffer->mScratchTop = mJSONStart;
+  buffer->mTextTop = mJSONTextStart;
+  buffer->flushIfStale(monotonicMillis());
+}
+
+/* helper to get the printable name of an NPNVariable */
+const char*
+NPNVariableName(NPNVariable variable) {
+  switch (variable) {
+    case NPNVxDisplay: return "NPNVxDisplay"; break;
+    case NPNVxtAppContext: return "NPNVxtAppContext"; break;
+    case NPNVnetscapeWindow: return "NPNVnetscapeWindow"; break;
+    case NPNVjavascriptEnabledBool: return "NPNVjavascriptEnabledBool"; break;
+    case NPNVasdEnabledBool: return "NPNVasdEnabledBool"; break;
+    case NPNVisOfflineBool: return "NPNVisOfflineBool"; break;
+    case NPNVserviceManager: return "NPNVserviceManager"; break;
+    case NPNVDOMElement: return "NPNVDOMElement"; break;
+    case NPNVDOMWindow: return "NPNVDOMWindow"; break;
+    case NPNVToolkit: return "NPNVToolkit"; break;
+    case NPNVSupportsXEmbedBool: return "NPNVSupportsXEmbedBool"; break;
+    case NPNVWindowNPObject: return "NPNVWindowNPObject"; break;
+    case NPNVPluginElementNPObject: return "NPNVPluginElementNPObject"; break;
+    case NPNVSupportsWindowless: return "NPNVSupportsWindowless"; break;
+    case NPNVprivateModeBool: return "NPNVprivateModeBool"; break;
+  }
+  return "(unknown NPNVariable)";
+}
+
+/* helper to get the printable name of an NPPVariable */
+const char*
+NPPVariableName(NPPVariable variable) {
+  switch (variable) {
+    case NPPVpluginNameString: return "NPPVpluginNameString"; break;
+    case NPPVpluginDescriptionString: return "NPPVpluginDescriptionString"; break;
+    case NPPVpluginWindowBool: return "NPPVpluginWindowBool"; break;
+    case NPPVpluginTransparentBool: return "NPPVpluginTransparentBool"; break;
+    case NPPVjavaClass: return "NPPVjavaClass"; break;
+    case NPPVpluginWindowSize: return "NPPVpluginWindowSize"; break;
+    case NPPVpluginTimerInterval: return "NPPVpluginTimerInterval"; break;
+    case NPPVpluginScriptableInstance: return "NPPVpluginScriptableInstance"; break;
+    case NPPVpluginScriptableIID: return "NPPVpluginScriptableIID"; break;
+    case NPPVjavascriptPushCallerBool: return "NPPVjavascriptPushCallerBool"; break;
+    case NPPVpluginKeepLibraryInMemory: return "NPPVpluginKeepLibraryInMemory"; break;
+    case NPPVpluginNeedsXEmbed        : return "NPPVpluginNeedsXEmbed"; break;
+    case NPPVpluginScriptableNPObject : return "NPPVpluginScriptableNPObject"; break;
+    case NPPVformValue: return "NPPVformValue"; break;
+    case NPPVpluginUrlRequestsDisplayedBool: return "NPPVpluginUrlRequestsDisplayedBool"; break;
+    case NPPVpluginWantsAllNetworkStreams: return "NPPVpluginWantsAllNetworkStreams"; break;
+  }
+  return "(unknown NPPVariable)";
+}
+
+/* helper to get the printable name of an NPError */
+const char*
+NPErrorName(NPError e) {
+  switch(e) {
+    case NPERR_NO_ERROR: return "NO_ERROR"; break;
+    case NPERR_GENERIC_ERROR: return "GENERIC_ERROR"; break;
+    case NPERR_INVALID_INSTANCE_ERROR: return "INVALID_INSTANCE_ERROR"; break;
+    case NPERR_INVALID_FUNCTABLE_ERROR: return "INVALID_FUNCTABLE_ERROR"; break;
+    case NPERR_MODULE_LOAD_FAILED_ERROR: return "MODULE_LOAD_FAILED_ERROR"; break;
+    case NPERR_OUT_OF_MEMORY_ERROR: return "OUT_OF_MEMORY_ERROR"; break;
+    case NPERR_INVALID_PLUGIN_ERROR: return "INVALID_PLUGIN_ERROR"; break;
+    case NPERR_INVALID_PLUGIN_DIR_ERROR: return "INVALID_PLUGIN_DIR_ERROR"; break;
+    case NPERR_INCOMPATIBLE_VERSION_ERROR: return "INCOMPATIBLE_VERSION_ERROR"; break;
+    case NPERR_INVALID_PARAM: return "INVALID_PARAM"; break;
+    case NPERR_INVALID_URL: return "INVALID_URL"; break;
+    case NPERR_FILE_NOT_FOUND: return "FILE_NOT_FOUND"; break;
+    case NPERR_NO_DATA: return "NO_DATA"; break;
+    case NPERR_STREAM_NOT_SEEKABLE: return "STREAM_NOT_SEEKABLE"; break;
+  }
+  return "UNKNOWN NPError";
+}
+
+#ifdef MOZ_X11
+/* helper to get the printable name of an X event type */
+const char*
+XEventTypeName(int type) {
+  switch(type) {
+    case KeyPress: return "KeyPress"; break;
+    case KeyRelease: return "KeyRelease"; break;
+    case ButtonPress: return "ButtonPress"; break;
+    case ButtonRelease: return "ButtonRelease"; break;
+    case MotionNotify: return "MotionNotify"; break;
+    case EnterNotify: return "EnterNotify"; break;
+    case LeaveNotify: return "LeaveNotify"; break;
+    case FocusIn: return "FocusIn"; break;
+    case FocusOut: return "FocusOut"; break;
+    case KeymapNotify: return "KeymapNotify"; break;
+    case Expose: return "Expose"; break;
+    case GraphicsExpose: return "GraphicsExpose"; break;
+    case NoExpose: return "NoExpose"; break;
+    case VisibilityNotify: return "VisibilityNotify"; break;
+    case CreateNotify: return "CreateNotify"; break;
+    case DestroyNotify: return "DestroyNotify"; break;
+    case UnmapNotify: return "UnmapNotify"; break;
+    case MapNotify: return "MapNotify"; break;
+    case MapRequest: return "MapRequest"; break;
+    case ReparentNotify: return "ReparentNotify"; break;
+    case ConfigureNotify: return "ConfigureNotify"; break;
+    case ConfigureRequest: return "ConfigureRequest"; break;
+    case GravityNotify: return "GravityNotify"; break;
+    case ResizeRequest: return "ResizeRequest"; break;
+    case CirculateNotify: return "CirculateNotify"; break;
+    case CirculateRequest: return "CirculateRequest"; break;
+    case PropertyNotify: return "PropertyNotify"; break;
+    case SelectionClear: return "SelectionClear"; break;
+    case SelectionRequest: return "SelectionRequest"; break;
+    case SelectionNotify: return "SelectionNotify"; break;
+    case ColormapNotify: return "ColormapNotify"; break;
+    case ClientMessage: return "ClientMessage"; break;
+    case MappingNotify: return "MappingNotify"; break;
+    case GenericEvent: return "GenericEvent"; break;
+  }
+  return "UNKNOWN XEvent";
+}
+#endif
+
+/* helper to get the printable name of an NPReason */
+const char*
+NPReasonName(NPReason reason) {
+  switch(reason) {
+    case NPRES_DONE: return "DONE"; break;
+    case NPRES_NETWORK_ERR: return "NETWORK_ERR"; break;
+    case NPRES_USER_BREAK: return "USER_BREAK"; break;
+  }
+  return "UNKNOWN NPReason";
+}
+
+/* NPObject and NPClass tracking */
+typedef enum {
+  ORIGIN_UNKNOWN,
+  ORIGIN_BROWSER,
+  ORIGIN_PLUGIN,
+} NPObjectOrigin;
+/* A path from a root object like "window" to a tracked object. Paths are
+ * trees of interned segments, so a child shares its parent's prefix and
+ * objects reached the same way share a node. The whole path is only
+ * spelled out when someone asks for it. */
+class PathNode {
+  private:
+    typedef std::set<std::string> SegmentSet;
+    typedef std::pair<const PathNode*,const char*> NodeKey;
+    typedef std::map<NodeKey,PathNode*> NodeMap;
+    static SegmentSet gSegments;
+    static NodeMap gNodes;
+    const PathNode* mParent;
+    const char* mSegment;
+    mutable std::string* mRendered;
+    PathNode(const PathNode* aParent, const char* aSegment)
+        : mParent(aParent), mSegment(aSegment), mRendered(NULL) { }
+  public:
+    /* the node for aSegment under aParent, NULL for the empty path */
+    static const PathNode* get(const PathNode* aParent,
+        const std::string& aSegment) {
+      if (aSegment.empty()) {
+        return aParent;
+      }
+      const char* segment = gSegments.insert(aSegment).first->c_str();
+      NodeKey key(aParent, segment);
+      NodeMap::iterator i = gNodes.find(key);
+      if (i != gNodes.end()) {
+        return i->second;
+      }
+      PathNode* node = new PathNode(aParent, segment);
+      gNodes[key] = node;
+      return node;
+    }
+    static const char* c_str(const PathNode* aNode) {
+      return aNode ? aNode->c_str() : "";
+    }
+    const char* c_str() const {
+      if (mRendered == NULL) {
+        mRendered = new std::string(mParent ? mParent->c_str() : "");
+        mRendered->append(mSegment);
+      }
+      return mRendered->c_str();
+    }
+    /* spell out the path without allocating, for the recorder */
+    void write(SafeWriter& aWriter) const {
+      if (mParent) mParent->write(aWriter);
+      aWriter.append(mSegment);
+    }
+};
+PathNode::SegmentSet PathNode::gSegments;
+PathNode::NodeMap PathNode::gNodes;
+
+static char
+originName(NPObjectOrigin aOrigin) {
+  return aOrigin==ORIGIN_BROWSER?'B':(aOrigin==ORIGIN_PLUGIN?'P':'?');
+}
+
+/* What we know about an NPObject: where it came from and how it was
+ * reached. The printable form is only built when it's first asked for. */
+class NPObjectTracker {
+  private:
+    typedef std::map<const NPObject*,NPObjectTracker*> NPObjectMap;
+    static NPObjectMap byObject;
+    ObjectRef mRef;
+    mutable std::string* mPrintable;
+    NPObjectTracker(const NPObject* aObject, NPObjectOrigin aOrigin,
+        const PathNode* aPath) : mPrintable(NULL) {
+      mRef.mOrigin = aOrigin;
+      mRef.mObject = aObject;
+      mRef.mPath = aPath;
+    }
+    NPObjectOrigin origin() const { return (NPObjectOrigin)mRef.mOrigin; }
+    void invalidatePrintable() {
+      delete mPrintable;
+      mPrintable = NULL;
+    }
+    void setOrigin(NPObjectOrigin aOrigin){
+      mRef.mOrigin = aOrigin;
+      invalidatePrintable();
+    }
+    static NPObjectTracker* getTracker(const NPObject* aObject,
+        NPObjectOrigin aOrigin, const PathNode* aPath) {
+      NPObjectMap::iterator i = byObject.find(aObject);
+      if (i == byObject.end()) {
+        NPObjectTracker* tracker = new NPObjectTracker(aObject, aOrigin, aPath);
+        byObject[aObject] = tracker;
+        return tracker;
+      }
+      NPObjectTracker* tracker = i->second;
+      if (tracker->origin() == ORIGIN_UNKNOWN && aOrigin != ORIGIN_UNKNOWN) {
+        tracker->setOrigin(aOrigin);
+      }
+      return tracker;
+    }
+  public:
+    static NPObjectTracker* getTracker(const NPObject* aObject,
+        NPObjectOrigin aOrigin = ORIGIN_UNKNOWN, std::string aPath="") {
+      return getTracker(aObject, aOrigin, PathNode::get(NULL, aPath));
+    }
+    static void dump(Log& aLog) {
+      aLog("  %d objects:\n", (int)byObject.size());
+      for (NPObjectMap::iterator i = byObject.begin(); i != byObject.end();
+          i++) {
+        aLog("    %s\n", i->second->c_str());
+      }
+    }
+    const NPObject* getObject() const { return (const NPObject*)mRef.mObject; }
+    const ObjectRef& ref() const { return mRef; }
+    const PathNode* path() const { return (const PathNode*)mRef.mPath; }
+    const char* c_str() const {
+      if (mPrintable == NULL) {
+        char ptr[64];
+        snprintf(ptr, 64, "%c%p:", originName(origin()), mRef.mObject);
+        mPrintable = new std::string(ptr);
+        mPrintable->append(PathNode::c_str(path()));
+      }
+      return mPrintable->c_str();
+    }
+    /* what to pass to the log for %s */
+
+    NPObjectTracker* trackChild(NPObject* aChildObject,
+        std::string aRelationship) {
+      return getTracker(aChildObject, origin(),
+          PathNode::get(path(), aRelationship));
+    }
+
+    NPObjectTracker* trackChild(NPObject* aChildObject,
+        NPIdentifier aIdentifier, std::string aExtra="") {
+      char buf[256];
+      if (gBrowserFuncs->identifierisstring(aIdentifier)) {
+        NPUTF8* utf8 = gBrowserFuncs->utf8fromidentifier(aIdentifier);
+        snprintf(buf, 256, ".%s", utf8);
+        gBrowserFuncs->memfree(utf8);
+      } else {
+        int32_t intvalue = gBrowserFuncs->intfromidentifier(aIdentifier);
+        snprintf(buf, 256, "[%d]", intvalue);
+      }
+      return trackChild(aChildObject, std::string(buf) + aExtra);
+    }
+    void setPath(std::string aPath) {
+      mRef.mPath = PathNode::get(NULL, aPath);
+      invalidatePrintable();
+    }
+};
+NPObjectTracker::NPObjectMap NPObjectTracker::byObject;
+
+static void
+formatObjectRef(SafeWriter& aWriter, const ObjectRef& aRef) {
+  Conversion none = { NULL, NULL, 'p', 0, false, false, 0 };
+  aWriter.append(originName((NPObjectOrigin)aRef.mOrigin));
+  aWriter.append("0x");
+  aWriter.appendNumber((uintptr_t)aRef.mObject, 16, false, none);
+  aWriter.append(':');
+  if (aRef.mPath) ((const PathNode*)aRef.mPath)->write(aWriter);
+}
+
+static void
+writeObject(SafeWriter& aWriter, const NPObject* aObject, bool aJSON) {
+  const ObjectRef& ref = NPObjectTracker::getTracker(aObject)->ref();
+  if (aJSON) {
+    writeJSONObjectRef(aWriter, ref);
+  } else {
+    formatObjectRef(aWriter, ref);
+  }
+}
+
+/* Counts and times of calls to functions on particular object members,
+ * for reports like the hot object report. Only calls that are being traced
+ * are counted. */
+#ifndef HOT_OBJECTS_TOP
+#define HOT_OBJECTS_TOP 20
+#endif
+class ObjectStats {
+  private:
+    typedef struct Key {
+      const NPObjectTracker* mTracker;
+      NPIdentifier mIdentifier;
+      FunctionId mFunction;
+      bool operator<(const Key& aOther) const {
+        if (mTracker != aOther.mTracker) return mTracker < aOther.mTracker;
+        if (mIdentifier != aOther.mIdentifier) {
+          return mIdentifier < aOther.mIdentifier;
+        }
+        return mFunction < aOther.mFunction;
+      }
+    } Key;
+    typedef struct {
+      uint64_t mCalls;
+      uint64_t mNanos;
+    } Entry;
+    typedef std::map<Key,Entry> EntryMap;
+    typedef std::pair<Key,Entry> Item;
+    const char* mName;
+    EntryMap mEntries;
+    static bool byTime(const Item& aA, const Item& aB) {
+      return aA.second.mNanos > aB.second.mNanos;
+    }
+  public:
+    ObjectStats(const char* aName) : mName(aName) { }
+    void record(FunctionId aFunction, const NPObject* aObject,
+        NPIdentifier aIdentifier, uint64_t aNanos) {
+      Key key = { NPObjectTracker::getTracker(aObject), aIdentifier,
+        aFunction };
+      Entry& entry = mEntries[key];
+      entry.mCalls++;
+      entry.mNanos += aNanos;
+    }
+    /* log the HOT_OBJECTS_TOP entries that took the most time */
+    void report(Log& aLog) {
+      if (mEntries.empty()) return;
+      std::vector<Item> items(mEntries.begin(), mEntries.end());
+      size_t top = MIN(items.size(), (size_t)HOT_OBJECTS_TOP);
+      std::partial_sort(items.begin(), items.begin() + top, items.end(),
+          byTime);
+      aLog("  %s (%d of %d):\n", mName, (int)top, (int)items.size());
+      for (size_t i = 0; i < top; i++) {
+        const Key& key = items[i].first;
+        const Entry& entry = items[i].second;
+        aLog("    %8llu calls %12lluns %s %s%s%s\n",
+            (unsigned long long)entry.mCalls,
+            (unsigned long long)entry.mNanos,
+            FunctionName(key.mFunction), key.mTracker->c_str(),
+            key.mIdentifier ? " " : "",
+            key.mIdentifier ? Printable(key.mIdentifier).c_str() :
+            "");
+      }
+    }
+};
+
+/* the hot object report: which objects' members get used the most, to
+ * find chatty scripting. Only traced calls are timed, so it leaves out
+ * functions turned off in CONTROLFILE and the time tracing was off. */
+static ObjectStats gHotObjects("hot objects in traced calls");
+
+/* Build with -DREDUNDANT_CALLS=1 to look for scripting calls whose answer
+ * the caller already had: a hasMethod or hasProperty straight before the
+ * invoke or getProperty it was checking for, and a getProperty that gives
+ * the same value as the last one in the same turn of the browser's event
+ * loop. The time those calls took is reported as wasted, against the call
+ * that could have been left out. The same patterns can be found offline
+ * in a JSON mode log. */
+#ifndef REDUNDANT_CALLS
+#define REDUNDANT_CALLS 0
+#endif
+
+/* Turns of the browser's event loop as the plugin sees them: each
+ * outermost call from the browser into the plugin starts a new turn. */
+class EventLoop {
+  private:
+    static __thread int tDepth;
+    static unsigned gTurn;
+  public:
+    /* put one of these in each way the browser calls into the plugin */
+    class Call {
+      public:
+        Call() {
+          if (REDUNDANT_CALLS && tDepth++ == 0) gTurn++;
+        }
+        ~Call() {
+          if (REDUNDANT_CALLS) tDepth--;
+        }
+    };
+    static unsigned turn() { return gTurn; }
+};
+__thread int EventLoop::tDepth = 0;
+unsigned EventLoop::gTurn = 0;
+
+class RedundantCalls {
+  private:
+    /* the last check made on each side: the plugin calling the browser
+     * and the browser calling the plugin */
+    typedef struct {
+      FunctionId mFunction;
+      const NPObject* mObject;
+      NPIdentifier mIdentifier;
+      uint64_t mNanos;
+    } Check;
+    static Check gLastCheck[2];
+    /* the values getProperty gave in this turn */
+    typedef std::pair<const NPObject*,NPIdentifier> Property;
+    typedef std::map<Property,uint64_t> ValueMap;
+    static ValueMap gValues;
+    static unsigned gValuesTurn;
+    static int side(FunctionId aFunction) {
+      return aFunction >= FN_NPClass_allocate &&
+        aFunction <= FN_NPClass_construct;
+    }
+    /* the call that a successful aFunction makes pointless, if any */
+    static FunctionId checkFor(FunctionId aFunction) {
+      switch (aFunction) {
+        case FN_NPN_HasMethod: return FN_NPN_Invoke;
+        case FN_NPN_HasProperty: return FN_NPN_GetProperty;
+        case FN_NPClass_hasMethod: return FN_NPClass_invoke;
+        case FN_NPClass_hasProperty: return FN_NPClass_getProperty;
+        default: return FN_pluginlogger;
+      }
+    }
+    static uint64_t hash(const NPVariant& aValue);
+  public:
+    static ObjectStats gWasted;
+    static void check(FunctionId aFunction, const NPObject* aObject,
+        NPIdentifier aIdentifier, uint64_t aNanos, bool aResult,
+        const NPVariant* aValue);
+};
+RedundantCalls::Check RedundantCalls::gLastCheck[2];
+RedundantCalls::ValueMap RedundantCalls::gValues;
+unsigned RedundantCalls::gValuesTurn = 0;
+ObjectStats RedundantCalls::gWasted("redundant calls");
+
+/* FNV-1a over what makes two values the same */
+uint64_t
+RedundantCalls::hash(const NPVariant& aValue) {
+  uint64_t h = 14695981039346656037ULL;
+  const unsigned char* data;
+  size_t length;
+  switch (aValue.type) {
+    case NPVariantType_String:
+      data = (const unsigned char*)aValue.value.stringValue.UTF8Characters;
+      length = aValue.value.stringValue.UTF8Length;
+      break;
+    case NPVariantType_Bool:
+      data = (const unsigned char*)&aValue.value.boolValue;
+      length = sizeof(aValue.value.boolValue);
+      break;
+    case NPVariantType_Int32:
+      data = (const unsigned char*)&aValue.value.intValue;
+      length = sizeof(aValue.value.intValue);
+      break;
+    case NPVariantType_Double:
+      data = (const unsigned char*)&aValue.value.doubleValue;
+      length = sizeof(aValue.value.doubleValue);
+      break;
+    case NPVariantType_Object:
+      data = (const unsigned char*)&aValue.value.objectValue;
+      length = sizeof(aValue.value.objectValue);
+      break;
+    default:
+      data = NULL;
+      length = 0;
+      break;
+  }
+  h = (h ^ aValue.type) * 1099511628211ULL;
+  for (size_t i = 0; i < length; i++) {
+    h = (h ^ data[i]) * 1099511628211ULL;
+  }
+  return h;
+}
+
+void
+RedundantCalls::check(FunctionId aFunction, const NPObject* aObject,
+    NPIdentifier aIdentifier, uint64_t aNanos, bool aResult,
+    const NPVariant* aValue) {
+  Check& last = gLastCheck[side(aFunction)];
+  if (checkFor(last.mFunction) == aFunction && last.mObject == aObject &&
+      last.mIdentifier == aIdentifier) {
+    gWasted.record(last.mFunction, aObject, aIdentifier, last.mNanos);
+  }
+  if (aResult && checkFor(aFunction) != FN_pluginlogger) {
+    last.mFunction = aFunction;
+    last.mObject = aObject;
+    last.mIdentifier = aIdentifier;
+    last.mNanos = aNanos;
+  } else {
+    last.mFunction = FN_pluginlogger;
+  }
+
+  if ((aFunction == FN_NPN_GetProperty ||
+        aFunction == FN_NPClass_getProperty) && aResult && aValue) {
+    if (gValuesTurn != EventLoop::turn()) {
+      gValues.clear();
+      gValuesTurn = EventLoop::turn();
+    }
+    // the sides get different objects, so they can share the map
+    uint64_t h = hash(*aValue);
+    Property property(aObject, aIdentifier);
+    ValueMap::iterator i = gValues.find(property);
+    if (i != gValues.end() && i->second == h) {
+      gWasted.record(aFunction, aObject, aIdentifier, aNanos);
+    } else {
+      gValues[property] = h;
+    }
+  }
+}
+
+/* times the call a wrapper passes on, for the object reports */
+class ObjectTimer {
+  private:
+    Log& mLog;
+    const NPObject* mObject;
+    NPIdentifier mIdentifier;
+    uint64_t mStart;
+  public:
+    ObjectTimer(Log& aLog, const NPObject* aObject, NPIdentifier aIdentifier)
+        : mLog(aLog), mObject(aObject), mIdentifier(aIdentifier), mStart(0) {
+      if (mLog.traced()) mStart = monotonicNanos();
+    }
+    void done(bool aResult = true, const NPVariant* aValue = NULL) {
+      if (mLog.traced()) {
+        uint64_t nanos = monotonicNanos() - mStart;
+        gHotObjects.record(mLog.function(), mObject, mIdentifier, nanos);
+        if (REDUNDANT_CALLS) {
+          RedundantCalls::check(mLog.function(), mObject, mIdentifier, nanos,
+              aResult, aValue);
+        }
+      }
+    }
+};
+
+/* A histogram with a bucket for each power of two, which any thread can
+ * add to without locking. It also keeps the last value added, so it can be
+ * read as a gauge too. */
+#define HISTOGRAM_BUCKETS 64
+class Histogram {
+  private:
+    const char* mName;
+    const char* mUnit;
+    uint64_t mBuckets[HISTOGRAM_BUCKETS];
+    uint64_t mCount;
+    uint64_t mSum;
+    uint64_t mMax;
+    uint64_t mLast;
+  public:
+    Histogram(const char* aName, const char* aUnit)
+        : mName(aName), mUnit(aUnit), mCount(0), mSum(0),
+          mMax(0), mLast(0) {
+      memset(mBuckets, 0, sizeof(mBuckets));
+    }
+    void record(uint64_t aValue) {
+      // bucket n holds values from 2^(n-1) up to 2^n
+      int bucket = aValue ? 64 - __builtin_clzll(aValue) : 0;
+      __atomic_add_fetch(&mBuckets[MIN(bucket, HISTOGRAM_BUCKETS - 1)], 1,
+          __ATOMIC_RELAXED);
+      __atomic_add_fetch(&mCount, 1, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&mSum, aValue, __ATOMIC_RELAXED);
+      __atomic_store_n(&mLast, aValue, __ATOMIC_RELAXED);
+      uint64_t max = __atomic_load_n(&mMax, __ATOMIC_RELAXED);
+      while (aValue > max && !__atomic_compare_exchange_n(&mMax, &max, aValue,
+            true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      }
+    }
+    uint64_t count() const { return __atomic_load_n(&mCount, __ATOMIC_RELAXED); }
+    uint64_t last() const { return __atomic_load_n(&mLast, __ATOMIC_RELAXED); }
+    /* log the summary and each bucket that has anything in it */
+    void report(Log& aLog) const {
+      uint64_t count = this->count();
+      if (count == 0) return;
+      aLog("  %s: %llu samples, last %llu%s, mean %llu%s, max %llu%s\n",
+          mName, (unsigned long long)count,
+          (unsigned long long)last(), mUnit,
+          (unsigned long long)(__atomic_load_n(&mSum, __ATOMIC_RELAXED) /
+            count), mUnit,
+          (unsigned long long)__atomic_load_n(&mMax, __ATOMIC_RELAXED),
+          mUnit);
+      for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        uint64_t bucket = __atomic_load_n(&mBuckets[i], __ATOMIC_RELAXED);
+        if (bucket == 0) continue;
+        aLog("    < %llu%s: %llu\n", 1ULL << i, mUnit,
+            (unsigned long long)bucket);
+      }
+    }
+};
+
+/* Calls the plugin asks the browser to make on the main thread go through
+ * asyncCallThunk() so we can see how long they wait in the browser's queue,
+ * how long they take and how many are waiting. What each one needs is kept
+ * in a small pool, which grows from the heap if the queue gets deep. The
+ * browser drops the calls still queued for an instance when it's destroyed
+ * and for every instance at shutdown, so the ones waiting are kept on a
+ * list to be taken back then. Calls are never freed, since the browser
+ * may still run one we've taken back, and asyncCallThunk has to be able
+ * to look at it to see that. */
+#ifndef ASYNC_CALL_POOL_SIZE
+#define ASYNC_CALL_POOL_SIZE 64
+#endif
+typedef struct AsyncCall {
+  void (*mFunction)(void*);
+  void* mUserData;
+  uint64_t mScheduled;
+  NPP mNPP; // the browser's
+  bool mWaiting; // on the list of calls the browser has queued
+  struct AsyncCall* mNextFree;
+  struct AsyncCall* mPrevWaiting;
+  struct AsyncCall* mNextWaiting;
+} AsyncCall;
+
+class AsyncCalls {
+  private:
+    static AsyncCall gPool[ASYNC_CALL_POOL_SIZE];
+    static AsyncCall* gFree;
+    static AsyncCall* gQueued; // waiting for the browser to run them
+    /* plugin threads queue calls while the main thread runs them, and
+     * reclaim() holds it across the whole list, so wait rather than spin */
+    static pthread_mutex_t gLock;
+    static bool gLinked;
+    static void lock() { pthread_mutex_lock(&gLock); }
+    static void unlock() { pthread_mutex_unlock(&gLock); }
+    /* call with the lock held */
+    static void unqueue(AsyncCall* aCall) {
+      aCall->mWaiting = false;
+      if (aCall->mPrevWaiting) {
+        aCall->mPrevWaiting->mNextWaiting = aCall->mNextWaiting;
+      } else {
+        gQueued = aCall->mNextWaiting;
+      }
+      if (aCall->mNextWaiting) {
+        aCall->mNextWaiting->mPrevWaiting = aCall->mPrevWaiting;
+      }
+    }
+  public:
+    static int gWaiting;
+    static Histogram gLatency;
+    static Histogram gDuration;
+    static Histogram gDepth;
+    static AsyncCall* get() {
+      lock();
+      if (!gLinked) {
+        for (int i = 0; i < ASYNC_CALL_POOL_SIZE; i++) {
+          gPool[i].mNextFree = gFree;
+          gFree = &gPool[i];
+        }
+        gLinked = true;
+      }
+      AsyncCall* call = gFree;
+      if (call) gFree = call->mNextFree;
+      unlock();
+      if (call == NULL) {
+        call = new AsyncCall;
+        call->mWaiting = false;
+      }
+      return call;
+    }
+    static void release(AsyncCall* aCall) {
+      lock();
+      aCall->mNextFree = gFree;
+      gFree = aCall;
+      unlock();
+    }
+    /* note that aCall has been handed to the browser */
+    static void queued(AsyncCall* aCall) {
+      lock();
+      aCall->mWaiting = true;
+      aCall->mPrevWaiting = NULL;
+      aCall->mNextWaiting = gQueued;
+      if (gQueued) gQueued->mPrevWaiting = aCall;
+      gQueued = aCall;
+      unlock();
+    }
+    /* whether the browser is running a call we're still waiting on, rather
+     * than one we've taken back, and if so it's not waiting any more */
+    static bool running(AsyncCall* aCall) {
+      lock();
+      bool waiting = aCall->mWaiting;
+      if (waiting) unqueue(aCall);
+      unlock();
+      return waiting;
+    }
+    /* take back the calls waiting for aNPP, or for every instance with
+     * NULL, and return how many there were */
+    static int reclaim(NPP aNPP) {
+      AsyncCall* dropped = NULL;
+      int count = 0;
+      lock();
+      for (AsyncCall* call = gQueued; call != NULL; ) {
+        AsyncCall* next = call->mNextWaiting;
+        if (aNPP == NULL || call->mNPP == aNPP) {
+          unqueue(call);
+          call->mNextWaiting = dropped;
+          dropped = call;
+          count++;
+        }
+        call = next;
+      }
+      unlock();
+      while (dropped != NULL) {
+        AsyncCall* next = dropped->mNextWaiting;
+        release(dropped);
+        dropped = next;
+      }
+      if (count > 0) {
+        LiveStats::asyncCalls(
+            __atomic_sub_fetch(&gWaiting, count, __ATOMIC_RELAXED));
+      }
+      return count;
+    }
+    static void report(Log& aLog) {
+      if (gDepth.count() == 0) return;
+      aLog("  async calls: %d waiting\n",
+          __atomic_load_n(&gWaiting, __ATOMIC_RELAXED));
+      gLatency.report(aLog);
+      gDuration.report(aLog);
+      gDepth.report(aLog);
+    }
+};
+AsyncCall AsyncCalls::gPool[ASYNC_CALL_POOL_SIZE];
+AsyncCall* AsyncCalls::gFree = NULL;
+AsyncCall* AsyncCalls::gQueued = NULL;
+pthread_mutex_t AsyncCalls::gLock = PTHREAD_MUTEX_INITIALIZER;
+bool AsyncCalls::gLinked = false;
+int AsyncCalls::gWaiting = 0;
+Histogram AsyncCalls::gLatency("async call latency", "ns");
+Histogram AsyncCalls::gDuration("async call duration", "ns");
+Histogram AsyncCalls::gDepth("async calls waiting", "");
+
+#ifdef MOZ_X11
+/* On X11 the plugin paints and gets input through NPP_HandleEvent, so we
+ * keep a histogram of how long it takes over each type of event and log
+ * any GraphicsExpose that takes longer than SLOW_PAINT_MS. */
+#ifndef SLOW_PAINT_MS
+#define SLOW_PAINT_MS 16
+#endif
+class XEvents {
+  private:
+    static Histogram* gDurations[LASTEvent];
+  public:
+    static uint64_t gSlowPaints;
+    static void record(int aType, uint64_t aNanos) {
+      if (aType < 0 || aType >= LASTEvent) return;
+      if (gDurations[aType] == NULL) {
+        gDurations[aType] = new Histogram(XEventTypeName(aType), "ns");
+      }
+      gDurations[aType]->record(aNanos);
+    }
+    /* NULL until an event of that type has been recorded */
+    static const Histogram* durations(int aType) {
+      if (aType < 0 || aType >= LASTEvent) return NULL;
+      return gDurations[aType];
+    }
+    static void report(Log& aLog) {
+      if (gSlowPaints) {
+        aLog("  slow paints: %llu over %dms\n",
+            (unsigned long long)gSlowPaints, SLOW_PAINT_MS);
+      }
+      for (int i = 0; i < LASTEvent; i++) {
+        if (gDurations[i]) gDurations[i]->report(aLog);
+      }
+    }
+};
+Histogram* XEvents::gDurations[LASTEvent];
+uint64_t XEvents::gSlowPaints = 0;
+
+/* what an XEvent is, with where for the ones that paint */
+static void
+describeXEvent(char* aBuffer, size_t aSize, const XEvent* aEvent) {
+  const char* name = XEventTypeName(aEvent->type);
+  switch (aEvent->type) {
+    case GraphicsExpose:
+      {
+        const XGraphicsExposeEvent& e = aEvent->xgraphicsexpose;
+        snprintf(aBuffer, aSize, "%s drawable=0x%lx x=%d y=%d width=%d "
+            "height=%d", name, e.drawable, e.x, e.y, e.width, e.height);
+      }
+      break;
+    case Expose:
+      {
+        const XExposeEvent& e = aEvent->xexpose;
+        snprintf(aBuffer, aSize, "%s x=%d y=%d width=%d height=%d count=%d",
+            name, e.x, e.y, e.width, e.height, e.count);
+      }
+      break;
+    case MotionNotify:
+      snprintf(aBuffer, aSize, "%s x=%d y=%d state=0x%x", name,
+          aEvent->xmotion.x, aEvent->xmotion.y, aEvent->xmotion.state);
+      break;
+    case ButtonPress: case ButtonRelease:
+      snprintf(aBuffer, aSize, "%s button=%u x=%d y=%d state=0x%x", name,
+          aEvent->xbutton.button, aEvent->xbutton.x, aEvent->xbutton.y,
+          aEvent->xbutton.state);
+      break;
+    case KeyPress: case KeyRelease:
+      snprintf(aBuffer, aSize, "%s keycode=%u state=0x%x", name,
+          aEvent->xkey.keycode, aEvent->xkey.state);
+      break;
+    case EnterNotify: case LeaveNotify:
+      snprintf(aBuffer, aSize, "%s x=%d y=%d", name, aEvent->xcrossing.x,
+          aEvent->xcrossing.y);
+      break;
+    default:
+      snprintf(aBuffer, aSize, "%s", name);
+      break;
+  }
+}
+#endif
+
+/* Build with -DMEMOIZE_CLASSES=\"0x7f0123456780:...\" to have the
+ * wrapper answer hasMethod and hasProperty itself once it has seen the
+ * plugin's answer, for plugin classes whose answers don't change. A class
+ * is named by the address of the plugin's NPClass, which is the aClass
+ * that NPN_CreateObject logs (so the plugin has to load at the same
+ * address each time, eg with setarch -R), and "*" names them all. A class
+ * forgets its answers whenever one of its objects is invalidated, since
+ * that's when a plugin tears down what its objects answer for. */
+#ifndef MEMOIZE_CLASSES
+#define MEMOIZE_CLASSES ""
+#endif
+
+/* remembered answers to hasMethod or hasProperty for one class */
+class Memo {
+  private:
+    std::map<NPIdentifier,bool> mAnswers;
+  public:
+    uint64_t mHits;
+    uint64_t mMisses;
+    Memo() : mHits(0), mMisses(0) { }
+    bool lookup(NPIdentifier aName, bool* aAnswer) {
+      std::map<NPIdentifier,bool>::iterator i = mAnswers.find(aName);
+      if (i == mAnswers.end()) {
+        mMisses++;
+        return false;
+      }
+      mHits++;
+      *aAnswer = i->second;
+      return true;
+    }
+    void remember(NPIdentifier aName, bool aAnswer) {
+      mAnswers[aName] = aAnswer;
+    }
+    void forget() { mAnswers.clear(); }
+};
+
+/* The NPClass we give the browser in place of one of the plugin's. It
+ * starts with the NPClass so the browser can use it as one, and remembers
+ * the class it stands in for so calls can be passed on without a lookup. */
+typedef struct {
+  NPClass mWrapper;
+  NPClass* mClass;
+  bool mMemoize;
+  Memo mHasMethod;
+  Memo mHasProperty;
+} WrappedClass;
+
+class NPClassTracker {
+  private:
+    typedef std::map<NPClass*,WrappedClass*> NPClassMap;
+    NPClassMap mWrappers;
+  public:
+    static NPClass* getClass(NPClass* aWrapper) {
+      return ((WrappedClass*)aWrapper)->mClass;
+    }
+    inline NPClass* wrap(NPClass* aClass);
+    /* aObject's class if its answers are being memoized */
+    static WrappedClass* memoizing(NPObject* aObject) {
+      WrappedClass* wrapped = (WrappedClass*)aObject->_class;
+      return wrapped->mMemoize ? wrapped : NULL;
+    }
+    /* forget what aObject's class has been remembering */
+    static void forget(NPObject* aObject) {
+      WrappedClass* wrapped = (WrappedClass*)aObject->_class;
+      if (wrapped->mMemoize) {
+        wrapped->mHasMethod.forget();
+        wrapped->mHasProperty.forget();
+      }
+    }
+    void report(Log& aLog);
+  private:
+    static bool memoize(const NPClass* aClass);
+};
+
+/* One of the plugins we're wrapping, with everything we know about it. */
+class PluginTarget {
+  private:
+    typedef std::map<std::string,PluginTarget*> TargetMap;
+    static TargetMap gByType;
+    bool mLoadAttempted;
+    bool mHaveInfo;
+  public:
+    std::string mPath;
+    void* mHandle;
+    ExportedPluginFunctions mFunctions;
+    NPPluginFuncs* mPluginFuncs;
+    PluginInfo mInfo;
+    StartupTimes mStartupTimes;
+    NPClassTracker mClasses;
+
+    PluginTarget(const std::string& aPath)
+        : mLoadAttempted(false), mHaveInfo(false), mPath(aPath),
+          mHandle(NULL), mPluginFuncs(NULL) {
+      memset(&mFunctions, 0, sizeof(mFunctions));
+      memset(&mStartupTimes, 0, sizeof(mStartupTimes));
+    }
+    void load();
+    const PluginInfo& info();
+    /* remember which MIME types this plugin handles */
+    void registerTypes();
+    /* the plugin that handles aType */
+    static PluginTarget* forType(const char* aType);
+};
+PluginTarget::TargetMap PluginTarget::gByType;
+static std::vector<PluginTarget*> gTargets;
+
+/* Each instance gets its own NPP to hand to the plugin. The browser's NPP
+ * points to us through pdata, which belongs to the plugin (and we're the
+ * plugin as far as the browser is concerned), and the plugin's NPP points
+ * to us through ndata, which belongs to the browser (and we're the browser
+ * as far as the plugin is concerned). That way the wrappers can get from
+ * either NPP to the instance, and its target, without a lookup. */
+typedef void (*TimerFunc)(NPP npp, uint32_t timerID);
+
+/* How a timer, or all of an instance's timers with the same interval, has
+ * been firing: how late compared to its interval (early if negative) and
+ * how long the plugin's callback took. */
+class TimerStats {
+  public:
+    uint64_t mFires;
+    int64_t mLateNanos;
+    int64_t mMaxLateNanos;
+    uint64_t mNanos;
+    uint64_t mMaxNanos;
+    TimerStats() : mFires(0), mLateNanos(0), mMaxLateNanos(0), mNanos(0),
+      mMaxNanos(0) { }
+    void record(int64_t aLateNanos, uint64_t aNanos) {
+      if (mFires == 0 || aLateNanos > mMaxLateNanos) {
+        mMaxLateNanos = aLateNanos;
+      }
+      mFires++;
+      mLateNanos += aLateNanos;
+      mNanos += aNanos;
+      if (aNanos > mMaxNanos) mMaxNanos = aNanos;
+    }
+    /* log these stats after aWhat, which describes the timer(s) */
+    void report(Log& aLog, const char* aWhat) const {
+      if (mFires == 0) {
+        aLog("  %s: never fired\n", aWhat);
+        return;
+      }
+      aLog("  %s: %llu fires, late %lldus mean %lldus max, callback %lluus "
+          "mean %lluus max %lluus total\n", aWhat,
+          (unsigned long long)mFires, (long long)(mLateNanos / (int64_t)mFires / 1000),
+          (long long)(mMaxLateNanos / 1000),
+          (unsigned long long)(mNanos / mFires / 1000),
+          (unsigned long long)(mMaxNanos / 1000),
+          (unsigned long long)(mNanos / 1000));
+    }
+};
+
+/* a timer the plugin scheduled, which fires through timerTrampoline() */
+typedef struct {
+  TimerFunc mFunction;
+  uint32_t mInterval;
+  bool mRepeat;
+  uint64_t mLastFired; // or when it was scheduled
+  TimerStats mStats;
+} Timer;
+
+/* The URL requests an instance makes, matched up with the streams that
+ * answer them and its notifications, so they can be logged as a waterfall
+ * like a HAR file's when the instance is destroyed. Streams the plugin
+ * didn't ask for (like the one for its src) are included too. */
+#ifndef URL_REQUESTS_MAX
+#define URL_REQUESTS_MAX 1000
+#endif
+#define WATERFALL_WIDTH 40
+typedef struct {
+  const char* mMethod;
+  std::string mURL;
+  bool mNotify;
+  void* mNotifyData;
+  NPStream* mStream;
+  uint64_t mRequested; // 0 for streams the plugin didn't ask for
+  uint64_t mStreamStarted;
+  uint64_t mFirstByte;
+  uint64_t mFinished;
+  uint64_t mBytes;
+  NPReason mReason;
+} URLRequest;
+
+class URLRequests {
+  private:
+    std::vector<URLRequest> mRequests;
+    std::map<NPStream*,size_t> mStreams; // open streams' requests
+    unsigned mDropped;
+    URLRequest* add(const char* aMethod, const char* aURL) {
+      if (mRequests.size() >= URL_REQUESTS_MAX) {
+        mDropped++;
+        return NULL;
+      }
+      mRequests.push_back(URLRequest());
+      URLRequest& request = mRequests.back();
+      request.mMethod = aMethod;
+      request.mURL = aURL ? aURL : "";
+      request.mNotify = false;
+      request.mNotifyData = NULL;
+      request.mStream = NULL;
+      request.mRequested = request.mStreamStarted = request.mFirstByte =
+        request.mFinished = request.mBytes = 0;
+      request.mReason = NPRES_DONE;
+      return &request;
+    }
+    URLRequest* forStream(NPStream* aStream) {
+      std::map<NPStream*,size_t>::iterator i = mStreams.find(aStream);
+      return i == mStreams.end() ? NULL : &mRequests[i->second];
+    }
+  public:
+    URLRequests() : mDropped(0) { }
+    void requested(const char* aMethod, const char* aURL, const char* aWindow,
+        bool aNotify, void* aNotifyData) {
+      URLRequest* request = add(aMethod, aURL);
+      if (request == NULL) return;
+      request->mNotify = aNotify;
+      request->mNotifyData = aNotifyData;
+      request->mRequested = monotonicNanos();
+      if (aWindow && !aNotify) {
+        // it's going to a browser window, so that's all we'll see of it
+        request->mFinished = request->mRequested;
+      }
+    }
+    /* match a new stream to the oldest request that's waiting for one, by
+     * notifyData and URL, or by notifyData alone in case of redirects */
+    void streamStarted(NPStream* aStream) {
+      URLRequest* match = NULL;
+      for (int pass = 0; pass < 2 && match == NULL; pass++) {
+        for (size_t i = 0; i < mRequests.size(); i++) {
+          URLRequest& request = mRequests[i];
+          if (request.mStreamStarted || request.mFinished ||
+              request.mRequested == 0 ||
+              request.mNotifyData != aStream->notifyData) {
+            continue;
+          }
+          if (pass == 0 ? request.mURL == aStream->url :
+              request.mNotifyData != NULL) {
+            match = &request;
+            break;
+          }
+        }
+      }
+      if (match == NULL) match = add("STREAM", aStream->url);
+      if (match == NULL) return;
+      match->mStream = aStream;
+      match->mStreamStarted = monotonicNanos();
+      mStreams[aStream] = match - &mRequests[0];
+    }
+    void wrote(NPStream* aStream, int32_t aLength) {
+      URLRequest* request = forStream(aStream);
+      if (request == NULL || aLength <= 0) return;
+      if (request->mFirstByte == 0) request->mFirstByte = monotonicNanos();
+      request->mBytes += aLength;
+    }
+    void streamDestroyed(NPStream* aStream, NPReason aReason) {
+      URLRequest* request = forStream(aStream);
+      if (request == NULL) return;
+      request->mReason = aReason;
+      if (!request->mNotify) request->mFinished = monotonicNanos();
+      mStreams.erase(aStream);
+    }
+    void notified(const char* aURL, NPReason aReason, void* aNotifyData) {
+      URLRequest* match = NULL;
+      for (size_t i = 0; i < mRequests.size(); i++) {
+        URLRequest& request = mRequests[i];
+        if (!request.mNotify || request.mFinished ||
+            request.mNotifyData != aNotifyData) {
+          continue;
+        }
+        match = &request;
+        if (aURL && request.mURL == aURL) break;
+      }
+      if (match == NULL) return;
+      match->mReason = aReason;
+      match->mFinished = monotonicNanos();
+    }
+    /* log each request's timeline, relative to aStart */
+    void report(Log& aLog, uint64_t aStart);
+};
+
+/* How an instance invalidates and repaints: how often and how much it
+ * invalidates, how long the browser takes to ask for the paint and how
+ * long the paint takes, and second by second how many frames that made.
+ * Paints are only seen where we can decode events, which is on X11. */
+#ifndef FRAME_TIMELINE_SECONDS
+#define FRAME_TIMELINE_SECONDS 600
+#endif
+typedef struct {
+  unsigned mInvalidations;
+  unsigned mFrames;
+  uint64_t mArea;
+  uint64_t mPaintNanos;
+} FrameSecond;
+
+class FramePacing {
+  private:
+    uint64_t mStart;
+    uint64_t mInvalidatedSince; // 0 if there's been a paint since
+    uint64_t mInvalidations;
+    uint64_t mRegions; // invalidations we don't know the area of
+    uint64_t mArea;
+    std::vector<FrameSecond> mSeconds;
+    Histogram mLatency;
+    Histogram mPaints;
+    FrameSecond* second(uint64_t aNow) {
+      size_t n = (aNow - mStart) / 1000000000;
+      if (n >= FRAME_TIMELINE_SECONDS) return NULL;
+      if (n >= mSeconds.size()) {
+        FrameSecond empty = { 0, 0, 0, 0 };
+        mSeconds.resize(n + 1, empty);
+      }
+      return &mSeconds[n];
+    }
+  public:
+    FramePacing() : mStart(monotonicNanos()), mInvalidatedSince(0),
+      mInvalidations(0), mRegions(0), mArea(0),
+      mLatency("invalidate to paint", "ns"),
+      mPaints("paint duration", "ns") { }
+    /* aArea is 0 if it isn't known */
+    void invalidated(uint64_t aArea) {
+      uint64_t now = monotonicNanos();
+      if (mInvalidatedSince == 0) mInvalidatedSince = now;
+      mInvalidations++;
+      mArea += aArea;
+      if (aArea == 0) mRegions++;
+      FrameSecond* s = second(now);
+      if (s) {
+        s->mInvalidations++;
+        s->mArea += aArea;
+      }
+    }
+    void painted(uint64_t aStart, uint64_t aNanos) {
+      if (mInvalidatedSince != 0 && aStart >= mInvalidatedSince) {
+        mLatency.record(aStart - mInvalidatedSince);
+      }
+      mInvalidatedSince = 0;
+      mPaints.record(aNanos);
+      FrameSecond* s = second(aStart);
+      if (s) {
+        s->mFrames++;
+        s->mPaintNanos += aNanos;
+      }
+    }
+    void report(Log& aLog) {
+      if (mInvalidations == 0 && mPaints.count() == 0) return;
+      double seconds = (monotonicNanos() - mStart) / 1e9;
+      aLog("  frames: %llu paints, %llu invalidations (%.1f/s, %llu of them "
+          "regions), %llu pixels invalidated\n",
+          (unsigned long long)mPaints.count(),
+          (unsigned long long)mInvalidations, mInvalidations / seconds,
+          (unsigned long long)mRegions, (unsigned long long)mArea);
+      mLatency.report(aLog);
+      mPaints.report(aLog);
+      for (size_t i = 0; i < mSeconds.size(); i++) {
+        const FrameSecond& s = mSeconds[i];
+        if (s.mInvalidations == 0 && s.mFrames == 0) continue;
+        aLog("    %4ds: %3u fps, %4u invalidations, %9llu pixels, "
+            "%6lluus painting\n", (int)i, s.mFrames, s.mInvalidations,
+            (unsigned long long)s.mArea,
+            (unsigned long long)s.mPaintNanos / 1000);
+      }
+    }
+};
+
+/* Build with -DCOALESCE_INVALIDATIONS=1 to have NPN_InvalidateRect gather
+ * an instance's rectangles into their bounding box and pass that on to the
+ * browser once, from an async call on the main thread, for plugins that
+ * invalidate lots of little rectangles each frame. */
+#ifndef COALESCE_INVALIDATIONS
+#define COALESCE_INVALIDATIONS 0
+#endif
+/* Build with -DCOALESCE_WRITES=N to have NPP_Write gather up the browser's
+ * chunks of a stream until there are N bytes, or as many as the plugin
+ * last said it was ready for if that's fewer, and pass them to the plugin
+ * in one write. Whatever's left is passed on when the stream ends, before
+ * NPP_StreamAsFile or NPP_DestroyStream, and if the plugin fails to take
+ * it NPP_DestroyStream gets NPRES_NETWORK_ERR rather than NPRES_DONE. For
+ * streams of unknown length, data that has waited COALESCE_WRITES_IDLE_MS
+ * is passed on at the next NPP_WriteReady instead of waiting for more. */
+#ifndef COALESCE_WRITES
+#define COALESCE_WRITES 0
+#endif
+#ifndef COALESCE_WRITES_IDLE_MS
+#define COALESCE_WRITES_IDLE_MS 50
+#endif
+/* how many times to try to pass on what's left as a stream is destroyed */
+#define WRITE_FLUSH_ATTEMPTS 8
+class WriteBuffer {
+  public:
+    std::string mData;
+    int32_t mOffset; // where in the stream mData starts
+    int32_t mReady; // what the plugin last said it was ready for
+    int32_t mError; // what to return to the browser once the plugin fails
+    uint64_t mFirstBuffered;
+    WriteBuffer() : mOffset(0), mReady(0), mError(0), mFirstBuffered(0) { }
+};
+
+class WriteCoalescing {
+  public:
+    static uint64_t gBrowserWrites;
+    static uint64_t gPluginWrites;
+    static Histogram gDelay;
+    static void report(Log& aLog) {
+      if (gBrowserWrites == 0) return;
+      aLog("  write coalescing: %llu browser writes passed on in %llu, %llu "
+          "saved\n", (unsigned long long)gBrowserWrites,
+          (unsigned long long)gPluginWrites,
+          (unsigned long long)(gBrowserWrites - gPluginWrites));
+      gDelay.report(aLog);
+    }
+};
+uint64_t WriteCoalescing::gBrowserWrites = 0;
+uint64_t WriteCoalescing::gPluginWrites = 0;
+Histogram WriteCoalescing::gDelay("write coalescing delay", "ns");
+
+/* Build with -DCACHE_BROWSER_VALUES=\"NPNVToolkit:UserAgent:...\" to have
+ * NPN_GetValue remember the browser's answers for the variables listed,
+ * and NPN_UserAgent for UserAgent, for each instance (and for no instance),
+ * and give them to the plugin again without asking the browser. Only list
+ * values that don't change for as long as the plugin is loaded. The
+ * NPObject variables and the XPCOM ones (NPNVserviceManager, NPNVDOMElement
+ * and NPNVDOMWindow) can't be cached because each one comes with a
+ * reference. */
+#ifndef CACHE_BROWSER_VALUES
+#define CACHE_BROWSER_VALUES ""
+#endif
+
+/* the NPN_GetValue variables that can be cached, with how much it gives
+ * for each */
+static const struct {
+  NPNVariable mVariable;
+  size_t mSize;
+} gCacheable[] = {
+  { NPNVxDisplay, sizeof(void*) },
+  { NPNVxtAppContext, sizeof(void*) },
+  { NPNVnetscapeWindow, sizeof(void*) },
+  { NPNVjavascriptEnabledBool, sizeof(NPBool) },
+  { NPNVasdEnabledBool, sizeof(NPBool) },
+  { NPNVisOfflineBool, sizeof(NPBool) },
+  { NPNVToolkit, sizeof(NPNToolkitType) },
+  { NPNVSupportsXEmbedBool, sizeof(NPBool) },
+  { NPNVSupportsWindowless, sizeof(NPBool) },
+  { NPNVprivateModeBool, sizeof(NPBool) },
+};
+#define CACHEABLE_COUNT (int)(sizeof(gCacheable) / sizeof(gCacheable[0]))
+/* UserAgent's bit in the mask of what's listed comes after the variables */
+#define CACHE_USER_AGENT CACHEABLE_COUNT
+
+class BrowserValues {
+  private:
+    typedef struct {
+      char mData[sizeof(void*)];
+    } Value;
+    typedef struct {
+      uint64_t mHits;
+      uint64_t mMisses;
+    } Stats;
+    Value mValues[CACHEABLE_COUNT];
+    uint32_t mHave; // a bit for each of mValues that's been filled in
+    const char* mUserAgent;
+    static uint32_t gListed; // a bit for each of gCacheable that's listed
+    static pthread_once_t gListedOnce;
+    static Stats gStats[CACHEABLE_COUNT + 1];
+    /* turn CACHE_BROWSER_VALUES into gListed */
+    static void list() {
+      std::string names = CACHE_BROWSER_VALUES;
+      size_t start = 0;
+      while (start <= names.size()) {
+        size_t end = names.find(':', start);
+        if (end == std::string::npos) end = names.size();
+        std::string name = names.substr(start, end - start);
+        if (name == "UserAgent") {
+          gListed |= 1 << CACHE_USER_AGENT;
+        }
+        for (int i = 0; i < CACHEABLE_COUNT; i++) {
+          if (name == NPNVariableName(gCacheable[i].mVariable)) {
+            gListed |= 1 << i;
+          }
+        }
+        start = end + 1;
+      }
+    }
+    static uint32_t listed() {
+      pthread_once(&gListedOnce, list);
+      return gListed;
+    }
+  public:
+    BrowserValues() : mHave(0), mUserAgent(NULL) { }
+    /* where aVariable is cached, or -1 if it isn't */
+    static int slot(NPNVariable aVariable) {
+      if (CACHE_BROWSER_VALUES[0] == '\0') return -1;
+      uint32_t listed = BrowserValues::listed();
+      for (int i = 0; i < CACHEABLE_COUNT; i++) {
+        if (gCacheable[i].mVariable == aVariable) {
+          return listed & (1 << i) ? i : -1;
+        }
+      }
+      return -1;
+    }
+    static bool cachingUserAgent() {
+      return CACHE_BROWSER_VALUES[0] != '\0' &&
+        (listed() & (1 << CACHE_USER_AGENT));
+    }
+    /* copy a cached value into aValue, if there is one */
+    bool get(int aSlot, void* aValue) {
+      if (!(mHave & (1 << aSlot))) {
+        gStats[aSlot].mMisses++;
+        return false;
+      }
+      gStats[aSlot].mHits++;
+      memcpy(aValue, mValues[aSlot].mData, gCacheable[aSlot].mSize);
+      return true;
+    }
+    void put(int aSlot, const void* aValue) {
+      memcpy(mValues[aSlot].mData, aValue, gCacheable[aSlot].mSize);
+      mHave |= 1 << aSlot;
+    }
+    const char* userAgent() {
+      Stats& stats = gStats[CACHE_USER_AGENT];
+      if (mUserAgent) {
+        stats.mHits++;
+      } else {
+        stats.mMisses++;
+      }
+      return mUserAgent;
+    }
+    void setUserAgent(const char* aUserAgent) { mUserAgent = aUserAgent; }
+    static void report(Log& aLog) {
+      for (int i = 0; i <= CACHEABLE_COUNT; i++) {
+        if (gStats[i].mHits == 0 && gStats[i].mMisses == 0) continue;
+        aLog("  cached %s: %llu hits %llu misses\n", i == CACHE_USER_AGENT ?
+            "UserAgent" : NPNVariableName(gCacheable[i].mVariable),
+            (unsigned long long)gStats[i].mHits,
+            (unsigned long long)gStats[i].mMisses);
+      }
+    }
+};
+uint32_t BrowserValues::gListed = 0;
+pthread_once_t BrowserValues::gListedOnce = PTHREAD_ONCE_INIT;
+BrowserValues::Stats BrowserValues::gStats[CACHEABLE_COUNT + 1];
+/* what the browser says when there's no instance */
+static BrowserValues gBrowserValues;
+
+class PluginInstance;
+/* A scheduled flush. The browser drops it if the instance is destroyed
+ * first, so the ones that are scheduled are kept in gScheduled, for the
+ * instance to take back then and for flushInvalidations() to check that
+ * it's running one that's still wanted. */
+typedef struct {
+  PluginInstance* mInstance;
+} InvalidationFlush;
+
+class Invalidations {
+  private:
+    NPRect mPending;
+    unsigned mPendingCalls; // 0 if there's nothing pending
+    uint64_t mCalls;
+    uint64_t mFlushes;
+  public:
+    static std::set<InvalidationFlush*> gScheduled;
+    InvalidationFlush* mFlush; // the flush that's scheduled, if any
+    Invalidations() : mPendingCalls(0), mCalls(0), mFlushes(0),
+      mFlush(NULL) { }
+    ~Invalidations() {
+      if (mFlush) {
+        gScheduled.erase(mFlush);
+        delete mFlush;
+      }
+    }
+    void add(const NPRect& aRect) {
+      if (mPendingCalls++ == 0) {
+        mPending = aRect;
+      } else {
+        mPending.top = MIN(mPending.top, aRect.top);
+        mPending.left = MIN(mPending.left, aRect.left);
+        mPending.bottom = mPending.bottom > aRect.bottom ? mPending.bottom :
+          aRect.bottom;
+        mPending.right = mPending.right > aRect.right ? mPending.right :
+          aRect.right;
+      }
+      mCalls++;
+    }
+    /* pass what's pending on to the browser */
+    void flush(NPP aBrowserNPP);
+    void report(Log& aLog) {
+      if (mCalls == 0) return;
+      aLog("  invalidations coalesced: %llu calls into %llu, %llu saved\n",
+          (unsigned long long)mCalls, (unsigned long long)mFlushes,
+          (unsigned long long)(mCalls - mFlushes));
+    }
+};
+std::set<InvalidationFlush*> Invalidations::gScheduled;
+
+class PluginInstance {
+  private:
+    NPP_t mPluginNPP;
+  public:
+    NPP mBrowserNPP;
+    PluginTarget* mTarget;
+    uint64_t mCreated;
+    URLRequests mURLRequests;
+    FramePacing mFrames;
+    Invalidations mInvalidations;
+    std::map<NPStream*,WriteBuffer> mWriteBuffers;
+    BrowserValues mBrowserValues;
+    std::map<uint32_t,Timer> mTimers;
+    std::map<uint32_t,TimerStats> mTimerIntervals;
+    PluginStatsInstance* mLive; // our slot in the stats segment, if any
+
+    PluginInstance(NPP aBrowserNPP, PluginTarget* aTarget, const char* aType)
+        : mBrowserNPP(aBrowserNPP), mTarget(aTarget),
+          mCreated(monotonicNanos()),
+          mLive(LiveStats::claim(aBrowserNPP, aType)) {
+      mPluginNPP.pdata = NULL;
+      mPluginNPP.ndata = this;
+      aBrowserNPP->pdata = this;
+    }
+    ~PluginInstance() {
+      LiveStats::release(mLive);
+      mBrowserNPP->pdata = NULL;
+    }
+    NPP pluginNPP() { return &mPluginNPP; }
+    static PluginInstance* fromBrowser(NPP aNPP) {
+      return aNPP ? (PluginInstance*)aNPP->pdata : NULL;
+    }
+    static PluginInstance* fromPlugin(NPP aNPP) {
+      return aNPP ? (PluginInstance*)aNPP->ndata : NULL;
+    }
+    void reportTimer(Log& aLog, uint32_t aTimerID, const Timer& aTimer) {
+      char what[64];
+      snprintf(what, sizeof(what), "timer %u (%ums%s)", aTimerID,
+          aTimer.mInterval, aTimer.mRepeat ? ", repeating" : "");
+      aTimer.mStats.report(aLog, what);
+    }
+    /* log the timers that are still scheduled and the totals for each
+     * interval */
+    void reportTimers(Log& aLog) {
+      for (std::map<uint32_t,Timer>::iterator i = mTimers.begin();
+          i != mTimers.end(); i++) {
+        reportTimer(aLog, i->first, i->second);
+      }
+      for (std::map<uint32_t,TimerStats>::iterator i =
+          mTimerIntervals.begin(); i != mTimerIntervals.end(); i++) {
+        char what[64];
+        snprintf(what, sizeof(what), "timers every %ums", i->first);
+        i->second.report(aLog, what);
       }
-      return trackChild(aChildObject, std::string(buf) + aExtra);
     }
-    void setPath(std::string aPath) {
-      mPath = aPath;
-      updatePrintable();
+};
+
+/* Each request gets a line with when it started, its method and URL, a
+ * bar showing it waiting (-) and receiving (#) across the instance's life,
+ * then its time to first byte, total time, size and result. */
+void
+URLRequests::report(Log& aLog, uint64_t aStart) {
+  if (mRequests.empty()) return;
+  uint64_t end = monotonicNanos();
+  uint64_t span = end > aStart ? end - aStart : 1;
+  aLog("  url requests (%d, %u dropped):\n", (int)mRequests.size(), mDropped);
+  for (size_t i = 0; i < mRequests.size(); i++) {
+    const URLRequest& request = mRequests[i];
+    uint64_t started = request.mRequested ? request.mRequested :
+      request.mStreamStarted;
+    uint64_t firstByte = request.mFirstByte ? request.mFirstByte : end;
+    uint64_t finished = request.mFinished ? request.mFinished : end;
+    char bar[WATERFALL_WIDTH + 1];
+    for (int c = 0; c < WATERFALL_WIDTH; c++) {
+      uint64_t t = aStart + span * c / WATERFALL_WIDTH;
+      uint64_t next = aStart + span * (c + 1) / WATERFALL_WIDTH;
+      if (next <= started || t > finished) {
+        bar[c] = ' ';
+      } else if (next <= firstByte) {
+        bar[c] = '-';
+      } else {
+        bar[c] = '#';
+      }
     }
+    bar[WATERFALL_WIDTH] = '\0';
+    aLog("    +%9lluus %-6s %s\n", (unsigned long long)(started - aStart) /
+        1000, request.mMethod, request.mURL.c_str());
+    aLog("      [%s] first byte %s%lluus, total %s%lluus, %llu bytes, %s\n",
+        bar, request.mFirstByte ? "" : "none after ",
+        (unsigned long long)(firstByte - started) / 1000,
+        request.mFinished ? "" : "unfinished after ",
+        (unsigned long long)(finished - started) / 1000,
+        (unsigned long long)request.mBytes,
+        request.mFinished ? NPReasonName(request.mReason) : "open");
+  }
+}
+
+/* the browser's NPP for the one the plugin gave us */
+static inline NPP
+browserNPP(NPP aNPP) {
+  PluginInstance* instance = PluginInstance::fromPlugin(aNPP);
+  return instance ? instance->mBrowserNPP : NULL;
+}
+
+/* the plugin's NPP for the one the browser gave us */
+static inline NPP
+pluginNPP(NPP aNPP) {
+  PluginInstance* instance = PluginInstance::fromBrowser(aNPP);
+  return instance ? instance->pluginNPP() : NULL;
+}
+
+/* Stand-ins for the plugin's functions, for calls on an NPP we don't know
+ * (eg: one whose NPP_New failed), which fail without calling any plugin. */
+static NPError
+stubNew(NPMIMEType aType, NPP aInstance, uint16_t aMode, int16_t aArgc,
+    char* aArgn[], char* aArgv[], NPSavedData* aSaved) {
+  return NPERR_INVALID_INSTANCE_ERROR;
+}
+static NPError
+stubDestroy(NPP aInstance, NPSavedData** aSave) {
+  return NPERR_INVALID_INSTANCE_ERROR;
+}
+static NPError
+stubSetWindow(NPP aInstance, NPWindow* aWindow) {
+  return NPERR_INVALID_INSTANCE_ERROR;
+}
+static NPError
+stubNewStream(NPP aInstance, NPMIMEType aType, NPStream* aStream,
+    NPBool aSeekable, uint16_t* aStype) {
+  return NPERR_INVALID_INSTANCE_ERROR;
+}
+static NPError
+stubDestroyStream(NPP aInstance, NPStream* aStream, NPReason aReason) {
+  return NPERR_INVALID_INSTANCE_ERROR;
+}
+static void
+stubStreamAsFile(NPP aInstance, NPStream* aStream, const char* aFname) {
+}
+static int32_t
+stubWriteReady(NPP aInstance, NPStream* aStream) {
+  return -1;
+}
+static int32_t
+stubWrite(NPP aInstance, NPStream* aStream, int32_t aOffset, int32_t aLen,
+    void* aBuffer) {
+  return -1;
+}
+static void
+stubPrint(NPP aInstance, NPPrint* aPlatformPrint) {
+}
+static int16_t
+stubHandleEvent(NPP aInstance, void* aEvent) {
+  return 0;
+}
+static void
+stubURLNotify(NPP aInstance, const char* aURL, NPReason aReason,
+    void* aNotifyData) {
+}
+static NPError
+stubGetValue(NPP aInstance, NPPVariable aVariable, void* aValue) {
+  return NPERR_INVALID_INSTANCE_ERROR;
+}
+static NPError
+stubSetValue(NPP aInstance, NPNVariable aVariable, void* aValue) {
+  return NPERR_INVALID_INSTANCE_ERROR;
+}
+static NPPluginFuncs gStubFuncs = {
+  sizeof(NPPluginFuncs), 0, stubNew, stubDestroy, stubSetWindow,
+  stubNewStream, stubDestroyStream, stubStreamAsFile, stubWriteReady,
+  stubWrite, stubPrint, stubHandleEvent, stubURLNotify, NULL, stubGetValue,
+  stubSetValue
 };
-NPObjectTracker::NPObjectMap NPObjectTracker::byObject;
 
-static std::string Printable(const NPObject* aObject) {
-  NPObjectTracker* tracker = NPObjectTracker::getTracker(aObject);
-  return std::string(tracker->c_str());
+/* the functions of the plugin behind the browser's NPP */
+static inline NPPluginFuncs*
+pluginFuncs(NPP aNPP) {
+  PluginInstance* instance = PluginInstance::fromBrowser(aNPP);
+  return instance ? instance->mTarget->mPluginFuncs : &gStubFuncs;
 }
 
-class NPClassTracker {
-  private:
-    typedef std::map<NPClass*,NPClass*> NPClassMap;
-    static NPClassMap mWrappers;
-    static NPClassMap mClasses;
-  public:
-    static bool hasWrapper(NPClass* aClass) {
-      NPClassMap::iterator i = mWrappers.find(aClass);
-      return (i != mWrappers.end());
-    }
-    static NPClass* getWrapper(NPClass* aClass) {
-      return mWrappers[aClass];
-    }
-    static NPClass* getClass(NPClass* aWrapper) {
-      return mClasses[aWrapper];
+/* pass up to aLimit bytes of what's buffered for aStream to the plugin */
+static void
+flushWrites(Log& aLog, NPP aInstance, NPStream* aStream, WriteBuffer& aBuffer,
+    int32_t aLimit) {
+  int32_t length = MIN((int32_t)aBuffer.mData.size(), aLimit);
+  if (length <= 0) return;
+  int32_t r = pluginFuncs(aInstance)->write(pluginNPP(aInstance), aStream,
+      aBuffer.mOffset, length, (void*)aBuffer.mData.data());
+  uint64_t now = monotonicNanos();
+  WriteCoalescing::gPluginWrites++;
+  WriteCoalescing::gDelay.record(now - aBuffer.mFirstBuffered);
+  if (aLog) aLog.values().integer("passedOn", length)
+      .integer("offset", aBuffer.mOffset).integer("pluginReturned", r);
+  if (r < 0) {
+    aBuffer.mError = r;
+    aBuffer.mData.clear();
+    return;
+  }
+  r = MIN(r, length);
+  aBuffer.mData.erase(0, r);
+  aBuffer.mOffset += r;
+  aBuffer.mReady -= r;
+  aBuffer.mFirstBuffered = now;
+}
+
+/* pass on everything still buffered as a stream ends, and return whether
+ * the plugin has taken all of the stream */
+static bool
+drainWrites(Log& aLog, NPP aInstance, NPStream* aStream,
+    WriteBuffer& aBuffer) {
+  for (int i = 0; i < WRITE_FLUSH_ATTEMPTS && !aBuffer.mData.empty(); i++) {
+    int32_t ready = pluginFuncs(aInstance)->writeready(pluginNPP(aInstance),
+        aStream);
+    flushWrites(aLog, aInstance, aStream, aBuffer, ready > 0 ? ready :
+        (int32_t)aBuffer.mData.size());
+  }
+  if (!aBuffer.mData.empty()) {
+    // the plugin wouldn't take them
+    if (aLog) aLog.values().integer("droppedBytes", aBuffer.mData.size());
+    aBuffer.mData.clear();
+    aBuffer.mError = -1;
+  }
+  return aBuffer.mError == 0;
+}
+
+/* the plugin behind the plugin's NPP, or NULL if it isn't one of ours */
+static inline PluginTarget*
+targetFor(NPP aNPP) {
+  PluginInstance* instance = PluginInstance::fromPlugin(aNPP);
+  return instance ? instance->mTarget : NULL;
+}
+
+/* write the call counts and the object table to the log */
+static void
+snapshot() {
+  Log log(FN_pluginlogger);
+
+  if (!log) return;
+  log("snapshot: tracing is %s\n", TraceControl::tracing() ? "on" : "off");
+  for (int f = 0; f < FN_COUNT; f++) {
+    uint64_t calls = FunctionStats::calls((FunctionId)f);
+    if (calls > 0) {
+      log("  %s: %llu calls\n", FunctionName((FunctionId)f),
+          (unsigned long long)calls);
     }
-    static inline NPClass* wrap(NPClass* aClass);
-};
-NPClassTracker::NPClassMap NPClassTracker::mWrappers;
-NPClassTracker::NPClassMap NPClassTracker::mClasses;
+  }
+  for (size_t i = 0; i < gTargets.size(); i++) {
+    const StartupTimes& times = gTargets[i]->mStartupTimes;
+    log("  %s: info from %s, dlopen %lluus, dlsym %lluus, "
+        "NP_Initialize %lluus\n", gTargets[i]->mPath.c_str(),
+        times.infoFromCache ? "cache" : "plugin",
+        (unsigned long long)times.dlopen / 1000,
+        (unsigned long long)times.dlsym / 1000,
+        (unsigned long long)times.initialize / 1000);
+  }
+  NPObjectTracker::dump(log);
+  for (size_t i = 0; i < gTargets.size(); i++) {
+    gTargets[i]->mClasses.report(log);
+  }
+  gHotObjects.report(log);
+  RedundantCalls::gWasted.report(log);
+  AsyncCalls::report(log);
+  WriteCoalescing::report(log);
+  BrowserValues::report(log);
+#ifdef MOZ_X11
+  XEvents::report(log);
+#endif
+  Log::flush("snapshot");
+}
 
 
 /* wrappers for NPClass virtual methods */
@@ -359,27 +4666,26 @@ NPClassTracker::NPClassMap NPClassTracker::mClasses;
  *        I hope not, but maybe. We'll see. */
 NPObject*
 wrap_NPClass_allocate(NPP npp, NPClass *aClass) {
-  Log log;
-  log("NPClass.allocate(npp=%p, aClass=%p)\n", npp, aClass);
+  Log log(FN_NPClass_allocate, npp);
+  EventLoop::Call call;
+  if (log) log.call().pointer("npp", npp).pointer("aClass", aClass);
 
   NPClass* wrapped = NPClassTracker::getClass(aClass);
-  NPObject* r = wrapped->allocate(npp, wrapped);
-  r->_class = NPClassTracker::wrap(r->_class);
+  NPObject* r = wrapped->allocate(pluginNPP(npp), wrapped);
 
   if (r != NULL) {
     // FIXME: what should we put for the path?
-    NPObjectTracker* ot = NPObjectTracker::getTracker(r, ORIGIN_PLUGIN);
-    log(" returned %s\n", ot->c_str());
-  } else {
-    log(" returned NULL\n");
+    NPObjectTracker::getTracker(r, ORIGIN_PLUGIN);
   }
+  if (log) log.returned().object(r);
   return r;
 }
 
 void
 wrap_NPClass_deallocate(NPObject* obj) {
-  Log log;
-  log("NPClass.deallocate(obj=%s)\n", NPObjectTracker::c_str(obj));
+  Log log(FN_NPClass_deallocate, obj);
+  EventLoop::Call call;
+  if (log) log.call().object("obj", obj);
 
   NPClassTracker::getClass(obj->_class)->deallocate(obj);
   // FIXME: remove from tracking, right?
@@ -389,9 +4695,11 @@ wrap_NPClass_deallocate(NPObject* obj) {
 
 void
 wrap_NPClass_invalidate(NPObject* obj) {
-  Log log;
-  log("NPClass.deallocate(obj=%s)\n", NPObjectTracker::c_str(obj));
+  Log log(FN_NPClass_invalidate, obj);
+  EventLoop::Call call;
+  if (log) log.call().object("obj", obj);
 
+  NPClassTracker::forget(obj);
   NPClassTracker::getClass(obj->_class)->invalidate(obj);
 
   return;
@@ -399,37 +4707,47 @@ wrap_NPClass_invalidate(NPObject* obj) {
 
 bool
 wrap_NPClass_hasMethod(NPObject* obj, NPIdentifier name) {
-  Log log;
-  log("NPClass.hasMethod(obj=%s, name=%s)\n",
-      NPObjectTracker::c_str(obj), Printable(name).c_str());
-
-  bool r = NPClassTracker::getClass(obj->_class)->hasMethod(obj, name);
+  Log log(FN_NPClass_hasMethod, obj);
+  EventLoop::Call call;
+  if (log) log.call().object("obj", obj).identifier("name", name);
+
+  ObjectTimer timer(log, obj, name);
+  WrappedClass* memo = NPClassTracker::memoizing(obj);
+  bool r;
+  bool memoized = memo && memo->mHasMethod.lookup(name, &r);
+  if (!memoized) {
+    r = NPClassTracker::getClass(obj->_class)->hasMethod(obj, name);
+    if (memo) memo->mHasMethod.remember(name, r);
+  }
+  timer.done(r);
 
-  log(" returns %s\n", boolStr(r));
+  if (log) log.returned().boolean(r).boolean("memoized", memoized);
   return r;
 }
 
 bool
 wrap_NPClass_invoke(NPObject* obj, NPIdentifier name,
     const NPVariant *args, uint32_t argCount, NPVariant *result) {
-  Log log;
-  log("NPClass.invoke(obj=%s, name=%s, args=%s)\n",
-      NPObjectTracker::c_str(obj), Printable(name).c_str(),
-      Printable(args, argCount, true).c_str());
+  Log log(FN_NPClass_invoke, obj);
+  EventLoop::Call call;
+  if (log) log.call().object("obj", obj).identifier("name", name)
+      .variants("args", args, argCount);
 
+  ObjectTimer timer(log, obj, name);
   bool r = NPClassTracker::getClass(obj->_class)->invoke(obj, name,
       args, argCount, result);
+  timer.done(r);
 
   if (r) {
     if (NPVARIANT_IS_OBJECT(*result)) {
       NPObjectTracker::getTracker(obj)->trackChild(
           NPVARIANT_TO_OBJECT(*result), std::string(".") +
-          Printable(name) + Printable(args, argCount, true));
+          Printable(name).c_str() +
+          Printable(args, argCount, true).c_str());
     }
-
-    log(" returned true, result=%s\n", Printable(result).c_str());
+    if (log) log.returned().boolean(true).variant("result", result);
   } else {
-    log(" returned false\n");
+    if (log) log.returned().boolean(false);
   }
   return r;
 }
@@ -437,21 +4755,24 @@ wrap_NPClass_invoke(NPObject* obj, NPIdentifier name,
 bool
 wrap_NPClass_invokeDefault(NPObject* obj, const NPVariant *args,
     uint32_t argCount, NPVariant *result) {
-  Log log;
-  log("NPClass.invokeDefault(obj=%s, args=%s)\n",
-      NPObjectTracker::c_str(obj), Printable(args, argCount, true).c_str());
+  Log log(FN_NPClass_invokeDefault, obj);
+  EventLoop::Call call;
+  if (log) log.call().object("obj", obj).variants("args", args, argCount);
 
+  ObjectTimer timer(log, obj, NULL);
   bool r = NPClassTracker::getClass(obj->_class)->invokeDefault(obj,
       args, argCount, result);
+  timer.done();
 
   if (r) {
     if (NPVARIANT_IS_OBJECT(*result)) {
       NPObjectTracker::getTracker(obj)->trackChild(
-          NPVARIANT_TO_OBJECT(*result), Printable(args, argCount, true));
+          NPVARIANT_TO_OBJECT(*result),
+          Printable(args, argCount, true).c_str());
     }
-    log(" returned true, result=%s\n", Printable(result).c_str());
+    if (log) log.returned().boolean(true).variant("result", result);
   } else {
-    log(" returned false\n");
+    if (log) log.returned().boolean(false);
   }
 
   return r;
@@ -459,38 +4780,48 @@ wrap_NPClass_invokeDefault(NPObject* obj, const NPVariant *args,
 
 bool
 wrap_NPClass_hasProperty(NPObject *obj, NPIdentifier name) {
-  Log log;
-
-  log("NPClass.hasProperty(obj=%s, name=%s)\n",
-      NPObjectTracker::c_str(obj), Printable(name).c_str());
-
-  bool r = NPClassTracker::getClass(obj->_class)->hasProperty(obj, name);
+  Log log(FN_NPClass_hasProperty, obj);
+  EventLoop::Call call;
+
+  if (log) log.call().object("obj", obj).identifier("name", name);
+
+  ObjectTimer timer(log, obj, name);
+  WrappedClass* memo = NPClassTracker::memoizing(obj);
+  bool r;
+  bool memoized = memo && memo->mHasProperty.lookup(name, &r);
+  if (!memoized) {
+    r = NPClassTracker::getClass(obj->_class)->hasProperty(obj, name);
+    if (memo) memo->mHasProperty.remember(name, r);
+  }
+  timer.done(r);
 
-  log(" returned %s\n", boolStr(r));
+  if (log) log.returned().boolean(r).boolean("memoized", memoized);
   return r;
 }
 
 bool
 wrap_NPClass_getProperty(NPObject *obj, NPIdentifier name,
     NPVariant *result) {
-  Log log;
+  Log log(FN_NPClass_getProperty, obj);
+  EventLoop::Call call;
 
-  log("NPClass.getProperty(obj=%s, name=%s)\n",
-      NPObjectTracker::c_str(obj), Printable(name).c_str());
+  if (log) log.call().object("obj", obj).identifier("name", name);
 
+  ObjectTimer timer(log, obj, name);
   bool r = NPClassTracker::getClass(obj->_class)->getProperty(obj, name,
       result);
+  timer.done(r, result);
 
   if (r) {
     // if the return value is an object we want to track that
     if (NPVARIANT_IS_OBJECT(*result)) {
       NPObjectTracker::getTracker(obj)->trackChild(
           NPVARIANT_TO_OBJECT(*result),
-          std::string(".")+Printable(name));
+          std::string(".")+Printable(name).c_str());
     }
-    log(" returned true, result=%s\n", Printable(result).c_str());
+    if (log) log.returned().boolean(true).variant("result", result);
   } else {
-    log(" returned false\n");
+    if (log) log.returned().boolean(false);
   }
   return r;
 }
@@ -498,74 +4829,80 @@ wrap_NPClass_getProperty(NPObject *obj, NPIdentifier name,
 bool
 wrap_NPClass_setProperty(NPObject *obj, NPIdentifier name,
     const NPVariant *value) {
-  Log log;
+  Log log(FN_NPClass_setProperty, obj);
+  EventLoop::Call call;
 
-  log("NPClass.setProperty(obj=%s, name=%s, value=%p)\n",
-      NPObjectTracker::c_str(obj),
-      Printable(name).c_str(),
-      Printable(value).c_str());
+  if (log) log.call().object("obj", obj).identifier("name", name)
+      .variant("value", value);
 
+  ObjectTimer timer(log, obj, name);
   bool r =
     NPClassTracker::getClass(obj->_class)->setProperty(obj, name, value);
+  timer.done();
 
-  log(" returned %s\n", boolStr(r));
+  if (log) log.returned().boolean(r);
   return r;
 }
 
 bool
 wrap_NPClass_removeProperty(NPObject *obj, NPIdentifier name) {
-  Log log;
+  Log log(FN_NPClass_removeProperty, obj);
+  EventLoop::Call call;
 
-  log("NPClass.removeProperty(obj=%s, name=%s)\n",
-      NPObjectTracker::c_str(obj), Printable(name).c_str());
+  if (log) log.call().object("obj", obj).identifier("name", name);
 
+  ObjectTimer timer(log, obj, name);
   bool r = NPClassTracker::getClass(obj->_class)->removeProperty(obj, name);
+  timer.done();
 
-  log(" returned %s\n", boolStr(r));
+  if (log) log.returned().boolean(r);
   return r;
 }
 
 bool
 wrap_NPClass_enumerate(NPObject *obj, NPIdentifier **value,
     uint32_t *count) {
-  Log log;
+  Log log(FN_NPClass_enumerate, obj);
+  EventLoop::Call call;
 
-  log("NPClass.enumerate(obj=%s)\n", NPObjectTracker::c_str(obj));
+  if (log) log.call().object("obj", obj);
 
+  ObjectTimer timer(log, obj, NULL);
   bool r = NPClassTracker::getClass(obj->_class)->enumerate(obj, value, count);
+  timer.done();
 
   if (r) {
-    for (uint32_t i = 0; i < *count; i++) {
-      log("  %s\n", Printable(*value[i]).c_str());
-    }
+    if (log) log.returned().boolean(true).identifiers("value", *value, *count);
+  } else {
+    if (log) log.returned().boolean(false);
   }
-  log(" returned %s\n", boolStr(r));
   return r;
 }
 
 bool
 wrap_NPClass_construct(NPObject* obj, const NPVariant *args,
     uint32_t argCount, NPVariant *result) {
-  Log log;
+  Log log(FN_NPClass_construct, obj);
+  EventLoop::Call call;
 
-  log("NPClass.construct(obj=%s)\n", NPObjectTracker::c_str(obj));
-  for (uint32_t i = 0; i<argCount; i++) {
-    log("  arg[%d] = %s\n", i, Printable(&args[i]).c_str());
-  }
+  if (log) log.call().object("obj", obj).variants("args", args, argCount);
 
+  ObjectTimer timer(log, obj, NULL);
   bool r = NPClassTracker::getClass(obj->_class)->construct(obj,
       args, argCount, result);
+  timer.done();
 
   if (r) {
     if (NPVARIANT_IS_OBJECT(*result)) {
       std::string path = std::string("([constructor]") +
-        Printable(args, argCount) + std::string(")");
+        Printable(args, argCount, false).c_str() +
+        std::string(")");
       NPObjectTracker::getTracker(obj)->trackChild(
           NPVARIANT_TO_OBJECT(*result), path);
     }
-    log(" returned true, result=%s\n", Printable(result).c_str());
+    if (log) log.returned().boolean(true).variant("result", result);
   } else {
-    log(" returned false\n");
+    if (log) log.returned().boolean(false);
   }
 
   return r;
@@ -573,28 +4910,78 @@ wrap_NPClass_construct(NPObject* obj, const NPVariant *args,
 
 NPClass*
 NPClassTracker::wrap(NPClass* aClass) {
-  if (hasWrapper(aClass)) {
-    return getWrapper(aClass);
-  } else {
-    // create a wrapper NPClass
-    NPClass* wrapper = new NPClass;
-    wrapper->allocate = wrap_NPClass_allocate;
-    wrapper->deallocate = wrap_NPClass_deallocate;
-    wrapper->invalidate = wrap_NPClass_invalidate;
-    wrapper->hasMethod = wrap_NPClass_hasMethod;
-    wrapper->invoke = wrap_NPClass_invoke;
+  NPClassMap::iterator i = mWrappers.find(aClass);
+  if (i != mWrappers.end()) {
+    return &i->second->mWrapper;
+  }
+
+  // create a wrapper NPClass, leaving out whatever the plugin's class
+  // leaves out so that the browser falls back to its defaults
+  WrappedClass* wrapped = new WrappedClass;
+  memset(&wrapped->mWrapper, 0, sizeof(NPClass));
+  wrapped->mClass = aClass;
+  wrapped->mMemoize = memoize(aClass);
+  NPClass* wrapper = &wrapped->mWrapper;
+  wrapper->structVersion = MIN(3, aClass->structVersion);
+  if (aClass->allocate) wrapper->allocate = wrap_NPClass_allocate;
+  if (aClass->deallocate) wrapper->deallocate = wrap_NPClass_deallocate;
+  if (aClass->invalidate) wrapper->invalidate = wrap_NPClass_invalidate;
+  if (aClass->hasMethod) wrapper->hasMethod = wrap_NPClass_hasMethod;
+  if (aClass->invoke) wrapper->invoke = wrap_NPClass_invoke;
+  if (aClass->invokeDefault) {
     wrapper->invokeDefault = wrap_NPClass_invokeDefault;
-    wrapper->hasProperty = wrap_NPClass_hasProperty;
-    wrapper->getProperty = wrap_NPClass_getProperty;
-    wrapper->setProperty = wrap_NPClass_setProperty;
+  }
+  if (aClass->hasProperty) wrapper->hasProperty = wrap_NPClass_hasProperty;
+  if (aClass->getProperty) wrapper->getProperty = wrap_NPClass_getProperty;
+  if (aClass->setProperty) wrapper->setProperty = wrap_NPClass_setProperty;
+  if (aClass->removeProperty) {
     wrapper->removeProperty = wrap_NPClass_removeProperty;
+  }
+  if (NP_CLASS_STRUCT_VERSION_HAS_ENUM(aClass) && aClass->enumerate) {
     wrapper->enumerate = wrap_NPClass_enumerate;
+  }
+  if (NP_CLASS_STRUCT_VERSION_HAS_CTOR(aClass) && aClass->construct) {
     wrapper->construct = wrap_NPClass_construct;
-    wrapper->structVersion = MIN(3, aClass->structVersion);
-    // register the wrapper
-    mWrappers[aClass] = wrapper;
-    mClasses[wrapper] = aClass;
-    return wrapper;
+  }
+  // register the wrapper
+  mWrappers[aClass] = wrapped;
+  return wrapper;
+}
+
+/* whether we were asked to memoize aClass */
+bool
+NPClassTracker::memoize(const NPClass* aClass) {
+  const char* name = MEMOIZE_CLASSES;
+  while (*name != '\0') {
+    if (name[0] == '*' && (name[1] == ':' || name[1] == '\0')) {
+      return true;
+    }
+    char* end;
+    uintptr_t address = strtoull(name, &end, 16);
+    if (end != name && (*end == ':' || *end == '\0') &&
+        address == (uintptr_t)aClass) {
+      return true;
+    }
+    name = strchr(name, ':');
+    if (name == NULL) break;
+    name++;
+  }
+  return false;
+}
+
+/* log the memoized classes' hit rates */
+void
+NPClassTracker::report(Log& aLog) {
+  for (NPClassMap::iterator i = mWrappers.begin(); i != mWrappers.end();
+      i++) {
+    const WrappedClass* wrapped = i->second;
+    if (!wrapped->mMemoize) continue;
+    const Memo& m = wrapped->mHasMethod;
+    const Memo& p = wrapped->mHasProperty;
+    aLog("  memoized class %p: hasMethod %llu hits %llu misses, "
+        "hasProperty %llu hits %llu misses\n", (void*)wrapped->mClass,
+        (unsigned long long)m.mHits, (unsigned long long)m.mMisses,
+        (unsigned long long)p.mHits, (unsigned long long)p.mMisses);
   }
 }
 
@@ -602,382 +4989,491 @@ NPClassTracker::wrap(NPClass* aClass) {
 /* wrapped browser functions */
 NPError
 wrap_NPN_GetValue(NPP npp, NPNVariable variable, void *ret_value) {
-  Log log;
-
-  log("NPN_GetValue(npp=%p, variable=%s, value=%p)\n",
-      npp, NPNVariableName(variable), ret_value);
-  NPError e = gBrowserFuncs->getvalue(npp, variable, ret_value);
+  Log log(FN_NPN_GetValue, browserNPP(npp));
+  PluginInstance* instance = PluginInstance::fromPlugin(npp);
+  npp = browserNPP(npp);
+
+  if (log) log.call().pointer("npp", npp)
+      .symbol("variable", NPNVariableName(variable))
+      .pointer("value", ret_value);
+  NPError e;
+  BrowserValues& values = instance ? instance->mBrowserValues :
+    gBrowserValues;
+  int slot = BrowserValues::slot(variable);
+  if (slot >= 0 && values.get(slot, ret_value)) {
+    if (log) log.values().boolean("cached", true);
+    e = NPERR_NO_ERROR;
+  } else {
+    e = gBrowserFuncs->getvalue(npp, variable, ret_value);
+    if (e == NPERR_NO_ERROR && slot >= 0) {
+      values.put(slot, ret_value);
+    }
+  }
   if (e == NPERR_NO_ERROR) {
     switch(variable) {
       case NPNVxDisplay:
-        log("  NPNVxDisplay = %p\n", *(void**)ret_value);
+        if (log) log.values().pointer("result", *(void**)ret_value);
         break;
       case NPNVxtAppContext:
-        log("  NPNVxtAppContext = %p\n", *(void**)ret_value);
+        if (log) log.values().pointer("result", *(void**)ret_value);
         break;
       case NPNVnetscapeWindow:
-        log("  NPNVnetscapeWindow = %p\n", *(void**)ret_value);
+        if (log) log.values().pointer("result", *(void**)ret_value);
         break;
       case NPNVjavascriptEnabledBool:
-        log("  NPNVjavascriptEnabledBool = %s\n",
-            boolStr(*(bool*)ret_value));
+        if (log) log.values().boolean("result", *(bool*)ret_value);
         break;
       case NPNVasdEnabledBool:
-        log("  NPNVasdEnabledBool = %s\n",
-            (*(bool*)ret_value)?"true":"false");
+        if (log) log.values().boolean("result", *(bool*)ret_value);
         break;
       case NPNVisOfflineBool:
-        log("  NPNVisOfflineBool = %s\n",
-            (*(bool*)ret_value)?"true":"false");
+        if (log) log.values().boolean("result", *(bool*)ret_value);
         break;
       case NPNVserviceManager:
-        log("  NPNVserviceManager = %p\n", *(void**)ret_value);
+        if (log) log.values().pointer("result", *(void**)ret_value);
         break;
       case NPNVDOMElement:
-        log("  NPNVDOMElement = %p\n", *(void**)ret_value);
+        if (log) log.values().pointer("result", *(void**)ret_value);
         break;
       case NPNVDOMWindow:
-        log("  NPNVDOMWindow = %p\n", *(void**)ret_value);
+        if (log) log.values().pointer("result", *(void**)ret_value);
         break;
       case NPNVToolkit:
-        log("  NPNVToolkit = %p\n", *(void**)ret_value);
+        if (log) log.values().pointer("result", *(void**)ret_value);
         break;
       case NPNVSupportsXEmbedBool:
-        log("  NPNVSupportsXEmbedBool = %s\n",
-            (*(bool*)ret_value)?"true":"false");
+        if (log) log.values().boolean("result", *(bool*)ret_value);
         break;
       case NPNVWindowNPObject:
         {
         NPObject* obj = *(NPObject**)ret_value;
-        NPObjectTracker* tracker =
-          NPObjectTracker::getTracker(obj, ORIGIN_BROWSER, "window");
-        log("  NPNVWindowNPObject = %s\n", tracker->c_str());
+        NPObjectTracker::getTracker(obj, ORIGIN_BROWSER, "window");
+        if (log) log.values().object("result", obj);
         }
         break;
       case NPNVPluginElementNPObject:
         {
         NPObject* obj = *(NPObject**)ret_value;
-        NPObjectTracker* tracker =
-          NPObjectTracker::getTracker(obj, ORIGIN_BROWSER, "plugin");
-        log("  NPNVPluginElementNPObject = %s\n", tracker->c_str());
+        NPObjectTracker::getTracker(obj, ORIGIN_BROWSER, "plugin");
+        if (log) log.values().object("result", obj);
         }
         break;
       case NPNVSupportsWindowless:
-        log("  NPNVSupportsWindowless = %s\n",
-            (*(bool*)ret_value)?"true":"false");
+        if (log) log.values().boolean("result", *(bool*)ret_value);
         break;
       case NPNVprivateModeBool:
-        log("  NPNVprivateModeBool = %s\n",
-            (*(bool*)ret_value)?"true":"false");
+        if (log) log.values().boolean("result", *(bool*)ret_value);
         break;
     }
   }
-  log(" returned %s\n", NPErrorName(e));
+  if (log) log.returned().error(e);
   return e;
 }
 
 NPError
 wrap_NPN_SetValue(NPP npp, NPPVariable variable, void *value) {
-  Log log;
+  Log log(FN_NPN_SetValue, browserNPP(npp));
+  npp = browserNPP(npp);
 
-  log("NPN_SetValue(npp=%p, variable=%s, value=%p)\n",
-      npp, NPPVariableName(variable), value);
+  if (log) log.call().pointer("npp", npp)
+      .symbol("variable", NPPVariableName(variable)).pointer("value", value);
   NPError e = gBrowserFuncs->setvalue(npp, variable, value);
-  log(" returned %s\n", NPErrorName(e));
+  if (log) log.returned().error(e);
   return e;
 }
 
 NPError
 wrap_NPN_GetURLNotify(NPP npp, const char* url, const char* window,
     void* notifyData) {
-  Log log;
+  Log log(FN_NPN_GetURLNotify, browserNPP(npp));
+  PluginInstance* instance = PluginInstance::fromPlugin(npp);
+  npp = browserNPP(npp);
 
-  log("NPN_GetURLNotify(npp=%p, url=\"%s\", window=\"%s\", notifydata=%p)\n",
-      npp, url, window, notifyData);
+  if (log) log.call().pointer("npp", npp).string("url", url)
+      .string("window", window).pointer("notifyData", notifyData);
   NPError e = gBrowserFuncs->geturlnotify(npp, url, window, notifyData);
-  log(" returned %s\n", NPErrorName(e));
+  if (e == NPERR_NO_ERROR && instance != NULL) {
+    instance->mURLRequests.requested("GET", url, window, true, notifyData);
+    LiveStats::count(instance->mLive, &PluginStatsInstance::requests);
+  }
+  if (log) log.returned().error(e);
   return e;
 }
 
 NPError
 wrap_NPN_PostURLNotify(NPP npp, const char* url, const char* window,
     uint32_t len, const char* buf, NPBool file, void* notifyData) {
-  Log log;
+  Log log(FN_NPN_PostURLNotify, browserNPP(npp));
+  PluginInstance* instance = PluginInstance::fromPlugin(npp);
+  npp = browserNPP(npp);
 
-  log("NPN_PostURLNotify(npp=%p, url=\"%s\", window=\"%s\", len=%d, buf=%p, "
-      "file=%d, notifyData=%p)\n",
-      npp, url, window, len, buf, file, notifyData);
+  if (log) log.call().pointer("npp", npp).string("url", url)
+      .string("window", window).integer("len", len).pointer("buf", buf)
+      .boolean("file", file).pointer("notifyData", notifyData);
   NPError e = gBrowserFuncs->posturlnotify(npp, url, window, len, buf, file,
       notifyData);
-  log(" returned %s\n", NPErrorName(e));
+  if (e == NPERR_NO_ERROR && instance != NULL) {
+    instance->mURLRequests.requested("POST", url, window, true, notifyData);
+    LiveStats::count(instance->mLive, &PluginStatsInstance::requests);
+  }
+  if (log) log.returned().error(e);
   return e;
 }
 
 NPError
 wrap_NPN_GetURL(NPP npp, const char* url, const char* window) {
-  Log log;
+  Log log(FN_NPN_GetURL, browserNPP(npp));
+  PluginInstance* instance = PluginInstance::fromPlugin(npp);
+  npp = browserNPP(npp);
 
-  log("NPN_GetURL(npp=%p, url=\"%s\", window=\"%s\")\n", npp, url, window);
+  if (log) log.call().pointer("npp", npp).string("url", url)
+      .string("window", window);
   NPError e = gBrowserFuncs->geturl(npp, url, window);
-  log(" returned %s\n", NPErrorName(e));
+  if (e == NPERR_NO_ERROR && instance != NULL) {
+    instance->mURLRequests.requested("GET", url, window, false, NULL);
+    LiveStats::count(instance->mLive, &PluginStatsInstance::requests);
+  }
+  if (log) log.returned().error(e);
   return e;
 }
 
 NPError
 wrap_NPN_PostURL(NPP npp, const char* url, const char* window,
     uint32_t len, const char* buf, NPBool file) {
-  Log log;
+  Log log(FN_NPN_PostURL, browserNPP(npp));
+  PluginInstance* instance = PluginInstance::fromPlugin(npp);
+  npp = browserNPP(npp);
 
-  log("NPN_PostURL(npp=%p, url=\"%s\", window=\"%s\", len=%d, "
-      "buf=%p, file=%d)\n", npp, url, window, len, buf, file);
+  if (log) log.call().pointer("npp", npp).string("url", url)
+      .string("window", window).integer("len", len).pointer("buf", buf)
+      .boolean("file", file);
   NPError e = gBrowserFuncs->posturl(npp, url, window, len, buf, file);
-  log(" returned %s\n", NPErrorName(e));
+  if (e == NPERR_NO_ERROR && instance != NULL) {
+    instance->mURLRequests.requested("POST", url, window, false, NULL);
+    LiveStats::count(instance->mLive, &PluginStatsInstance::requests);
+  }
+  if (log) log.returned().error(e);
   return e;
 }
 
 NPError
 wrap_NPN_RequestRead(NPStream* stream, NPByteRange* rangeList) {
-  Log log;
+  Log log(FN_NPN_RequestRead, stream);
 
-  log("NPN_RequestRead(stream=%p)\n", stream);
-  for (NPByteRange* r=rangeList; r!=NULL; r=r->next) {
-    log("  range offset=%d length=%d\n", r->offset, r->length);
-  }
+  if (log) log.call().pointer("stream", stream).ranges("rangeList", rangeList);
   NPError e = gBrowserFuncs->requestread(stream, rangeList);
-  log(" returned %s\n", NPErrorName(e));
+  if (log) log.returned().error(e);
   return e;
 }
 
 NPError
 wrap_NPN_NewStream(NPP npp, NPMIMEType type, const char* window,
     NPStream** stream) {
-  Log log;
+  Log log(FN_NPN_NewStream, browserNPP(npp));
+  npp = browserNPP(npp);
 
-  log("NPN_NewStream(npp=%p, type=\"%s\", window=\"%s\", stream=%p)\n",
-      npp, type, window, stream);
+  if (log) log.call().pointer("npp", npp).string("type", type)
+      .string("window", window).pointer("stream", stream);
   NPError e = gBrowserFuncs->newstream(npp, type, window, stream);
-  log(" returned %s\n", NPErrorName(e));
+  if (log) log.returned().error(e);
   return e;
 }
 
 int32_t
 wrap_NPN_Write(NPP npp, NPStream* stream, int32_t len, void* buffer) {
-  Log log;
+  Log log(FN_NPN_Write, browserNPP(npp));
+  npp = browserNPP(npp);
 
-  log("NPN_Write(npp=%p, stream=%p, len=%d, buffer=%p\n",
-      npp, stream, len, buffer);
+  if (log) log.call().pointer("npp", npp).pointer("stream", stream)
+      .integer("len", len).pointer("buffer", buffer);
   int32_t r = gBrowserFuncs->write(npp, stream, len, buffer);
-  log(" returned %d\n", r);
+  if (log) log.returned().integer(r);
   return r;
 }
 
 NPError
 wrap_NPN_DestroyStream(NPP npp, NPStream* stream, NPReason reason) {
-  Log log;
+  Log log(FN_NPN_DestroyStream, browserNPP(npp));
+  npp = browserNPP(npp);
 
-  log("NPN_DestroyStream(npp=%p, stream=%p, reason=%d)\n",
-      npp, stream, reason);
+  if (log) log.call().pointer("npp", npp).pointer("stream", stream)
+      .symbol("reason", NPReasonName(reason));
   NPError e = gBrowserFuncs->destroystream(npp, stream, reason);
-  log(" returned %s\n", NPErrorName(e));
+  if (log) log.returned().error(e);
   return e;
 }
 
 void
 wrap_NPN_Status(NPP npp, const char* message) {
-  Log log;
+  Log log(FN_NPN_Status, browserNPP(npp));
+  npp = browserNPP(npp);
 
-  log("NPN_Status(npp=%p, message=\"%s\"\n", npp, message);
+  if (log) log.call().pointer("npp", npp).string("message", message);
   gBrowserFuncs->status(npp, message);
   return;
 }
 
 const char*
 wrap_NPN_UserAgent(NPP npp) {
-  Log log;
-
-  log("NPN_UserAgent(npp=%p)\n", npp);
-  const char* r = gBrowserFuncs->uagent(npp);
-  log(" returned \"%s\"\n", r);
+  Log log(FN_NPN_UserAgent, browserNPP(npp));
+  PluginInstance* instance = PluginInstance::fromPlugin(npp);
+  npp = browserNPP(npp);
+
+  if (log) log.call().pointer("npp", npp);
+  const char* r = NULL;
+  BrowserValues& values = instance ? instance->mBrowserValues :
+    gBrowserValues;
+  if (BrowserValues::cachingUserAgent()) r = values.userAgent();
+  if (r == NULL) {
+    r = gBrowserFuncs->uagent(npp);
+    if (BrowserValues::cachingUserAgent()) values.setUserAgent(r);
+  }
+  if (log) log.returned().string(r);
   return r;
 }
 
 void*
 wrap_NPN_MemAlloc(uint32_t size) {
-  Log log;
+  Log log(FN_NPN_MemAlloc);
 
-  log("NPN_MemAlloc(size=%d)\n", size);
+  if (log) log.call().integer("size", size);
   void* r = gBrowserFuncs->memalloc(size);
-  log(" returned \"%p\"\n", r);
+  if (log) log.returned().pointer(r);
   return r;
 }
 
 void
 wrap_NPN_MemFree(void* ptr) {
-  Log log;
+  Log log(FN_NPN_MemFree);
 
-  log("NPN_MemFree(ptr=%p)\n", ptr);
+  if (log) log.call().pointer("ptr", ptr);
   gBrowserFuncs->memfree(ptr);
   return;
 }
 
 uint32_t
 wrap_NPN_MemFlush(uint32_t size) {
-  Log log;
+  Log log(FN_NPN_MemFlush);
 
-  log("NPN_MemFlush(size=%d)\n", size);
+  if (log) log.call().integer("size", size);
   uint32_t r = gBrowserFuncs->memflush(size);
-  log(" returned %d\n", r);
+  if (log) log.returned().integer(r);
   return r;
 }
 
 void
 wrap_NPN_ReloadPlugins(NPBool reloadPages) {
-  Log log;
+  Log log(FN_NPN_ReloadPlugins);
 
-  log("NPN_ReloadPlugins(reloadPages=%d)\n", reloadPages);
+  if (log) log.call().boolean("reloadPages", reloadPages);
   gBrowserFuncs->reloadplugins(reloadPages);
 }
 
 void*
 wrap_NPN_GetJavaEnv() {
-  Log log;
+  Log log(FN_NPN_GetJavaEnv);
 
-  log("NPN_GetJavaEnv()\n");
+  if (log) log.call();
   void* r = gBrowserFuncs->getJavaEnv();
-  log(" returned %p\n", r);
+  if (log) log.returned().pointer(r);
   return r;
 }
 
 void*
 wrap_NPN_GetJavaPeer(NPP npp) {
-  Log log;
+  Log log(FN_NPN_GetJavaPeer, browserNPP(npp));
+  npp = browserNPP(npp);
 
-  log("NPN_GetJavaPeer(npp=%p)\n", npp);
+  if (log) log.call().pointer("npp", npp);
   void* r = gBrowserFuncs->getJavaPeer(npp);
-  log(" returned %p\n", r);
+  if (log) log.returned().pointer(r);
   return r;
 }
 
 void
-wrap_NPN_InvalidateRect(NPP npp, NPRect *rect) {
-  Log log;
+Invalidations::flush(NPP aBrowserNPP) {
+  if (mPendingCalls == 0) return;
+  Log log(FN_NPN_InvalidateRect, aBrowserNPP);
+  if (log) log.call().pointer("npp", aBrowserNPP).rect("rect", &mPending)
+      .integer("coalesced", mPendingCalls);
+  NPRect rect = mPending;
+  mPendingCalls = 0;
+  mFlushes++;
+  gBrowserFuncs->invalidaterect(aBrowserNPP, &rect);
+}
+
+/* what the browser calls back to flush coalesced invalidations */
+static void
+flushInvalidations(void* aFlush) {
+  InvalidationFlush* flush = (InvalidationFlush*)aFlush;
+  if (Invalidations::gScheduled.erase(flush) == 0) {
+    return; // its instance is gone and took it back
+  }
+  PluginInstance* instance = flush->mInstance;
+  delete flush;
+  instance->mInvalidations.mFlush = NULL;
+  instance->mInvalidations.flush(instance->mBrowserNPP);
+}
 
-  log("NPN_InvalidateRect(npp=%p rect={top=%d, left=%d, bottom=%d, "
-      "right=%d})\n", npp, rect->top, rect->left, rect->bottom, rect->right);
-  gBrowserFuncs->invalidaterect(npp, rect);
+void
+wrap_NPN_InvalidateRect(NPP npp, NPRect *rect) {
+  Log log(FN_NPN_InvalidateRect, browserNPP(npp));
+  PluginInstance* instance = PluginInstance::fromPlugin(npp);
+  npp = browserNPP(npp);
+
+  if (log) log.call().pointer("npp", npp).rect("rect", rect);
+  if (COALESCE_INVALIDATIONS && instance != NULL &&
+      gBrowserFuncs->pluginthreadasynccall != NULL) {
+    Invalidations& invalidations = instance->mInvalidations;
+    invalidations.add(*rect);
+    if (invalidations.mFlush == NULL) {
+      invalidations.mFlush = new InvalidationFlush;
+      invalidations.mFlush->mInstance = instance;
+      Invalidations::gScheduled.insert(invalidations.mFlush);
+      gBrowserFuncs->pluginthreadasynccall(npp, flushInvalidations,
+          invalidations.mFlush);
+    }
+    if (log) log.values().boolean("coalesced", true);
+  } else {
+    gBrowserFuncs->invalidaterect(npp, rect);
+  }
+  if (instance != NULL && rect->right > rect->left &&
+      rect->bottom > rect->top) {
+    instance->mFrames.invalidated((uint64_t)(rect->right - rect->left) *
+        (rect->bottom - rect->top));
+  }
+  if (instance != NULL) {
+    LiveStats::count(instance->mLive, &PluginStatsInstance::invalidations);
+  }
   return;
 }
 
 void
 wrap_NPN_InvalidateRegion(NPP npp, NPRegion region) {
-  Log log;
+  Log log(FN_NPN_InvalidateRegion, browserNPP(npp));
+  PluginInstance* instance = PluginInstance::fromPlugin(npp);
+  npp = browserNPP(npp);
 
-  log("NPN_InvalidateRegion(npp=%p, region=%p\n", npp, region);
+  if (log) log.call().pointer("npp", npp).pointer("region", region);
   gBrowserFuncs->invalidateregion(npp, region);
+  if (instance != NULL) {
+    instance->mFrames.invalidated(0);
+    LiveStats::count(instance->mLive, &PluginStatsInstance::invalidations);
+  }
   return;
 }
 
 void
 wrap_NPN_ForceRedraw(NPP npp) {
-  Log log;
+  Log log(FN_NPN_ForceRedraw, browserNPP(npp));
+  PluginInstance* instance = PluginInstance::fromPlugin(npp);
+  npp = browserNPP(npp);
 
-  log("NPN_ForceRedraw(npp=%p)\n", npp);
+  if (log) log.call().pointer("npp", npp);
+  // the redraw should include anything we've held back
+  if (instance != NULL) instance->mInvalidations.flush(npp);
   gBrowserFuncs->forceredraw(npp);
   return;
 }
 
 NPIdentifier
 wrap_NPN_GetStringIdentifier(const NPUTF8* name) {
-  Log log;
+  Log log(FN_NPN_GetStringIdentifier);
 
-  log("NPN_GetStringIdentifier(name=\"%s\")\n", name);
+  if (log) log.call().string("name", name);
   NPIdentifier r = gBrowserFuncs->getstringidentifier(name);
-  log(" returned %p\n", r);
+  if (log) log.returned().pointer(r);
   return r;
 }
 
 void
 wrap_NPN_GetStringIdentifiers(const NPUTF8** names, int32_t nameCount,
     NPIdentifier* identifiers) {
-  Log log;
+  Log log(FN_NPN_GetStringIdentifiers);
 
-  log("NPN_GetStringIdentifiers(nameCount=%d)\n", nameCount);
+  if (log) log.call().strings("names", names, nameCount)
+      .integer("nameCount", nameCount);
   gBrowserFuncs->getstringidentifiers(names, nameCount, identifiers);
-  log(" returned: \n");
-  for (int i=0; i<nameCount; i++) {
-    log("  \"%s\" -> %p\n", names[i], identifiers[i]);
-  }
+  if (log) log.returned().pointers("identifiers", identifiers, nameCount);
 }
 
 NPIdentifier
 wrap_NPN_GetIntIdentifier(int32_t intid) {
-  Log log;
+  Log log(FN_NPN_GetIntIdentifier);
 
-  log("NPN_GetIntIdentifier(intid=%d)\n", intid);
+  if (log) log.call().integer("intid", intid);
   NPIdentifier r = gBrowserFuncs->getintidentifier(intid);
-  log(" returned %p\n", r);
+  if (log) log.returned().pointer(r);
   return r;
 }
 
 bool
 wrap_NPN_IdentifierIsString(NPIdentifier identifier) {
-  Log log;
+  Log log(FN_NPN_IdentifierIsString);
 
-  log("NPN_IdentifierIsString(identifier=%p)\n", identifier);
+  if (log) log.call().pointer("identifier", identifier);
   bool r = gBrowserFuncs->identifierisstring(identifier);
-  log(" returned %d\n", r);
+  if (log) log.returned().integer(r);
   return r;
 }
 
 NPUTF8*
 wrap_NPN_UTF8FromIdentifier (NPIdentifier identifier) {
-  Log log;
+  Log log(FN_NPN_UTF8FromIdentifier);
 
-  log("NPN_UTF8FromIdentifier(identifier=%p)\n", identifier);
+  if (log) log.call().pointer("identifier", identifier);
   NPUTF8* r = gBrowserFuncs->utf8fromidentifier(identifier);
-  log(" returned \"%s\"\n", r);
+  if (log) log.returned().string(r);
   return r;
 }
 
 int32_t
 wrap_NPN_IntFromIdentifier(NPIdentifier identifier) {
-  Log log;
+  Log log(FN_NPN_IntFromIdentifier);
 
-  log("NPN_IntFromIdentifier(identifier=%p)\n", identifier);
+  if (log) log.call().pointer("identifier", identifier);
   int32_t r = gBrowserFuncs->intfromidentifier(identifier);
-  log(" returned %d\n", r);
+  if (log) log.returned().integer(r);
   return r;
 }
 
 NPObject*
 wrap_NPN_CreateObject(NPP npp, NPClass *aClass) {
-  Log log;
-
-  log("NPN_CreateObject(npp=%p, class=%p)\n", npp, aClass);
-  NPObject* r = gBrowserFuncs->createobject(npp,
-      NPClassTracker::wrap(aClass));
+  Log log(FN_NPN_CreateObject, browserNPP(npp));
+  PluginTarget* target = targetFor(npp);
+  npp = browserNPP(npp);
+
+  if (log) log.call().pointer("npp", npp).pointer("aClass", aClass);
+  if (target == NULL) {
+    // we can't tell which plugin's class this is, and guessing would mix
+    // up the classes of different plugins
+    if (log) log.returned().object(NULL);
+    return NULL;
+  }
+  NPClass* wrapper = target->mClasses.wrap(aClass);
+  NPObject* r = gBrowserFuncs->createobject(npp, wrapper);
   // the plugin is requesting that the browser create an object
   // so I think it belongs on the plugin side. we will see...
-  NPObjectTracker::getTracker(r, ORIGIN_PLUGIN);
-  log(" returned %s\n", NPObjectTracker::c_str(r));
+  if (r != NULL) NPObjectTracker::getTracker(r, ORIGIN_PLUGIN);
+  if (log) log.returned().object(r);
   return r;
 }
 
 NPObject*
 wrap_NPN_RetainObject(NPObject *obj) {
-  Log log;
+  Log log(FN_NPN_RetainObject, obj);
 
-  log("NPN_RetainObject(obj=%s)\n", NPObjectTracker::c_str(obj));
+  if (log) log.call().object("obj", obj);
   NPObject* r = gBrowserFuncs->retainobject(obj);
-  log(" returned %s\n", NPObjectTracker::c_str(r));
+  if (log) log.returned().object(r);
   return r;
 }
 
 void
 wrap_NPN_ReleaseObject(NPObject *obj) {
-  Log log;
+  Log log(FN_NPN_ReleaseObject, obj);
 
-  log("NPN_ReleaseObject(obj=%p)\n", NPObjectTracker::c_str(obj));
+  if (log) log.call().object("obj", obj);
   // FIXME: should we remove it from the tracker if refcount==0?
   gBrowserFuncs->releaseobject(obj);
   return;
@@ -986,18 +5482,20 @@ wrap_NPN_ReleaseObject(NPObject *obj) {
 bool
 wrap_NPN_Invoke(NPP npp, NPObject* obj, NPIdentifier methodName,
     const NPVariant *args, uint32_t argCount, NPVariant *result) {
-  Log log;
+  Log log(FN_NPN_Invoke, browserNPP(npp));
+  npp = browserNPP(npp);
 
-  log("NPN_Invoke(npp=%p, obj=%s, methodName=%s, args=%s)\n", npp,
-      NPObjectTracker::c_str(obj), Printable(methodName).c_str(),
-      Printable(args, argCount, true).c_str());
+  if (log) log.call().pointer("npp", npp).object("obj", obj)
+      .identifier("methodName", methodName).variants("args", args, argCount);
 
+  ObjectTimer timer(log, obj, methodName);
   bool r = gBrowserFuncs->invoke(npp, obj, methodName, args, argCount,
       result);
+  timer.done(r);
   if (r) {
-    log(" returned true, result=%s\n", Printable(result).c_str());
+    if (log) log.returned().boolean(true).variant("result", result);
   } else {
-    log(" returned false\n");
+    if (log) log.returned().boolean(false);
   }
   return r;
 }
@@ -1005,47 +5503,64 @@ wrap_NPN_Invoke(NPP npp, NPObject* obj, NPIdentifier methodName,
 bool
 wrap_NPN_InvokeDefault(NPP npp, NPObject* obj, const NPVariant *args,
     uint32_t argCount, NPVariant *result) {
-  Log log;
+  Log log(FN_NPN_InvokeDefault, browserNPP(npp));
+  npp = browserNPP(npp);
 
-  log("NPN_InvokeDefault(npp=%p, obj=%s, args=%s)\n", npp,
-      NPObjectTracker::c_str(obj), Printable(args, argCount, true).c_str());
+  if (log) log.call().pointer("npp", npp).object("obj", obj)
+      .variants("args", args, argCount);
 
+  ObjectTimer timer(log, obj, NULL);
   bool r = gBrowserFuncs->invokeDefault(npp, obj, args, argCount, result);
+  timer.done();
   // FIXME: if the return value is an object we want to track that
-  log(" returned %d, result=%s\n", r, Printable(result).c_str());
+  if (r) {
+    if (log) log.returned().boolean(true).variant("result", result);
+  } else {
+    if (log) log.returned().boolean(false);
+  }
   return r;
 }
 
 bool
 wrap_NPN_Evaluate(NPP npp, NPObject *obj, NPString *script,
     NPVariant *result) {
-  Log log;
+  Log log(FN_NPN_Evaluate, browserNPP(npp));
+  npp = browserNPP(npp);
 
-  log("NPN_Evaluate(npp=%p, obj=%s, script=%s)\n", npp,
-      NPObjectTracker::c_str(obj), Printable(script).c_str());
+  if (log) log.call().pointer("npp", npp).object("obj", obj)
+      .string("script", script);
+  ObjectTimer timer(log, obj, NULL);
   bool r = gBrowserFuncs->evaluate(npp, obj, script, result);
+  timer.done();
   // FIXME: if the return value is an object we want to track that
-  log(" returned %d, result=%s\n", r, Printable(result).c_str());
+  if (r) {
+    if (log) log.returned().boolean(true).variant("result", result);
+  } else {
+    if (log) log.returned().boolean(false);
+  }
   return r;
 }
 
 bool
 wrap_NPN_GetProperty(NPP npp, NPObject *obj, NPIdentifier propertyName,
     NPVariant *result) {
-  Log log;
+  Log log(FN_NPN_GetProperty, browserNPP(npp));
+  npp = browserNPP(npp);
 
-  log("NPN_GetProperty(npp=%p, obj=%s, propertyName=%s)\n", npp,
-      NPObjectTracker::c_str(obj), Printable(propertyName).c_str());
+  if (log) log.call().pointer("npp", npp).object("obj", obj)
+      .identifier("propertyName", propertyName);
+  ObjectTimer timer(log, obj, propertyName);
   bool r = gBrowserFuncs->getproperty(npp, obj, propertyName, result);
+  timer.done(r, result);
   if (r) {
     // if the return value is an object we want to track that
     if (NPVARIANT_IS_OBJECT(*result)) {
       NPObjectTracker::getTracker(obj)->trackChild(
           NPVARIANT_TO_OBJECT(*result), propertyName);
     }
-    log(" returned true, result=%s\n", Printable(result).c_str());
+    if (log) log.returned().boolean(true).variant("result", result);
   } else {
-    log(" returned false\n");
+    if (log) log.returned().boolean(false);
   }
   return r;
 }
@@ -1053,160 +5568,216 @@ wrap_NPN_GetProperty(NPP npp, NPObject *obj, NPIdentifier propertyName,
 bool
 wrap_NPN_SetProperty(NPP npp, NPObject *obj, NPIdentifier propertyName,
     const NPVariant *value) {
-  Log log;
+  Log log(FN_NPN_SetProperty, browserNPP(npp));
+  npp = browserNPP(npp);
 
-  log("NPN_SetProperty(npp=%p, obj=%s, propertyName=%s, value=%p)\n",
-      npp, NPObjectTracker::c_str(obj),
-      Printable(propertyName).c_str(),
-      Printable(value).c_str());
+  if (log) log.call().pointer("npp", npp).object("obj", obj)
+      .identifier("propertyName", propertyName).variant("value", value);
+  ObjectTimer timer(log, obj, propertyName);
   bool r = gBrowserFuncs->setproperty(npp, obj, propertyName, value);
-  log(" returned %d\n", r);
+  timer.done();
+  if (log) log.returned().boolean(r);
   return r;
 }
 
 bool
 wrap_NPN_RemoveProperty(NPP npp, NPObject *obj,
     NPIdentifier propertyName) {
-  Log log;
+  Log log(FN_NPN_RemoveProperty, browserNPP(npp));
+  npp = browserNPP(npp);
 
-  log("NPN_RemoveProperty(npp=%p, obj=%s, propertyName=%s)\n", npp,
-      NPObjectTracker::c_str(obj), Printable(propertyName).c_str());
+  if (log) log.call().pointer("npp", npp).object("obj", obj)
+      .identifier("propertyName", propertyName);
+  ObjectTimer timer(log, obj, propertyName);
   bool r = gBrowserFuncs->removeproperty(npp, obj, propertyName);
-  log(" returned %d\n", r);
+  timer.done();
+  if (log) log.returned().boolean(r);
   return r;
 }
 
 bool
 wrap_NPN_HasProperty(NPP npp, NPObject *obj, NPIdentifier propertyName) {
-  Log log;
+  Log log(FN_NPN_HasProperty, browserNPP(npp));
+  npp = browserNPP(npp);
 
-  log("NPN_HasProperty(npp=%p, obj=%s, propertyName=%s)\n", npp,
-      NPObjectTracker::c_str(obj), Printable(propertyName).c_str());
+  if (log) log.call().pointer("npp", npp).object("obj", obj)
+      .identifier("propertyName", propertyName);
+  ObjectTimer timer(log, obj, propertyName);
   bool r = gBrowserFuncs->hasproperty(npp, obj, propertyName);
-  log(" returned %d\n", r);
+  timer.done(r);
+  if (log) log.returned().boolean(r);
   return r;
 }
 
 bool
 wrap_NPN_HasMethod(NPP npp, NPObject *obj, NPIdentifier propertyName) {
-  Log log;
+  Log log(FN_NPN_HasMethod, browserNPP(npp));
+  npp = browserNPP(npp);
 
-  log("NPN_HasMethod(npp=%p, obj=%s, propertyName=%s)\n", npp,
-      NPObjectTracker::c_str(obj), Printable(propertyName).c_str());
+  if (log) log.call().pointer("npp", npp).object("obj", obj)
+      .identifier("propertyName", propertyName);
+  ObjectTimer timer(log, obj, propertyName);
   bool r = gBrowserFuncs->hasmethod(npp, obj, propertyName);
-  log(" returned %d\n", r);
+  timer.done(r);
+  if (log) log.returned().boolean(r);
   return r;
 }
 
 void
 wrap_NPN_ReleaseVariantValue(NPVariant *variant) {
-  Log log;
+  Log log(FN_NPN_ReleaseVariantValue);
 
-  log("NPN_ReleaseVariantValue(variant=%s)\n",
-      Printable(variant).c_str());
+  if (log) log.call().variant("variant", variant);
   gBrowserFuncs->releasevariantvalue(variant);
   return;
 }
 
 void
 wrap_NPN_SetException(NPObject *obj, const NPUTF8 *message) {
-  Log log;
+  Log log(FN_NPN_SetException, obj);
 
-  log("NPN_SetException(obj=%s, message=\"%s\")\n",
-      NPObjectTracker::c_str(obj), message);
+  if (log) log.call().object("obj", obj).string("message", message);
   gBrowserFuncs->setexception(obj, message);
   return;
 }
 
 bool
 wrap_NPN_PushPopupsEnabledState(NPP npp, NPBool enabled) {
-  Log log;
+  Log log(FN_NPN_PushPopupsEnabledState, browserNPP(npp));
+  npp = browserNPP(npp);
 
-  log("NPN_PushPopupsEnabledState(npp=%p, enabled=%d)\n", npp, enabled);
+  if (log) log.call().pointer("npp", npp).boolean("enabled", enabled);
   bool r = gBrowserFuncs->pushpopupsenabledstate(npp, enabled);
-  log(" returned %d\n", r);
+  if (log) log.returned().boolean(r);
   return r;
 }
 
 bool
 wrap_NPN_PopPopupsEnabledState(NPP npp) {
-  Log log;
+  Log log(FN_NPN_PopPopupsEnabledState, browserNPP(npp));
+  npp = browserNPP(npp);
 
-  log("NPN_PopPopupsEnabledState(npp=%p)\n", npp);
+  if (log) log.call().pointer("npp", npp);
   bool r = gBrowserFuncs->poppopupsenabledstate(npp);
-  log(" returned %d\n", r);
+  if (log) log.returned().boolean(r);
   return r;
 }
 
 bool
 wrap_NPN_Enumerate(NPP npp, NPObject *obj, NPIdentifier **identifier,
     uint32_t *count) {
-  Log log;
+  Log log(FN_NPN_Enumerate, browserNPP(npp));
+  npp = browserNPP(npp);
 
-  log("NPN_Enumerate(npp=%p, obj=%s)\n", npp, NPObjectTracker::c_str(obj));
+  if (log) log.call().pointer("npp", npp).object("obj", obj);
+  ObjectTimer timer(log, obj, NULL);
   bool r = gBrowserFuncs->enumerate(npp, obj, identifier, count);
+  timer.done();
   if (r) {
-    for (uint32_t i = 0; i < *count; i++) {
-      log("  %s\n", Printable(*identifier[i]).c_str());
-    }
+    if (log) log.returned().boolean(true)
+        .identifiers("identifier", *identifier, *count);
+  } else {
+    if (log) log.returned().boolean(false);
   }
-  log(" returned %d\n", r);
   return r;
 }
 
+/* what the browser calls on the main thread in place of the plugin's
+ * function */
+static void
+asyncCallThunk(void* aCall) {
+  AsyncCall* call = (AsyncCall*)aCall;
+  if (!AsyncCalls::running(call)) {
+    // its instance is gone and we've already taken it back
+    return;
+  }
+  uint64_t start = monotonicNanos();
+  LiveStats::asyncCalls(
+      __atomic_sub_fetch(&AsyncCalls::gWaiting, 1, __ATOMIC_RELAXED));
+  AsyncCalls::gLatency.record(start - call->mScheduled);
+  void (*function)(void*) = call->mFunction;
+  void* userData = call->mUserData;
+  AsyncCalls::release(call);
+  {
+    EventLoop::Call loopCall;
+    function(userData);
+  }
+  AsyncCalls::gDuration.record(monotonicNanos() - start);
+}
+
 void
 wrap_NPN_PluginThreadAsyncCall(NPP npp, void (*func)(void *),
     void *userData) {
-  Log log;
-
-  log("NPN_PluginThreadAsyncCall(npp=%p, func=%p, userData=%p)\n",
-      npp, func, userData);
-  gBrowserFuncs->pluginthreadasynccall(npp, func, userData);
+  Log log(FN_NPN_PluginThreadAsyncCall, browserNPP(npp));
+  npp = browserNPP(npp);
+
+  if (log) log.call().pointer("npp", npp).pointer("func", (void*)func)
+      .pointer("userData", userData);
+  AsyncCall* call = AsyncCalls::get();
+  call->mFunction = func;
+  call->mUserData = userData;
+  call->mScheduled = monotonicNanos();
+  call->mNPP = npp;
+  int waiting = __atomic_add_fetch(&AsyncCalls::gWaiting, 1,
+      __ATOMIC_RELAXED);
+  AsyncCalls::gDepth.record(waiting);
+  LiveStats::asyncCalls(waiting);
+  AsyncCalls::queued(call);
+  gBrowserFuncs->pluginthreadasynccall(npp, asyncCallThunk, call);
 }
 
 bool
 wrap_NPN_Construct(NPP npp, NPObject* obj, const NPVariant *args,
     uint32_t argCount, NPVariant *result) {
-  Log log;
+  Log log(FN_NPN_Construct, browserNPP(npp));
+  npp = browserNPP(npp);
 
-  log("NPN_Construct(npp=%p, obj=%s)\n", npp, NPObjectTracker::c_str(obj));
-  for (uint32_t i = 0; i<argCount; i++) {
-    log("  arg[%d] = %s\n", i, Printable(&args[i]).c_str());
-  }
+  if (log) log.call().pointer("npp", npp).object("obj", obj)
+      .variants("args", args, argCount);
+  ObjectTimer timer(log, obj, NULL);
   bool r = gBrowserFuncs->construct(npp, obj, args, argCount, result);
-  // FIXME: check return value before showing result?
-  log(" returned %d, result=%s\n", r, Printable(result).c_str());
+  timer.done();
+  if (r) {
+    if (log) log.returned().boolean(true).variant("result", result);
+  } else {
+    if (log) log.returned().boolean(false);
+  }
   return r;
 }
 
 NPError
 wrap_NPN_GetValueForURL(NPP npp, NPNURLVariable variable,
     const char *url, char **value, uint32_t *len) {
-  Log log;
+  Log log(FN_NPN_GetValueForURL, browserNPP(npp));
+  npp = browserNPP(npp);
 
-  log("NPN_GetValueForURL(npp=%p variable=%s, url=\"%s\")\n", npp,
+  if (log) log.call().pointer("npp", npp).symbol("variable",
       (variable==NPNURLVCookie)?"cookie":
-      ((variable==NPNURLVProxy)?"proxy":"unknown"), url);
+      ((variable==NPNURLVProxy)?"proxy":"unknown")).string("url", url);
   NPError e = gBrowserFuncs->getvalueforurl(npp, variable, url, value, len);
-  // FIXME: check return before printing values?
-  for (uint32_t i=0; i<*len; i++) {
-    log("  value[%d] = \"%s\"\n", i, value[i]);
+  if (e == NPERR_NO_ERROR) {
+    // the value isn't necessarily terminated
+    NPString string = { *value, *len };
+    if (log) log.returned().error(e).string("value", &string);
+  } else {
+    if (log) log.returned().error(e);
   }
-  log(" returned %s\n", NPErrorName(e));
   return e;
 }
 
 NPError
 wrap_NPN_SetValueForURL(NPP npp, NPNURLVariable variable,
     const char *url, const char *value, uint32_t len) {
-  Log log;
+  Log log(FN_NPN_SetValueForURL, browserNPP(npp));
+  npp = browserNPP(npp);
 
-  log("NPN_SetValueForURL(npp=%p, variable=%s, url=\"%s\", value=\"%s\", "
-      "len=%d)\n", npp,
+  NPString string = { value, len };
+  if (log) log.call().pointer("npp", npp).symbol("variable",
       (variable==NPNURLVCookie)?"cookie":
-      ((variable==NPNURLVProxy)?"proxy":"unknown"), url, value, len);
+      ((variable==NPNURLVProxy)?"proxy":"unknown")).string("url", url)
+      .string("value", &string).integer("len", len);
   NPError e = gBrowserFuncs->setvalueforurl(npp, variable, url, value, len);
-  log(" returned %s\n", NPErrorName(e));
+  if (log) log.returned().error(e);
   return e;
 }
 
@@ -1215,48 +5786,108 @@ wrap_NPN_GetAuthenticationInfo(NPP npp, const char *protocol,
     const char *host, int32_t port, const char *scheme,
     const char *realm, char **username, uint32_t *ulen,
     char **password, uint32_t *plen) {
-  Log log;
+  Log log(FN_NPN_GetAuthenticationInfo, browserNPP(npp));
+  npp = browserNPP(npp);
 
-  log("NPN_GetAuthenticationInfo(npp=%p, protocol=\"%s\", host=\"%s\", "
-      "port=%d, scheme=\"%s\", realm=\"%s\")\n",
-      npp, protocol, host, port, scheme, realm);
+  if (log) log.call().pointer("npp", npp).string("protocol", protocol)
+      .string("host", host).integer("port", port).string("scheme", scheme)
+      .string("realm", realm);
   NPError e = gBrowserFuncs->getauthenticationinfo(npp, protocol, host,
       port, scheme, realm, username, ulen, password, plen);
   // FIXME: check return value before printing username & password?
   // FIXME: copy & truncate username & password
-  log(" returned %s, username=\"%s\", password=\"%s\"\n",
-      NPErrorName(e), *username, *password);
+  if (log) log.returned().error(e).string("username", *username)
+      .string("password", *password);
   return e;
 }
 
+/* the browser calls timers back with its NPP, so we register this in the
+ * plugin's place and call the plugin's timer with the plugin's NPP, timing
+ * it on the way */
+static void
+timerTrampoline(NPP npp, uint32_t timerID) {
+  PluginInstance* instance = PluginInstance::fromBrowser(npp);
+  if (instance == NULL) {
+    return;
+  }
+  std::map<uint32_t,Timer>::iterator i = instance->mTimers.find(timerID);
+  if (i == instance->mTimers.end()) {
+    return;
+  }
+  uint64_t start = monotonicNanos();
+  int64_t late = (int64_t)(start - i->second.mLastFired) -
+    (int64_t)i->second.mInterval * 1000000;
+  uint32_t interval = i->second.mInterval;
+  i->second.mLastFired = start;
+  {
+    EventLoop::Call call;
+    i->second.mFunction(instance->pluginNPP(), timerID);
+  }
+  uint64_t nanos = monotonicNanos() - start;
+  // the callback may have unscheduled its own timer
+  i = instance->mTimers.find(timerID);
+  if (i != instance->mTimers.end()) {
+    i->second.mStats.record(late, nanos);
+    // the browser is done with a one-shot timer once it fires (unless the
+    // callback scheduled another that got the same id)
+    if (!i->second.mRepeat && i->second.mLastFired == start) {
+      instance->mTimers.erase(i);
+    }
+  }
+  instance->mTimerIntervals[interval].record(late, nanos);
+  LiveStats::count(instance->mLive, &PluginStatsInstance::timerFires);
+}
+
 uint32_t
 wrap_NPN_ScheduleTimer(NPP npp, uint32_t interval, NPBool repeat,
     void (*timerFunc)(NPP npp, uint32_t timerID)) {
-  Log log;
-
-  log("NPN_ScheduleTimer(npp=%p, interval=%d, repeat=%d, timerFunc=%p)\n",
-      npp, interval, repeat, timerFunc);
-  uint32_t r = gBrowserFuncs->scheduletimer(npp, interval, repeat, timerFunc);
-  log(" returned %d\n", r);
+  Log log(FN_NPN_ScheduleTimer, browserNPP(npp));
+  PluginInstance* instance = PluginInstance::fromPlugin(npp);
+  npp = browserNPP(npp);
+
+  if (log) log.call().pointer("npp", npp).integer("interval", interval)
+      .boolean("repeat", repeat).pointer("timerFunc", (void*)timerFunc);
+  uint32_t r = gBrowserFuncs->scheduletimer(npp, interval, repeat,
+      timerTrampoline);
+  // 0 means the browser didn't schedule it
+  if (instance != NULL && r != 0) {
+    Timer& timer = instance->mTimers[r];
+    timer.mFunction = timerFunc;
+    timer.mInterval = interval;
+    timer.mRepeat = repeat;
+    timer.mLastFired = monotonicNanos();
+    timer.mStats = TimerStats();
+  }
+  if (log) log.returned().integer(r);
   return r;
 }
 
 void
 wrap_NPN_UnscheduleTimer(NPP npp, uint32_t timerID) {
-  Log log;
+  Log log(FN_NPN_UnscheduleTimer, browserNPP(npp));
+  PluginInstance* instance = PluginInstance::fromPlugin(npp);
+  npp = browserNPP(npp);
 
-  log("NPN_UnscheduleTimer(npp=%p, timerID=%d)\n", npp, timerID);
+  if (log) log.call().pointer("npp", npp).integer("timerID", timerID);
   gBrowserFuncs->unscheduletimer(npp, timerID);
+  if (instance != NULL) {
+    std::map<uint32_t,Timer>::iterator i = instance->mTimers.find(timerID);
+    if (i != instance->mTimers.end()) {
+      if (log.traced()) instance->reportTimer(log, timerID, i->second);
+      instance->mTimers.erase(i);
+    }
+  }
   return;
 }
 
 NPError
 wrap_NPN_PopUpContextMenu(NPP npp, NPMenu* menu) {
-  Log log;
+  Log log(FN_NPN_PopUpContextMenu, browserNPP(npp));
+  npp = browserNPP(npp);
 
-  log("NPN_PopUpContextMenu(npp=%p, NPMenu=%p)\n", npp, menu);
+  if (log) log.call().pointer("npp", npp).pointer("menu", menu);
   NPError e = gBrowserFuncs->popupcontextmenu(npp, menu);
-  log(" returned %s\n", NPErrorName(e));
+  if (log) log.returned().error(e);
   return e;
 }
 
@@ -1264,15 +5895,18 @@ NPBool
 wrap_NPN_ConvertPoint(NPP npp,
     double sourceX, double sourceY, NPCoordinateSpace sourceSpace,
     double *destX, double *destY, NPCoordinateSpace destSpace) {
-  Log log;
+  Log log(FN_NPN_ConvertPoint, browserNPP(npp));
+  npp = browserNPP(npp);
 
-  log("NPN_ConvertPoint(npp=%p, sourceX=%lf, sourceY=%lf, sourceSpace=%d, "
-      "destSpace=%d)\n", npp, sourceX, sourceY, sourceSpace, destSpace);
+  if (log) log.call().pointer("npp", npp).real("sourceX", sourceX)
+      .real("sourceY", sourceY).integer("sourceSpace", sourceSpace)
+      .integer("destSpace", destSpace);
   NPBool r = gBrowserFuncs->convertpoint(npp, sourceX, sourceY, sourceSpace,
       destX, destY, destSpace);
   // FIXME: should we print destX and destY on r==FALSE?
   // how can I tell? it's not documented anywhere
-  log(" returned %d, destX=%lf, destY=%lf\n", r, *destX, *destY);
+  if (log) log.returned().boolean(r).real("destX", destX ? *destX : 0)
+      .real("destY", destY ? *destY : 0);
   return r;
 }
 
@@ -1286,176 +5920,567 @@ wrap_NPP_New(NPMIMEType   pluginType,
              char*        argn[],
              char*        argv[],
              NPSavedData* saved) {
-  Log log;
-
-  log("NPP_New(pluginType=\"%s\", instance=%p, mode=%d, argc=%d, saved=%p)\n",
-      pluginType, instance, mode, argc, saved);
-  for (int i=0; i<argc; i++) {
-    log(" arg[%d] %s=\"%s\"\n", i, argn[i], argv[i]);
+  Log log(FN_NPP_New, instance);
+  EventLoop::Call call;
+
+  if (log) log.call().string("pluginType", pluginType)
+      .pointer("instance", instance).integer("mode", mode)
+      .integer("argc", argc).strings("argn", argn, argc)
+      .strings("argv", argv, argc).pointer("saved", saved);
+  PluginTarget* target = PluginTarget::forType(pluginType);
+  if (log) log.values().string("plugin", target->mPath.c_str());
+  if (target->mPluginFuncs == NULL) {
+    if (log) log.returned().error(NPERR_MODULE_LOAD_FAILED_ERROR);
+    return NPERR_MODULE_LOAD_FAILED_ERROR;
   }
-  NPError e = gPluginFuncs->newp(pluginType, instance, mode,
+  PluginInstance* pi = new PluginInstance(instance, target, pluginType);
+  NPError e = target->mPluginFuncs->newp(pluginType, pi->pluginNPP(), mode,
       argc, argn, argv, saved);
-  log(" returned %s\n", NPErrorName(e));
+  if (e != NPERR_NO_ERROR) {
+    delete pi;
+  }
+  if (log) log.returned().error(e);
   return e;
 }
 
 
 NPError
 wrap_NPP_Destroy(NPP instance, NPSavedData** save) {
-  Log log;
-
-  log("NPP_Destroy(instance=%p, save=%p)\n", instance, save);
-  NPError e = gPluginFuncs->destroy(instance, save);
-  log(" returned %s\n", NPErrorName(e));
+  Log log(FN_NPP_Destroy, instance);
+  EventLoop::Call call;
+
+  if (log) log.call().pointer("instance", instance).pointer("save", save);
+  NPError e = pluginFuncs(instance)->destroy(pluginNPP(instance), save);
+  if (log) log.returned().error(e);
+  int dropped = AsyncCalls::reclaim(instance);
+  if (log && dropped) log.values().integer("asyncCallsDropped", dropped);
+  PluginInstance* pluginInstance = PluginInstance::fromBrowser(instance);
+  if (log.traced() && pluginInstance) {
+    pluginInstance->reportTimers(log);
+    pluginInstance->mURLRequests.report(log, pluginInstance->mCreated);
+    pluginInstance->mFrames.report(log);
+    pluginInstance->mInvalidations.report(log);
+  }
+  delete pluginInstance;
   return e;
 }
 
 NPError
 wrap_NPP_SetWindow(NPP instance, NPWindow* window) {
-  Log log;
+  Log log(FN_NPP_SetWindow, instance);
+  EventLoop::Call call;
 
-  log("NPP_SetWindow(instance=%p, window=%p)\n", instance, window);
-  NPError e = gPluginFuncs->setwindow(instance, window);
-  log(" returned %s\n", NPErrorName(e));
+  if (log) log.call().pointer("instance", instance).pointer("window", window);
+  NPError e = pluginFuncs(instance)->setwindow(pluginNPP(instance), window);
+  if (log) log.returned().error(e);
   return e;
 };
 
 NPError
 wrap_NPP_NewStream(NPP instance, NPMIMEType type, NPStream* stream,
     NPBool seekable, uint16_t* stype) {
-  Log log;
-
-  log("NPP_NewStream(instance=%p, type=\"%s\", stream=%p, seekable=%d, "
-      "stype=%p)\n", instance, type, stream, seekable, stype);
-  NPError e = gPluginFuncs->newstream(instance, type, stream, seekable, stype);
-  log(" returned %s\n", NPErrorName(e));
+  Log log(FN_NPP_NewStream, instance);
+  EventLoop::Call call;
+
+  if (log) log.call().pointer("instance", instance).string("type", type)
+      .pointer("stream", stream).boolean("seekable", seekable)
+      .pointer("stype", stype);
+  NPError e = pluginFuncs(instance)->newstream(pluginNPP(instance), type, stream, seekable, stype);
+  PluginInstance* pluginInstance = PluginInstance::fromBrowser(instance);
+  if (e == NPERR_NO_ERROR && pluginInstance) {
+    pluginInstance->mURLRequests.streamStarted(stream);
+    LiveStats::count(pluginInstance->mLive, &PluginStatsInstance::streams);
+  }
+  if (log) log.returned().error(e);
   return e;
 }
 
 NPError
 wrap_NPP_DestroyStream(NPP instance, NPStream* stream, NPReason reason) {
-  Log log;
-
-  log("NPP_DestroyStream(instance=%p, stream=%p, reason=%d)\n",
-      instance, stream, reason);
-  NPError e = gPluginFuncs->destroystream(instance, stream, reason);
-  log(" returned %s\n", NPErrorName(e));
+  Log log(FN_NPP_DestroyStream, instance);
+  EventLoop::Call call;
+
+  if (log) log.call().pointer("instance", instance).pointer("stream", stream)
+      .symbol("reason", NPReasonName(reason));
+  PluginInstance* pluginInstance = PluginInstance::fromBrowser(instance);
+  std::map<NPStream*,WriteBuffer>::iterator buffer;
+  bool failed = false;
+  if (pluginInstance && (buffer = pluginInstance->mWriteBuffers.find(stream))
+      != pluginInstance->mWriteBuffers.end()) {
+    failed = !drainWrites(log, instance, stream, buffer->second);
+    pluginInstance->mWriteBuffers.erase(buffer);
+  }
+  if (failed && reason == NPRES_DONE) {
+    // the browser thinks the plugin has it all, but it doesn't
+    reason = NPRES_NETWORK_ERR;
+    // the plugin failed the last write
+    if (log) log.values().symbol("passedOnReason", NPReasonName(reason));
+  }
+  NPError e = pluginFuncs(instance)->destroystream(pluginNPP(instance), stream, reason);
+  if (pluginInstance) {
+    pluginInstance->mURLRequests.streamDestroyed(stream, reason);
+  }
+  if (failed && e == NPERR_NO_ERROR) {
+    e = NPERR_GENERIC_ERROR;
+  }
+  if (log) log.returned().error(e);
   return e;
 };
 
 void
 wrap_NPP_StreamAsFile(NPP instance, NPStream* stream, const char* fname) {
-  Log log;
-
-  log("NPP_StreamAsFile(instance=%p, stream=%p, fname=\"%s\")\n",
-      instance, stream, fname);
-  gPluginFuncs->asfile(instance, stream, fname);
+  Log log(FN_NPP_StreamAsFile, instance);
+  EventLoop::Call call;
+
+  if (log) log.call().pointer("instance", instance).pointer("stream", stream)
+      .string("fname", fname);
+  // the plugin should have all of the stream before it reads the file - if
+  // it fails to take the rest, NPP_DestroyStream says so
+  PluginInstance* pluginInstance = PluginInstance::fromBrowser(instance);
+  std::map<NPStream*,WriteBuffer>::iterator buffer;
+  if (pluginInstance && (buffer = pluginInstance->mWriteBuffers.find(stream))
+      != pluginInstance->mWriteBuffers.end()) {
+    drainWrites(log, instance, stream, buffer->second);
+  }
+  pluginFuncs(instance)->asfile(pluginNPP(instance), stream, fname);
 }
 
 int32_t
 wrap_NPP_WriteReady(NPP instance, NPStream* stream) {
-  Log log;
-
-  log("NPP_WriteReady(instance=%p, stream=%p)\n", instance, stream);
-  int32_t r = gPluginFuncs->writeready(instance, stream);
-  log(" returned %d\n", r);
+  Log log(FN_NPP_WriteReady, instance);
+  EventLoop::Call call;
+
+  if (log) log.call().pointer("instance", instance).pointer("stream", stream);
+  int32_t r = pluginFuncs(instance)->writeready(pluginNPP(instance), stream);
+  PluginInstance* pluginInstance = PluginInstance::fromBrowser(instance);
+  if (COALESCE_WRITES && pluginInstance) {
+    // only take as much as we can pass on to the plugin in one write
+    WriteBuffer& b = pluginInstance->mWriteBuffers[stream];
+    // with no end to wait for, don't hold on to data that's gone quiet
+    bool idle = stream->end == 0 && !b.mData.empty() &&
+      monotonicNanos() - b.mFirstBuffered >=
+      COALESCE_WRITES_IDLE_MS * 1000000ULL;
+    if (r > 0 && !b.mData.empty() &&
+        ((int32_t)b.mData.size() >= MIN(r, COALESCE_WRITES) || idle)) {
+      b.mReady = r;
+      flushWrites(log, instance, stream, b, r);
+      r = pluginFuncs(instance)->writeready(pluginNPP(instance), stream);
+    }
+    b.mReady = r;
+    if (r > 0) {
+      r = MIN(r, COALESCE_WRITES) - (int32_t)b.mData.size();
+      if (r < 0) r = 0;
+    }
+  }
+  if (log) log.returned().integer(r);
   return r;
 }
 
 int32_t
 wrap_NPP_Write(NPP instance, NPStream* stream, int32_t offset, int32_t len,
     void* buffer) {
-  Log log;
-
-  log("NPP_Write(instance=%p, stream=%p, offset=%d, len=%d, buffer=%p)\n",
-      instance, stream, offset, len, buffer);
-  int32_t r = gPluginFuncs->write(instance, stream, offset, len, buffer);
-  log(" returned %d\n", r);
+  Log log(FN_NPP_Write, instance);
+  EventLoop::Call call;
+
+  if (log) log.call().pointer("instance", instance).pointer("stream", stream)
+      .integer("offset", offset).integer("len", len).pointer("buffer", buffer);
+  PluginInstance* pluginInstance = PluginInstance::fromBrowser(instance);
+  int32_t r;
+  if (COALESCE_WRITES && pluginInstance) {
+    WriteBuffer& b = pluginInstance->mWriteBuffers[stream];
+    int32_t limit = b.mReady > 0 ? b.mReady : COALESCE_WRITES;
+    if (!b.mData.empty() &&
+        offset != b.mOffset + (int32_t)b.mData.size()) {
+      // not where the buffer ends, so pass that on first
+      flushWrites(log, instance, stream, b, limit);
+    }
+    if (b.mError) {
+      r = b.mError;
+    } else if (!b.mData.empty() &&
+        offset != b.mOffset + (int32_t)b.mData.size()) {
+      // the plugin didn't take it all, so have the browser try again
+      r = 0;
+    } else {
+      if (b.mData.empty()) {
+        b.mOffset = offset;
+        b.mFirstBuffered = monotonicNanos();
+      }
+      b.mData.append((const char*)buffer, len);
+      WriteCoalescing::gBrowserWrites++;
+      if ((int32_t)b.mData.size() >= MIN(limit, COALESCE_WRITES) ||
+          (stream->end && (uint32_t)(offset + len) >= stream->end)) {
+        flushWrites(log, instance, stream, b, limit);
+      }
+      r = b.mError ? b.mError : len;
+    }
+  } else {
+    r = pluginFuncs(instance)->write(pluginNPP(instance), stream, offset, len, buffer);
+  }
+  if (r > 0 && pluginInstance) {
+    pluginInstance->mURLRequests.wrote(stream, r);
+    LiveStats::wrote(pluginInstance->mLive, r);
+  }
+  if (log) log.returned().integer(r);
   return r;
 }
 
 void
 wrap_NPP_Print(NPP instance, NPPrint* platformPrint) {
-  Log log;
+  Log log(FN_NPP_Print, instance);
+  EventLoop::Call call;
 
-  log("NPP_Print(instance=%p, platformPrint=%p)\n", instance, platformPrint);
-  gPluginFuncs->print(instance, platformPrint);
+  if (log) log.call().pointer("instance", instance)
+      .pointer("platformPrint", platformPrint);
+  pluginFuncs(instance)->print(pluginNPP(instance), platformPrint);
   return;
 }
 
 int16_t
 wrap_NPP_HandleEvent(NPP instance, void* event) {
-  Log log;
-
-  log("NPP_HandleEvent(instance=%p, event=%p)\n", instance, event);
-  int16_t r = gPluginFuncs->event(instance, event);
-  log(" returned %d\n", r);
+  Log log(FN_NPP_HandleEvent, instance);
+  EventLoop::Call call;
+
+#ifdef MOZ_X11
+  const XEvent* xevent = (const XEvent*)event;
+  if (log) {
+    char description[128];
+    describeXEvent(description, sizeof(description), xevent);
+    log.call().pointer("instance", instance).symbol("event", description);
+  }
+  uint64_t start = monotonicNanos();
+  int16_t r = pluginFuncs(instance)->event(pluginNPP(instance), event);
+  uint64_t nanos = monotonicNanos() - start;
+  XEvents::record(xevent->type, nanos);
+  PluginInstance* pluginInstance = PluginInstance::fromBrowser(instance);
+  if (xevent->type == GraphicsExpose && pluginInstance) {
+    pluginInstance->mFrames.painted(start, nanos);
+    LiveStats::count(pluginInstance->mLive, &PluginStatsInstance::paints);
+    LiveStats::count(pluginInstance->mLive, &PluginStatsInstance::paintNanos,
+        nanos);
+  }
+  if (xevent->type == GraphicsExpose &&
+      nanos >= SLOW_PAINT_MS * 1000000ULL) {
+    XEvents::gSlowPaints++;
+    if (log) {
+      const XGraphicsExposeEvent& e = xevent->xgraphicsexpose;
+      log.values().integer("slowPaintUs", nanos / 1000)
+          .integer("width", e.width).integer("height", e.height)
+          .integer("x", e.x).integer("y", e.y);
+    }
+  }
+#else
+  if (log) log.call().pointer("instance", instance).pointer("event", event);
+  int16_t r = pluginFuncs(instance)->event(pluginNPP(instance), event);
+#endif
+  if (log) log.returned().integer(r);
   return r;
 }
 
 void
 wrap_NPP_URLNotify(NPP instance, const char* url, NPReason reason,
     void* notifyData) {
-  Log log;
-
-  log("NPP_URLNotify(instance=%p, url=\"%s\", reason=%d, notifyData=%p)\n",
-      instance, url, reason, notifyData);
-  gPluginFuncs->urlnotify(instance, url, reason, notifyData);
+  Log log(FN_NPP_URLNotify, instance);
+  EventLoop::Call call;
+
+  if (log) log.call().pointer("instance", instance).string("url", url)
+      .symbol("reason", NPReasonName(reason)).pointer("notifyData", notifyData);
+  pluginFuncs(instance)->urlnotify(pluginNPP(instance), url, reason, notifyData);
+  PluginInstance* pluginInstance = PluginInstance::fromBrowser(instance);
+  if (pluginInstance) {
+    pluginInstance->mURLRequests.notified(url, reason, notifyData);
+  }
   return;
 }
 
 NPError
 wrap_NPP_GetValue(NPP instance, NPPVariable variable, void* ret) {
-  Log log;
+  Log log(FN_NPP_GetValue, instance);
+  EventLoop::Call call;
 
-  log("NPP_GetValue(instance=%p, variable=%s, ret=%p)\n",
-      instance, NPPVariableName(variable), ret);
-  NPError e = gPluginFuncs->getvalue(instance, variable, ret);
+  if (log) log.call().pointer("instance", instance)
+      .symbol("variable", NPPVariableName(variable)).pointer("ret", ret);
+  NPError e = pluginFuncs(instance)->getvalue(pluginNPP(instance), variable, ret);
   if (variable == NPPVpluginScriptableNPObject) {
     NPObject* obj = *(NPObject**)ret;
     NPObjectTracker::getTracker(obj)->setPath("pluginScriptable");
-    log(" returned %s, obj=%s\n", NPErrorName(e), Printable(obj).c_str());
+    if (log) log.returned().error(e).object("obj", obj);
   } else {
-    log(" returned %s\n", NPErrorName(e));
+    if (log) log.returned().error(e);
   }
   return e;
 }
 
 NPError
 wrap_NPP_SetValue(NPP instance, NPNVariable variable, void* ret) {
-  Log log;
+  Log log(FN_NPP_SetValue, instance);
+  EventLoop::Call call;
 
-  log("NPP_SetValue(instance=%p, variable=%s, ret=%p)\n",
-      instance, NPNVariableName(variable), ret);
-  NPError e = gPluginFuncs->setvalue(instance, variable, ret);
-  log(" returned %s\n", NPErrorName(e));
+  if (log) log.call().pointer("instance", instance)
+      .symbol("variable", NPNVariableName(variable)).pointer("ret", ret);
+  NPError e = pluginFuncs(instance)->setvalue(pluginNPP(instance), variable, ret);
+  if (log) log.returned().error(e);
   return e;
 }
 
+/* Browsers call NP_GetMIMEDescription, NP_GetPluginVersion and NP_GetValue
+ * for the name and description while scanning for plugins at startup.
+ * Rather than loading the real plugin each time, we remember its answers
+ * in CACHEFILE, keyed by its path, modification time and size, and don't
+ * dlopen it until NP_Initialize. */
+#ifndef CACHEFILE
+#define CACHEFILE LOGFILE ".cache"
+#endif
+
+/* the cache key for the plugin at aPath, or "" if it can't be read */
+static std::string
+pluginKey(const char* aPath) {
+  struct stat st;
+  if (stat(aPath, &st) != 0) {
+    return std::string();
+  }
+  char stamp[64];
+  snprintf(stamp, 64, "\t%lld.%09ld\t%lld", (long long)st.st_mtim.tv_sec,
+      st.st_mtim.tv_nsec, (long long)st.st_size);
+  return std::string(aPath) + stamp;
+}
+
+/* look aInfo.key up in the cache */
+static bool
+readPluginInfo(PluginInfo& aInfo) {
+  FILE* cache = fopen(CACHEFILE, "r");
+  if (cache == NULL) {
+    return false;
+  }
+  bool found = false;
+  char* line = NULL;
+  size_t size = 0;
+  ssize_t length;
+  std::string prefix = aInfo.key + "\t";
+  while (!found && (length = getline(&line, &size, cache)) > 0) {
+    if (strncmp(line, prefix.c_str(), prefix.size()) != 0) {
+      continue;
+    }
+    // version, name, description, mime description
+    std::string* fields[] = { &aInfo.version, &aInfo.name,
+      &aInfo.description, &aInfo.mimeDescription };
+    const char* field = line + prefix.size();
+    for (int i = 0; i < 4; i++) {
+      size_t fieldLength = strcspn(field, "\t\n");
+      fields[i]->assign(field, fieldLength);
+      field += fieldLength;
+      if (*field == '\t') field++;
+    }
+    found = true;
+  }
+  free(line);
+  fclose(cache);
+  return found;
+}
+
+/* store aInfo in the cache, replacing any older entry for the same path */
 static void
-initialize() {
-  Log log;
+writePluginInfo(const PluginInfo& aInfo) {
+  std::string entry = aInfo.key + "\t" + aInfo.version + "\t" +
+    aInfo.name + "\t" + aInfo.description + "\t" + aInfo.mimeDescription;
+  if (entry.find('\n') != std::string::npos ||
+      std::count(entry.begin(), entry.end(), '\t') != 6) {
+    // can't be represented in the cache
+    return;
+  }
+  std::string path = aInfo.key.substr(0, aInfo.key.find('\t') + 1);
+
+  std::string contents;
+  FILE* cache = fopen(CACHEFILE, "r");
+  if (cache != NULL) {
+    char* line = NULL;
+    size_t size = 0;
+    while (getline(&line, &size, cache) > 0) {
+      if (strncmp(line, path.c_str(), path.size()) != 0) {
+        contents.append(line);
+      }
+    }
+    free(line);
+    fclose(cache);
+  }
+  contents.append(entry);
+  contents.append("\n");
+
+  // replace the file atomically in case another browser is reading it
+  std::string temporary = std::string(CACHEFILE) + ".tmp";
+  cache = fopen(temporary.c_str(), "w");
+  if (cache == NULL) {
+    return;
+  }
+  bool ok = fwrite(contents.data(), 1, contents.size(), cache) ==
+    contents.size();
+  ok = (fclose(cache) == 0) && ok;
+  if (ok) {
+    rename(temporary.c_str(), CACHEFILE);
+  } else {
+    unlink(temporary.c_str());
+  }
+}
+
+/* load the real plugin, if we haven't already */
+void
+PluginTarget::load() {
+  if (mLoadAttempted) return;
+  mLoadAttempted = true;
+
+  Log log(FN_pluginlogger);
 
-  log("loading the plugin so from: %s\n", PLUGIN);
+  if (log) log("loading the plugin so from: %s\n", mPath.c_str());
 
   // load the plugin shared object
-  gPlugin = dlopen(PLUGIN, RTLD_LOCAL);
-  log("loaded the plugin as %p\n", gPlugin);
-  if (gPlugin == NULL) {
-    log("dlerror returns: %s\n", dlerror());
+  uint64_t start = monotonicNanos();
+  mHandle = dlopen(mPath.c_str(), RTLD_LAZY|RTLD_LOCAL);
+  mStartupTimes.dlopen = monotonicNanos() - start;
+  if (log) log("loaded the plugin as %p in %lluus\n", mHandle,
+      (unsigned long long)mStartupTimes.dlopen / 1000);
+  if (mHandle == NULL) {
+    if (log) log("dlerror returns: %s\n", dlerror());
+    return;
   }
 
   // get handles to all of the global function pointers from the plugin
-  gExportedPluginFunctions.initialize = (NP_Initialize_Func)
-    dlsym(gPlugin, "NP_Initialize");
-  gExportedPluginFunctions.getPluginVersion = (NP_GetPluginVersion_Func)
-    dlsym(gPlugin, "NP_GetPluginVersion");
-  gExportedPluginFunctions.getMIMEDescription = (NP_GetMIMEDescription_Func)
-    dlsym(gPlugin, "NP_GetMIMEDescription");
-  gExportedPluginFunctions.getValue = (NP_GetValue_Func)
-    dlsym(gPlugin, "NP_GetValue");
-  gExportedPluginFunctions.shutdown = (NP_Shutdown_Func)
-    dlsym(gPlugin, "NP_Shutdown");
+  start = monotonicNanos();
+  mFunctions.initialize = (NP_Initialize_Func)
+    dlsym(mHandle, "NP_Initialize");
+  mFunctions.getPluginVersion = (NP_GetPluginVersion_Func)
+    dlsym(mHandle, "NP_GetPluginVersion");
+  mFunctions.getMIMEDescription = (NP_GetMIMEDescription_Func)
+    dlsym(mHandle, "NP_GetMIMEDescription");
+  mFunctions.getValue = (NP_GetValue_Func)
+    dlsym(mHandle, "NP_GetValue");
+  mFunctions.shutdown = (NP_Shutdown_Func)
+    dlsym(mHandle, "NP_Shutdown");
+  mStartupTimes.dlsym = monotonicNanos() - start;
+  if (log) log("looked up the plugin's functions in %lluus\n",
+      (unsigned long long)mStartupTimes.dlsym / 1000);
+}
+
+/* the plugin's MIME description, version, name and description, from the
+ * cache if possible */
+const PluginInfo&
+PluginTarget::info() {
+  if (mHaveInfo) {
+    return mInfo;
+  }
+  mHaveInfo = true;
+
+  Log log(FN_pluginlogger);
+
+  mInfo.key = pluginKey(mPath.c_str());
+  if (!mInfo.key.empty() && readPluginInfo(mInfo)) {
+    mStartupTimes.infoFromCache = true;
+    if (log) log("read plugin info for %s from %s\n", mPath.c_str(),
+        CACHEFILE);
+    registerTypes();
+    return mInfo;
+  }
+
+  load();
+  if (mFunctions.getMIMEDescription != NULL) {
+    const char* md = mFunctions.getMIMEDescription();
+    mInfo.mimeDescription = md ? md : "";
+  }
+  if (mFunctions.getPluginVersion != NULL) {
+    const char* v = mFunctions.getPluginVersion();
+    mInfo.version = v ? v : "";
+  }
+  if (mFunctions.getValue != NULL) {
+    const char* name = NULL;
+    if (mFunctions.getValue(NULL, NPPVpluginNameString,
+          &name) == NPERR_NO_ERROR && name != NULL) {
+      mInfo.name = name;
+    }
+    const char* description = NULL;
+    if (mFunctions.getValue(NULL, NPPVpluginDescriptionString,
+          &description) == NPERR_NO_ERROR && description != NULL) {
+      mInfo.description = description;
+    }
+  }
+  if (!mInfo.key.empty() && !mInfo.mimeDescription.empty()) {
+    writePluginInfo(mInfo);
+    if (log) log("wrote plugin info for %s to %s\n", mPath.c_str(),
+        CACHEFILE);
+  }
+  registerTypes();
+  return mInfo;
+}
+
+void
+PluginTarget::registerTypes() {
+  // MIME descriptions look like "type:extensions:description;type:..."
+  const std::string& md = mInfo.mimeDescription;
+  size_t start = 0;
+  while (start < md.size()) {
+    size_t end = md.find(';', start);
+    if (end == std::string::npos) end = md.size();
+    std::string type = md.substr(start, md.find(':', start) - start);
+    if (type.size() > end - start) type = md.substr(start, end - start);
+    // the first plugin to claim a type gets it
+    if (!type.empty() && gByType.find(type) == gByType.end()) {
+      gByType[type] = this;
+    }
+    start = end + 1;
+  }
+}
+
+PluginTarget*
+PluginTarget::forType(const char* aType) {
+  if (aType != NULL && gTargets.size() > 1) {
+    for (size_t i = 0; i < gTargets.size(); i++) {
+      gTargets[i]->info();
+    }
+    TargetMap::iterator i = gByType.find(aType);
+    if (i != gByType.end()) {
+      return i->second;
+    }
+  }
+  return gTargets[0];
+}
+
+/* the combined MIME description, names and descriptions of all of the
+ * plugins we wrap */
+static std::string gMIMEDescription;
+static std::string gName;
+static std::string gDescription;
+
+static void
+combinePluginInfo() {
+  static bool combined = false;
+  if (combined) return;
+  combined = true;
+
+  for (size_t i = 0; i < gTargets.size(); i++) {
+    const PluginInfo& info = gTargets[i]->info();
+    if (info.mimeDescription.empty()) continue;
+    if (!gMIMEDescription.empty()) gMIMEDescription.append(";");
+    gMIMEDescription.append(info.mimeDescription);
+  }
+  if (gTargets.size() == 1) {
+    gName = gTargets[0]->info().name;
+    gDescription = gTargets[0]->info().description;
+    return;
+  }
+  for (size_t i = 0; i < gTargets.size(); i++) {
+    const PluginInfo& info = gTargets[i]->info();
+    if (i > 0) {
+      gName.append(", ");
+      gDescription.append("; ");
+    }
+    gName.append(info.name.empty() ? gTargets[i]->mPath : info.name);
+    gDescription.append(info.description);
+  }
+}
+
+static void
+initialize() {
+  Log log(FN_pluginlogger);
+
+  Clock::start();
+  Stalls::initialize();
 
   // set up our browser api wrappers
   gWrappedBrowserFuncs = new NPNetscapeFuncs;
@@ -1514,23 +6539,38 @@ initialize() {
   gWrappedBrowserFuncs->popupcontextmenu = wrap_NPN_PopUpContextMenu;
   gWrappedBrowserFuncs->convertpoint = wrap_NPN_ConvertPoint;
 
+  // find the plugins we're wrapping
+  std::string plugins = PLUGINS;
+  size_t start = 0;
+  while (start <= plugins.size()) {
+    size_t end = plugins.find(':', start);
+    if (end == std::string::npos) end = plugins.size();
+    if (end > start) {
+      gTargets.push_back(new PluginTarget(plugins.substr(start, end - start)));
+    }
+    start = end + 1;
+  }
+
   gInitialized = true;
 
-  log("initialized\n");
+  if (log) log("initialized, timing with %s\n",
+      Clock::usingTSC() ? "the TSC" : "clock_gettime");
 }
 
 
 NP_EXPORT(NPError)
 NP_Initialize(NPNetscapeFuncs* aBrowserFuncs,
               NPPluginFuncs* aPluginFuncs) {
-  Log log;
+  Log log(FN_NP_Initialize);
 
   if (!gInitialized) initialize();
 
-  log("NP_Initialize() browser version=%d, size=%d. "
-      "wrapper version=%d, size=%d\n",
-      aBrowserFuncs->version, aBrowserFuncs->size,
-      gWrappedBrowserFuncs->version, gWrappedBrowserFuncs->size);
+  if (log) log.call().pointer("aBrowserFuncs", aBrowserFuncs)
+      .pointer("aPluginFuncs", aPluginFuncs)
+      .integer("browserVersion", aBrowserFuncs->version)
+      .integer("browserSize", aBrowserFuncs->size)
+      .integer("wrapperVersion", gWrappedBrowserFuncs->version)
+      .integer("wrapperSize", gWrappedBrowserFuncs->size);
 
   // save off the browser functions
   gBrowserFuncs = aBrowserFuncs;
@@ -1559,66 +6599,104 @@ NP_Initialize(NPNetscapeFuncs* aBrowserFuncs,
   gWrappedBrowserFuncs->size = MIN(gWrappedBrowserFuncs->size,
       gBrowserFuncs->size);
 
-  gPluginFuncs = new NPPluginFuncs;
-  NPError e = gExportedPluginFunctions.initialize(gWrappedBrowserFuncs,
-      gPluginFuncs);
-  log(" returning %s\n", NPErrorName(e));
+  // initialize each plugin, it's enough for one of them to work
+  NPError e = NPERR_MODULE_LOAD_FAILED_ERROR;
+  for (size_t i = 0; i < gTargets.size(); i++) {
+    PluginTarget* target = gTargets[i];
+    target->load();
+    if (target->mFunctions.initialize == NULL) {
+      if (log) log.values().string("couldNotLoad", target->mPath.c_str());
+      continue;
+    }
+    NPPluginFuncs* funcs = new NPPluginFuncs;
+    memset(funcs, 0, sizeof(NPPluginFuncs));
+    funcs->size = sizeof(NPPluginFuncs);
+    uint64_t start = monotonicNanos();
+    NPError te = target->mFunctions.initialize(gWrappedBrowserFuncs, funcs);
+    target->mStartupTimes.initialize = monotonicNanos() - start;
+    if (log) log.values().string("plugin", target->mPath.c_str())
+        .integer("initializeUs", target->mStartupTimes.initialize / 1000)
+        .error("returned", te);
+    if (te == NPERR_NO_ERROR) {
+      target->mPluginFuncs = funcs;
+      e = NPERR_NO_ERROR;
+    } else {
+      delete funcs;
+      if (e != NPERR_NO_ERROR) e = te;
+    }
+  }
+  if (log) log.returned().error(e);
   return e;
 }
 
 NP_EXPORT(char*)
 NP_GetPluginVersion() {
-  Log log;
+  Log log(FN_NP_GetPluginVersion);
 
   if (!gInitialized) initialize();
-  log("NP_GetPluginVersion()\n");
-  if (gExportedPluginFunctions.getPluginVersion != NULL) {
-    char* v = gExportedPluginFunctions.getPluginVersion();
-    log(" returned %s\n", v);
-    return v;
+  if (log) log.call();
+  // with several plugins the first one speaks for all of them
+  const PluginInfo& info = gTargets[0]->info();
+  if (!info.version.empty()) {
+    if (log) log.returned().string(info.version.c_str());
+    return (char*)info.version.c_str();
   } else {
-    log(" not defined on plugin, returning 1.0\n");
+    // not defined on the plugin
+    if (log) log.returned().string("1.0").boolean("default", true);
     return (char*)"1.0";
   }
 }
 
 NP_EXPORT(char*)
 NP_GetMIMEDescription() {
-  Log log;
+  Log log(FN_NP_GetMIMEDescription);
 
   if (!gInitialized) initialize();
-  log("NP_GetGetMIMEDescription()\n");
-  char* md = gExportedPluginFunctions.getMIMEDescription();
-  log(" returned %s\n", md);
-  return md;
+  if (log) log.call();
+  combinePluginInfo();
+  const char* md = gMIMEDescription.c_str();
+  if (log) log.returned().string(md);
+  return (char*)md;
 }
 
 NP_EXPORT(NPError)
 NP_GetValue(void* future, NPPVariable aVariable, void* aValue) {
-  Log log;
+  Log log(FN_NP_GetValue);
 
   if (!gInitialized) initialize();
-  log("NP_GetValue(%s)\n", NPPVariableName(aVariable));
-  NPError e = gExportedPluginFunctions.getValue(future, aVariable, aValue);
-  // FIXME: only print on success?
-  switch (aVariable) {
-    case NPPVpluginNameString:
-      log(" pluginName=%s\n", *(const char**)aValue);
-      break;
-    case NPPVpluginDescriptionString:
-      log(" pluginDescription=%s\n", *(const char**)aValue);
-      break;
-    case NPPVpluginWindowBool:
-      log(" pluginWindowBool=%d\n", *(bool*)aValue);
-      break;
-    case NPPVpluginTransparentBool:
-      log(" pluginTransparentBool=%d\n", *(bool*)aValue);
-      break;
-    default:
-      // we only print values we might care about
-      break;
+  if (log) log.call().pointer("future", future)
+      .symbol("aVariable", NPPVariableName(aVariable)).pointer("aValue", aValue);
+  // the name and description are asked for while scanning for plugins,
+  // answer those from the cache if we can
+  combinePluginInfo();
+  NPError e;
+  if (aVariable == NPPVpluginNameString && !gName.empty()) {
+    *(const char**)aValue = gName.c_str();
+    e = NPERR_NO_ERROR;
+  } else if (aVariable == NPPVpluginDescriptionString &&
+      !gDescription.empty()) {
+    *(const char**)aValue = gDescription.c_str();
+    e = NPERR_NO_ERROR;
+  } else {
+    PluginTarget* target = gTargets[0];
+    target->load();
+    if (target->mFunctions.getValue == NULL) {
+      if (log) log.returned().error(NPERR_GENERIC_ERROR);
+      return NPERR_GENERIC_ERROR;
+    }
+    e = target->mFunctions.getValue(future, aVariable, aValue);
+  }
+  // we only print values we might care about
+  if (!log) {
+  } else if (e == NPERR_NO_ERROR && (aVariable == NPPVpluginNameString ||
+        aVariable == NPPVpluginDescriptionString)) {
+    log.returned().error(e).string("value", *(const char**)aValue);
+  } else if (e == NPERR_NO_ERROR && (aVariable == NPPVpluginWindowBool ||
+        aVariable == NPPVpluginTransparentBool)) {
+    log.returned().error(e).boolean("value", *(bool*)aValue);
+  } else {
+    log.returned().error(e);
   }
-  log("NP_GetValue returned %s\n", NPErrorName(e));
 
   return e;
 }
@@ -1626,11 +6704,53 @@ NP_GetValue(void* future, NPPVariable aVariable, void* aValue) {
 NP_EXPORT(NPError)
 NP_Shutdown()
 {
-  Log log;
-
-  log("NP_Shutdown()\n");
-  NPError e = gExportedPluginFunctions.shutdown();
-  log(" returned %s\n", NPErrorName(e));
+  Log log(FN_NP_Shutdown);
+
+  if (log) log.call();
+  // a plugin might never have been loaded if its info was cached
+  NPError e = NPERR_NO_ERROR;
+  for (size_t i = 0; i < gTargets.size(); i++) {
+    PluginTarget* target = gTargets[i];
+    if (target->mFunctions.shutdown == NULL) continue;
+    NPError te = target->mFunctions.shutdown();
+    if (log) log.values().string("plugin", target->mPath.c_str())
+        .error("returned", te);
+    if (te != NPERR_NO_ERROR) e = te;
+    delete target->mPluginFuncs;
+    target->mPluginFuncs = NULL;
+  }
+  if (log) log.returned().error(e);
+  int dropped = AsyncCalls::reclaim(NULL);
+  if (log && dropped) log.values().integer("asyncCallsDropped", dropped);
+  if (log.traced()) {
+    for (size_t i = 0; i < gTargets.size(); i++) {
+      gTargets[i]->mClasses.report(log);
+    }
+    gHotObjects.report(log);
+    RedundantCalls::gWasted.report(log);
+    AsyncCalls::report(log);
+    WriteCoalescing::report(log);
+    BrowserValues::report(log);
+#ifdef MOZ_X11
+    XEvents::report(log);
+#endif
+  }
+  Log::flush("NP_Shutdown");
   return e;
 }
 
+/* set up tracing as soon as we're loaded */
+static void __attribute__((constructor))
+startup() {
+  TraceControl::initialize();
+  LiveStats::create();
+}
+
+/* write out anything still buffered when we're unloaded or the process
+ * exits */
+static void __attribute__((destructor))
+finalize() {
+  Log::flush("unload");
+  LiveStats::destroy();
+}
+
@@ -0,0 +1,70 @@
+/* pluginstats.h, the layout of pluginlogger's live stats segment
+ * Copyright 2009 Ian McKellar <http://ian.mckellar.org/>
+ * */
+
+/*  This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef pluginstats_h_
+#define pluginstats_h_
+
+#include <stdint.h>
+
+/* pluginlogger built with -DSTATS_SEGMENT=1 keeps these in a file under
+ * /dev/shm named after the browser's pid, for plugintop to map and read
+ * while the browser runs. The wrappers only ever add to the counters, with
+ * atomic operations, so readers see each counter go up but not the whole
+ * segment at one instant. Anything that changes the layout must change
+ * PLUGINSTATS_VERSION. */
+#define PLUGINSTATS_MAGIC 0x53474c50 /* "PLGS" */
+#define PLUGINSTATS_VERSION 1
+#define PLUGINSTATS_PREFIX "/dev/shm/pluginlogger."
+#define PLUGINSTATS_FUNCTIONS 128
+#define PLUGINSTATS_INSTANCES 32
+#define PLUGINSTATS_NAME_SIZE 48
+
+typedef struct {
+  char name[PLUGINSTATS_NAME_SIZE];
+  uint64_t calls;
+  uint64_t nanos; /* total time in the call */
+  uint64_t maxNanos;
+} PluginStatsFunction;
+
+typedef struct {
+  uint64_t id; /* the browser's NPP, set last, or 0 if this slot is free */
+  uint64_t created; /* CLOCK_MONOTONIC nanoseconds */
+  uint64_t streams;
+  uint64_t streamBytes;
+  uint64_t requests;
+  uint64_t invalidations;
+  uint64_t paints;
+  uint64_t paintNanos;
+  uint64_t timerFires;
+  char type[PLUGINSTATS_NAME_SIZE];
+} PluginStatsInstance;
+
+typedef struct {
+  uint32_t magic; /* written last, once the rest is ready */
+  uint32_t version;
+  uint32_t size; /* sizeof(PluginStatsSegment) */
+  uint32_t functionCount;
+  uint64_t pid;
+  uint64_t started; /* CLOCK_MONOTONIC nanoseconds */
+  uint64_t streamBytes;
+  uint64_t asyncCallsWaiting;
+  PluginStatsFunction functions[PLUGINSTATS_FUNCTIONS];
+  PluginStatsInstance instances[PLUGINSTATS_INSTANCES];
+} PluginStatsSegment;
+
+#endif /* pluginstats_h_ */
@@ -0,0 +1,287 @@
+/* plugintop, a live view of pluginlogger's stats segment
+ * Copyright 2009 Ian McKellar <http://ian.mckellar.org/>
+ * */
+
+/*  This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Attaches read-only to the segment a pluginlogger built with
+ * -DSTATS_SEGMENT=1 keeps under /dev/shm and shows NPAPI call rates and
+ * latencies, per-instance activity and stream throughput, refreshed every
+ * few seconds like top(1). */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "pluginstats.h"
+
+#define DEFAULT_DELAY 2.0
+#define DEFAULT_FUNCTIONS 20
+
+static uint64_t
+monotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+usage(const char* aProgram) {
+  fprintf(stderr, "usage: %s [-d seconds] [-n iterations] [-f functions] "
+      "[pid | segment]\n", aProgram);
+  fprintf(stderr, "  attaches to the newest " PLUGINSTATS_PREFIX
+      "* if no pid or segment is given\n");
+  exit(2);
+}
+
+/* the most recently modified segment, or an empty string if there isn't
+ * one */
+static std::string
+newestSegment() {
+  std::string prefix(PLUGINSTATS_PREFIX);
+  size_t slash = prefix.rfind('/');
+  std::string directory = prefix.substr(0, slash);
+  std::string name = prefix.substr(slash + 1);
+  std::string newest;
+  time_t newestTime = 0;
+  DIR* dir = opendir(directory.c_str());
+  if (dir == NULL) return newest;
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strncmp(entry->d_name, name.c_str(), name.size()) != 0) continue;
+    std::string path = directory + "/" + entry->d_name;
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && st.st_mtime >= newestTime) {
+      newest = path;
+      newestTime = st.st_mtime;
+    }
+  }
+  closedir(dir);
+  return newest;
+}
+
+static const PluginStatsSegment*
+attach(const std::string& aPath) {
+  int fd = open(aPath.c_str(), O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "plugintop: can't open %s: %s\n", aPath.c_str(),
+        strerror(errno));
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(PluginStatsSegment)) {
+    fprintf(stderr, "plugintop: %s is too small to be a stats segment\n",
+        aPath.c_str());
+    close(fd);
+    return NULL;
+  }
+  void* segment = mmap(NULL, sizeof(PluginStatsSegment), PROT_READ,
+      MAP_SHARED, fd, 0);
+  close(fd);
+  if (segment == MAP_FAILED) {
+    fprintf(stderr, "plugintop: can't map %s: %s\n", aPath.c_str(),
+        strerror(errno));
+    return NULL;
+  }
+  const PluginStatsSegment* stats = (const PluginStatsSegment*)segment;
+  // the logger writes the magic number last, so give it a moment
+  for (int i = 0; i < 10 && __atomic_load_n(&stats->magic,
+        __ATOMIC_ACQUIRE) != PLUGINSTATS_MAGIC; i++) {
+    usleep(100000);
+  }
+  if (stats->magic != PLUGINSTATS_MAGIC) {
+    fprintf(stderr, "plugintop: %s isn't a stats segment\n", aPath.c_str());
+    return NULL;
+  }
+  if (stats->version != PLUGINSTATS_VERSION ||
+      stats->size != sizeof(PluginStatsSegment) ||
+      stats->functionCount > PLUGINSTATS_FUNCTIONS) {
+    fprintf(stderr, "plugintop: %s is version %u (%u bytes), but this "
+        "plugintop reads version %u (%u bytes)\n", aPath.c_str(),
+        stats->version, stats->size, PLUGINSTATS_VERSION,
+        (unsigned)sizeof(PluginStatsSegment));
+    return NULL;
+  }
+  return stats;
+}
+
+/* copy the counters out one at a time, since the logger is still adding
+ * to them */
+static void
+sample(const PluginStatsSegment* aStats, PluginStatsSegment* aSample) {
+  memcpy(aSample, aStats, sizeof(PluginStatsSegment));
+  for (uint32_t f = 0; f < aStats->functionCount; f++) {
+    const PluginStatsFunction& from = aStats->functions[f];
+    PluginStatsFunction& to = aSample->functions[f];
+    to.calls = __atomic_load_n(&from.calls, __ATOMIC_RELAXED);
+    to.nanos = __atomic_load_n(&from.nanos, __ATOMIC_RELAXED);
+    to.maxNanos = __atomic_load_n(&from.maxNanos, __ATOMIC_RELAXED);
+  }
+  for (int i = 0; i < PLUGINSTATS_INSTANCES; i++) {
+    const PluginStatsInstance& from = aStats->instances[i];
+    PluginStatsInstance& to = aSample->instances[i];
+    to.id = __atomic_load_n(&from.id, __ATOMIC_ACQUIRE);
+    to.streamBytes = __atomic_load_n(&from.streamBytes, __ATOMIC_RELAXED);
+  }
+  aSample->streamBytes = __atomic_load_n(&aStats->streamBytes,
+      __ATOMIC_RELAXED);
+}
+
+/* a function's activity over one interval */
+typedef struct {
+  uint32_t mFunction;
+  uint64_t mCalls;
+  uint64_t mNanos;
+} Activity;
+
+static bool
+busier(const Activity& aA, const Activity& aB) {
+  if (aA.mCalls != aB.mCalls) return aA.mCalls > aB.mCalls;
+  return aA.mNanos > aB.mNanos;
+}
+
+static void
+show(const PluginStatsSegment& aNow, const PluginStatsSegment& aBefore,
+    double aSeconds, uint64_t aNanos, int aFunctions, bool aClear) {
+  if (aClear) printf("\033[H\033[J");
+  printf("plugintop - pid %llu, up %.0fs, %.1f KB/s streamed, "
+      "%llu async calls waiting\n\n", (unsigned long long)aNow.pid,
+      (aNanos - aNow.started) / 1e9,
+      (aNow.streamBytes - aBefore.streamBytes) / 1024.0 / aSeconds,
+      (unsigned long long)aNow.asyncCallsWaiting);
+
+  std::vector<Activity> activity;
+  for (uint32_t f = 0; f < aNow.functionCount; f++) {
+    Activity a;
+    a.mFunction = f;
+    a.mCalls = aNow.functions[f].calls - aBefore.functions[f].calls;
+    a.mNanos = aNow.functions[f].nanos - aBefore.functions[f].nanos;
+    if (a.mCalls > 0) activity.push_back(a);
+  }
+  std::sort(activity.begin(), activity.end(), busier);
+  printf("%-40s %10s %10s %10s %12s\n", "FUNCTION", "CALLS/S", "MEAN US",
+      "MAX US", "CALLS");
+  for (size_t i = 0; i < activity.size() && (int)i < aFunctions; i++) {
+    const PluginStatsFunction& function = aNow.functions[activity[i].mFunction];
+    printf("%-40.40s %10.1f %10.1f %10llu %12llu\n", function.name,
+        activity[i].mCalls / aSeconds,
+        activity[i].mNanos / 1000.0 / activity[i].mCalls,
+        (unsigned long long)function.maxNanos / 1000,
+        (unsigned long long)function.calls);
+  }
+  if (activity.empty()) printf("(no calls)\n");
+
+  printf("\n%-18s %-24s %7s %8s %9s %8s %9s %9s %9s %8s\n", "INSTANCE",
+      "TYPE", "AGE S", "STREAMS", "KB/S", "URLS", "INVAL/S", "PAINT/S",
+      "PAINT MS", "TIMERS/S");
+  bool any = false;
+  for (int i = 0; i < PLUGINSTATS_INSTANCES; i++) {
+    const PluginStatsInstance& now = aNow.instances[i];
+    if (now.id == 0) continue;
+    any = true;
+    PluginStatsInstance before;
+    // the slot may have been reused, even for the same NPP
+    if (aBefore.instances[i].id == now.id &&
+        aBefore.instances[i].created == now.created) {
+      before = aBefore.instances[i];
+    } else {
+      memset(&before, 0, sizeof(before));
+    }
+    uint64_t paints = now.paints - before.paints;
+    printf("0x%-16llx %-24.24s %7.0f %8llu %9.1f %8llu %9.1f %9.1f %9.2f "
+        "%8.1f\n", (unsigned long long)now.id, now.type,
+        (aNanos - now.created) / 1e9, (unsigned long long)now.streams,
+        (now.streamBytes - before.streamBytes) / 1024.0 / aSeconds,
+        (unsigned long long)now.requests,
+        (now.invalidations - before.invalidations) / aSeconds,
+        paints / aSeconds,
+        paints ? (now.paintNanos - before.paintNanos) / 1e6 / paints : 0.0,
+        (now.timerFires - before.timerFires) / aSeconds);
+  }
+  if (!any) printf("(no instances)\n");
+  fflush(stdout);
+}
+
+int
+main(int argc, char** argv) {
+  double delay = DEFAULT_DELAY;
+  int iterations = -1;
+  int functions = DEFAULT_FUNCTIONS;
+  int c;
+  while ((c = getopt(argc, argv, "d:n:f:h")) != -1) {
+    switch (c) {
+      case 'd': delay = atof(optarg); break;
+      case 'n': iterations = atoi(optarg); break;
+      case 'f': functions = atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  if (delay <= 0 || optind < argc - 1) usage(argv[0]);
+
+  std::string path;
+  if (optind < argc) {
+    const char* target = argv[optind];
+    char* end;
+    long pid = strtol(target, &end, 10);
+    if (*target != '\0' && *end == '\0') {
+      char buffer[64];
+      snprintf(buffer, sizeof(buffer), PLUGINSTATS_PREFIX "%ld", pid);
+      path = buffer;
+    } else {
+      path = target;
+    }
+  } else {
+    path = newestSegment();
+    if (path.empty()) {
+      fprintf(stderr, "plugintop: no " PLUGINSTATS_PREFIX "* segments - is "
+          "pluginlogger built with -DSTATS_SEGMENT=1?\n");
+      return 1;
+    }
+  }
+
+  const PluginStatsSegment* stats = attach(path);
+  if (stats == NULL) return 1;
+
+  bool clear = isatty(STDOUT_FILENO);
+  PluginStatsSegment* before = new PluginStatsSegment;
+  PluginStatsSegment* now = new PluginStatsSegment;
+  sample(stats, before);
+  uint64_t last = monotonicNanos();
+  for (int i = 0; iterations < 0 || i < iterations; i++) {
+    usleep((useconds_t)(delay * 1000000));
+    sample(stats, now);
+    uint64_t nanos = monotonicNanos();
+    show(*now, *before, (nanos - last) / 1e9, nanos, functions, clear);
+    if (kill((pid_t)now->pid, 0) < 0 && errno == ESRCH) {
+      printf("\nprocess %llu has exited\n", (unsigned long long)now->pid);
+      break;
+    }
+    std::swap(before, now);
+    last = nanos;
+  }
+  return 0;
+}
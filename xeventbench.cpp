@@ -0,0 +1,252 @@
+/* xeventbench, checks and times pluginlogger's X event decoding
+ * Copyright 2009 Ian McKellar <http://ian.mckellar.org/>
+ * */
+
+/*  This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Builds pluginlogger.cpp in so it can feed made-up XEvents, of the kinds
+ * a plugin gets through NPP_HandleEvent, to describeXEvent() and
+ * XEvents::record(). Run with --check to compare the descriptions and the
+ * per-type histograms against what they should be, and with no arguments
+ * to also time describing and recording a mix of events. */
+
+#include "pluginlogger.cpp"
+
+#define BENCH_EVENTS 1000000
+
+static XEvent
+graphicsExpose(int aX, int aY, int aWidth, int aHeight) {
+  XEvent event;
+  memset(&event, 0, sizeof(event));
+  event.xgraphicsexpose.type = GraphicsExpose;
+  event.xgraphicsexpose.drawable = 0x3a00007;
+  event.xgraphicsexpose.x = aX;
+  event.xgraphicsexpose.y = aY;
+  event.xgraphicsexpose.width = aWidth;
+  event.xgraphicsexpose.height = aHeight;
+  return event;
+}
+
+static XEvent
+expose(int aX, int aY, int aWidth, int aHeight, int aCount) {
+  XEvent event;
+  memset(&event, 0, sizeof(event));
+  event.xexpose.type = Expose;
+  event.xexpose.x = aX;
+  event.xexpose.y = aY;
+  event.xexpose.width = aWidth;
+  event.xexpose.height = aHeight;
+  event.xexpose.count = aCount;
+  return event;
+}
+
+static XEvent
+motion(int aX, int aY, unsigned aState) {
+  XEvent event;
+  memset(&event, 0, sizeof(event));
+  event.xmotion.type = MotionNotify;
+  event.xmotion.x = aX;
+  event.xmotion.y = aY;
+  event.xmotion.state = aState;
+  return event;
+}
+
+static XEvent
+button(int aType, unsigned aButton, int aX, int aY, unsigned aState) {
+  XEvent event;
+  memset(&event, 0, sizeof(event));
+  event.xbutton.type = aType;
+  event.xbutton.button = aButton;
+  event.xbutton.x = aX;
+  event.xbutton.y = aY;
+  event.xbutton.state = aState;
+  return event;
+}
+
+static XEvent
+key(int aType, unsigned aKeycode, unsigned aState) {
+  XEvent event;
+  memset(&event, 0, sizeof(event));
+  event.xkey.type = aType;
+  event.xkey.keycode = aKeycode;
+  event.xkey.state = aState;
+  return event;
+}
+
+static XEvent
+crossing(int aType, int aX, int aY) {
+  XEvent event;
+  memset(&event, 0, sizeof(event));
+  event.xcrossing.type = aType;
+  event.xcrossing.x = aX;
+  event.xcrossing.y = aY;
+  return event;
+}
+
+static XEvent
+plain(int aType) {
+  XEvent event;
+  memset(&event, 0, sizeof(event));
+  event.type = aType;
+  return event;
+}
+
+static int
+checkDescriptions() {
+  struct {
+    XEvent event;
+    const char* expected;
+  } cases[] = {
+    { graphicsExpose(0, 16, 640, 480),
+      "GraphicsExpose drawable=0x3a00007 x=0 y=16 width=640 height=480" },
+    { expose(5, 6, 7, 8, 2), "Expose x=5 y=6 width=7 height=8 count=2" },
+    { motion(-3, 200, 0x100), "MotionNotify x=-3 y=200 state=0x100" },
+    { button(ButtonPress, 1, 10, 20, 0x10),
+      "ButtonPress button=1 x=10 y=20 state=0x10" },
+    { button(ButtonRelease, 3, 0, 0, 0),
+      "ButtonRelease button=3 x=0 y=0 state=0x0" },
+    { key(KeyPress, 38, 0x4), "KeyPress keycode=38 state=0x4" },
+    { key(KeyRelease, 38, 0), "KeyRelease keycode=38 state=0x0" },
+    { crossing(EnterNotify, 1, 2), "EnterNotify x=1 y=2" },
+    { crossing(LeaveNotify, -1, -2), "LeaveNotify x=-1 y=-2" },
+    { plain(FocusIn), "FocusIn" },
+    { plain(ClientMessage), "ClientMessage" },
+    { plain(LASTEvent), "UNKNOWN XEvent" },
+  };
+  int failures = 0;
+  size_t count = sizeof(cases) / sizeof(cases[0]);
+  for (size_t i = 0; i < count; i++) {
+    char description[128];
+    describeXEvent(description, sizeof(description), &cases[i].event);
+    if (strcmp(description, cases[i].expected) != 0) {
+      fprintf(stderr, "event %u described as \"%s\", not \"%s\"\n",
+          (unsigned)i, description, cases[i].expected);
+      failures++;
+    }
+  }
+
+  // a buffer too small for the geometry still ends in a NUL
+  XEvent event = graphicsExpose(0, 0, 1, 1);
+  char small[16];
+  memset(small, 'x', sizeof(small));
+  describeXEvent(small, sizeof(small), &event);
+  if (strcmp(small, "GraphicsExpose ") != 0) {
+    fprintf(stderr, "short buffer holds \"%.*s\"\n", (int)sizeof(small),
+        small);
+    failures++;
+  }
+
+  printf("%u descriptions checked, %d failures\n", (unsigned)count + 1,
+      failures);
+  return failures;
+}
+
+static int
+checkDurations() {
+  int failures = 0;
+
+  // a type's histogram only exists once one of its events is recorded
+  if (XEvents::durations(ButtonPress) != NULL) {
+    fprintf(stderr, "ButtonPress has a histogram before any were recorded\n");
+    failures++;
+  }
+
+  XEvents::record(GraphicsExpose, 2000000);
+  XEvents::record(GraphicsExpose, 20000000);
+  XEvents::record(MotionNotify, 5000);
+  XEvents::record(KeyPress, 0);
+  // out of range types are dropped, not recorded somewhere else
+  XEvents::record(-1, 1);
+  XEvents::record(LASTEvent, 1);
+
+  struct {
+    int type;
+    uint64_t count;
+    uint64_t last;
+  } expected[] = {
+    { GraphicsExpose, 2, 20000000 },
+    { MotionNotify, 1, 5000 },
+    { KeyPress, 1, 0 },
+  };
+  size_t count = sizeof(expected) / sizeof(expected[0]);
+  for (size_t i = 0; i < count; i++) {
+    const Histogram* durations = XEvents::durations(expected[i].type);
+    if (durations == NULL) {
+      fprintf(stderr, "%s has no histogram\n",
+          XEventTypeName(expected[i].type));
+      failures++;
+    } else if (durations->count() != expected[i].count ||
+        durations->last() != expected[i].last) {
+      fprintf(stderr, "%s has %llu samples, last %llu, not %llu, last %llu\n",
+          XEventTypeName(expected[i].type),
+          (unsigned long long)durations->count(),
+          (unsigned long long)durations->last(),
+          (unsigned long long)expected[i].count,
+          (unsigned long long)expected[i].last);
+      failures++;
+    }
+  }
+
+  int types = 0;
+  for (int i = 0; i < LASTEvent; i++) {
+    if (XEvents::durations(i)) types++;
+  }
+  if (types != (int)count) {
+    fprintf(stderr, "%d types have histograms, not %u\n", types,
+        (unsigned)count);
+    failures++;
+  }
+  if (XEvents::durations(-1) != NULL || XEvents::durations(LASTEvent) != NULL) {
+    fprintf(stderr, "out of range types have histograms\n");
+    failures++;
+  }
+
+  printf("%u event types recorded, %d failures\n", (unsigned)count, failures);
+  return failures;
+}
+
+int
+main(int argc, char** argv) {
+  int failures = checkDescriptions() + checkDurations();
+  if (argc > 1 && strcmp(argv[1], "--check") == 0) {
+    return failures ? 1 : 0;
+  }
+
+  // mostly motion, with the paints and keys a Flash movie gets
+  XEvent events[] = {
+    motion(10, 10, 0), motion(11, 10, 0), motion(12, 11, 0),
+    graphicsExpose(0, 0, 640, 480), key(KeyPress, 38, 0),
+    key(KeyRelease, 38, 0), button(ButtonPress, 1, 12, 11, 0),
+    plain(FocusIn),
+  };
+  size_t count = sizeof(events) / sizeof(events[0]);
+  char description[128];
+  uint64_t start = monotonicNanos();
+  for (int n = 0; n < BENCH_EVENTS; n++) {
+    const XEvent& event = events[n % count];
+    describeXEvent(description, sizeof(description), &event);
+    __asm__ __volatile__("" : : "r"(description) : "memory");
+  }
+  uint64_t describing = monotonicNanos() - start;
+  start = monotonicNanos();
+  for (int n = 0; n < BENCH_EVENTS; n++) {
+    XEvents::record(events[n % count].type, n & 0xffff);
+  }
+  uint64_t recording = monotonicNanos() - start;
+  printf("\n%-12s %8.1f ns/event\n%-12s %8.1f ns/event\n", "describe",
+      describing / (double)BENCH_EVENTS, "record",
+      recording / (double)BENCH_EVENTS);
+  return failures ? 1 : 0;
+}